@@ -0,0 +1,277 @@
+// Interrupt Latency Benchmark for Safe Kernel Module
+// Assignment 2 - OS Fall 2025
+//
+// Measures what heavy queue traffic does to the rest of the system, and
+// the traffic's own throughput, in two phases of equal length:
+//   idle - nothing but the probe below
+//   load - producer threads writing to /dev/safe_lkm, consumer threads
+//          draining it (SAFE_LKM_IOC_DRAIN, long lock holds) and a reader
+//          of /proc/safe_lkm_queues, all at once
+// The probe is a thread that sleeps on an absolute 500 us timer and
+// records how late each wake-up is. A timer interrupt that arrives while a
+// CPU has interrupts disabled is delayed until they are enabled again, so
+// long IRQs-off sections show up in the probe's tail. As root, the probe
+// runs SCHED_FIFO and, when the kernel has the irqsoff tracer, the longest
+// IRQs-off section of each phase is read from it as well (system wide, not
+// only this module).
+//
+// Compare builds of the module: queue locks taken with spin_lock_irqsave
+// keep interrupts off for whole list walks; plain spinlocks (the current
+// code) do not, which moves the load row's tail and irqsoff column.
+//
+// Usage: ./bench_irqlat [seconds_per_phase] [threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include "safe_lkm_uapi.h"
+
+#define TRACING "/sys/kernel/tracing/"
+#define PERIOD_NS 500000L
+#define MAX_SAMPLES 200000
+#define MAX_THREADS 32
+#define GREEN "\033[0;32m"
+#define RED "\033[0;31m"
+#define RESET "\033[0m"
+#define YELLOW "\033[0;33m"
+#define BLUE "\033[0;34m"
+
+static volatile int stop;
+static long sent, received;
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long ts_ns(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Tracing files are optional: every helper fails quietly without them
+static int write_file(const char *path, const char *val) {
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    int ok = fd >= 0 && write(fd, val, strlen(val)) == (ssize_t)strlen(val);
+    if (fd >= 0) close(fd);
+    return ok ? 0 : -1;
+}
+
+static long read_long(const char *path) {
+    FILE *fp = fopen(path, "r");
+    long v = -1;
+    if (fp) {
+        if (fscanf(fp, "%ld", &v) != 1) v = -1;
+        fclose(fp);
+    }
+    return v;
+}
+
+static int irqsoff_available(void) {
+    char buf[4096] = "";
+    FILE *fp = fopen(TRACING "available_tracers", "r");
+    if (!fp) return 0;
+    if (!fgets(buf, sizeof(buf), fp)) buf[0] = '\0';
+    fclose(fp);
+    return strstr(buf, "irqsoff") != NULL;
+}
+
+static void *producer_main(void *arg) {
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[64];
+    } msg;
+    int fd = open(SAFE_LKM_DEV_PATH, O_WRONLY | O_NONBLOCK);
+    long n = 0;
+
+    if (fd < 0) return NULL;
+    msg.hdr.pid = getpid();
+    memset(msg.payload, 'x', sizeof(msg.payload));
+    for (int i = 0; !stop; i++) {
+        msg.hdr.type = i % 10;
+        msg.hdr.len = 16 + i % 48;
+        if (write(fd, &msg, sizeof(msg.hdr) + msg.hdr.len) > 0)
+            n++;
+        else if (errno == EAGAIN)
+            sched_yield();
+    }
+    close(fd);
+    pthread_mutex_lock(&count_lock);
+    sent += n;
+    pthread_mutex_unlock(&count_lock);
+    return NULL;
+}
+
+static void *consumer_main(void *arg) {
+    size_t size = 1 << 20;
+    char *buf = malloc(size);
+    struct safe_lkm_drain req;
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDONLY);
+    __s32 timeout = 10;
+    long n = 0;
+    int got;
+
+    if (fd < 0 || !buf) {
+        if (fd >= 0) close(fd);
+        free(buf);
+        return NULL;
+    }
+    ioctl(fd, SAFE_LKM_IOC_SET_RCVTIMEO, &timeout);
+    while (!stop) {
+        req = (struct safe_lkm_drain){ .buf = (__u64)(unsigned long)buf, .len = size };
+        got = ioctl(fd, SAFE_LKM_IOC_DRAIN, &req);
+        if (got > 0) n += got;
+    }
+    close(fd);
+    free(buf);
+    pthread_mutex_lock(&count_lock);
+    received += n;
+    pthread_mutex_unlock(&count_lock);
+    return NULL;
+}
+
+static void *proc_reader_main(void *arg) {
+    char buf[8192];
+    while (!stop) {
+        int fd = open("/proc/safe_lkm_queues", O_RDONLY);
+        if (fd < 0) break;
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+        close(fd);
+        usleep(1000);
+    }
+    return NULL;
+}
+
+struct probe {
+    long *late;               // Wake-up lateness per sample, ns
+    int n;
+};
+
+static void *probe_main(void *arg) {
+    struct probe *p = arg;
+    struct sched_param sp = { .sched_priority = 50 };
+    struct timespec next, now;
+
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);   // Root only
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!stop && p->n < MAX_SAMPLES) {
+        next.tv_nsec += PERIOD_NS;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        p->late[p->n++] = ts_ns(&now) - ts_ns(&next);
+    }
+    return NULL;
+}
+
+// Run one phase; threads == 0 is the idle phase
+static void run_phase(const char *name, int seconds, int threads, int tracer) {
+    pthread_t probe_thread, prod[MAX_THREADS], cons[MAX_THREADS], reader;
+    struct probe p = { .late = malloc(MAX_SAMPLES * sizeof(long)) };
+    long irqsoff = -1;
+
+    stop = 0;
+    sent = received = 0;
+    if (tracer) {
+        write_file(TRACING "tracing_max_latency", "0");
+        write_file(TRACING "current_tracer", "irqsoff");
+    }
+
+    pthread_create(&probe_thread, NULL, probe_main, &p);
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&prod[i], NULL, producer_main, NULL);
+        pthread_create(&cons[i], NULL, consumer_main, NULL);
+    }
+    if (threads)
+        pthread_create(&reader, NULL, proc_reader_main, NULL);
+
+    sleep(seconds);
+    stop = 1;
+    pthread_join(probe_thread, NULL);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(prod[i], NULL);
+        pthread_join(cons[i], NULL);
+    }
+    if (threads)
+        pthread_join(reader, NULL);
+
+    if (tracer) {
+        irqsoff = read_long(TRACING "tracing_max_latency");
+        write_file(TRACING "current_tracer", "nop");
+    }
+
+    qsort(p.late, p.n, sizeof(long), cmp_long);
+    printf("  %-6s %10.0f %10.0f %8.1f %8.1f %8.1f %8.1f ", name,
+           sent / (double)seconds, received / (double)seconds,
+           p.n ? p.late[p.n / 2] / 1e3 : 0,
+           p.n ? p.late[(long)(p.n * 0.99)] / 1e3 : 0,
+           p.n ? p.late[(long)(p.n * 0.9999)] / 1e3 : 0,
+           p.n ? p.late[p.n - 1] / 1e3 : 0);
+    if (irqsoff >= 0)
+        printf("%9ld\n", irqsoff);
+    else
+        printf("%9s\n", "-");
+    free(p.late);
+}
+
+// Receive whatever the load phase left behind
+static void drain_queue(void) {
+    static char buf[1 << 20];
+    struct safe_lkm_drain req;
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDONLY | O_NONBLOCK);
+
+    if (fd < 0) return;
+    do {
+        req = (struct safe_lkm_drain){ .buf = (__u64)(unsigned long)buf, .len = sizeof(buf) };
+    } while (ioctl(fd, SAFE_LKM_IOC_DRAIN, &req) > 0);
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    int threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("\n");
+    printf("========================================\n");
+    printf("  Safe Kernel Module - IRQ Latency\n");
+    printf("  OS Assignment 2 - Fall 2025\n");
+    printf("========================================\n");
+
+    if (access(SAFE_LKM_DEV_PATH, F_OK) != 0) {
+        printf("\n%sERROR: Module not loaded. Please run: sudo insmod safe_lkm.ko%s\n", RED, RESET);
+        return 1;
+    }
+    if (seconds < 1) seconds = 1;
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+    int tracer = geteuid() == 0 && irqsoff_available();
+    if (!tracer)
+        printf("\n%sirqsoff tracer unavailable (needs root and CONFIG_IRQSOFF_TRACER): "
+               "probe only%s\n", YELLOW, RESET);
+
+    printf("\n%s%d s per phase, %d producer(s) + %d consumer(s), probe every %ld us%s\n",
+           BLUE, seconds, threads, threads, PERIOD_NS / 1000, RESET);
+    printf("  %-6s %10s %10s %8s %8s %8s %8s %9s\n", "phase", "sent/s", "recv/s",
+           "p50 us", "p99 us", "p9999", "max us", "irqsoff");
+
+    run_phase("idle", seconds, 0, tracer);
+    run_phase("load", seconds, threads, tracer);
+    drain_queue();
+
+    printf("\n%sDone.%s Late wake-ups are probe timer latency; irqsoff is the kernel's\n"
+           "longest interrupts-disabled section in us.\n\n", GREEN, RESET);
+    return 0;
+}
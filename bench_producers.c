@@ -0,0 +1,174 @@
+// Multi-Producer Send Benchmark for Safe Kernel Module
+// Assignment 2 - OS Fall 2025
+//
+// Measures messages/sec through /dev/safe_lkm as the number of producer
+// threads grows, with per-CPU staging off and on. Switching the mode needs
+// write access to /sys/module/safe_lkm/parameters/percpu_staging (root);
+// otherwise only the currently configured mode is measured.
+//
+// Usage: ./bench_producers [max_producers] [messages_per_producer]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include "safe_lkm_uapi.h"
+
+#define STAGING_PARAM "/sys/module/safe_lkm/parameters/percpu_staging"
+#define GREEN "\033[0;32m"
+#define RED "\033[0;31m"
+#define RESET "\033[0m"
+#define YELLOW "\033[0;33m"
+#define BLUE "\033[0;34m"
+
+struct producer {
+    pthread_t thread;
+    int id;
+    int count;
+    int sent;
+};
+
+static pthread_barrier_t start_barrier;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *producer_main(void *arg) {
+    struct producer *p = arg;
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[32];
+    } msg;
+
+    int fd = open(SAFE_LKM_DEV_PATH, O_WRONLY);
+    pthread_barrier_wait(&start_barrier);
+    if (fd < 0) return NULL;
+
+    msg.hdr.pid = 60000 + p->id;
+    for (int i = 0; i < p->count; i++) {
+        msg.hdr.type = i % 10;
+        msg.hdr.len = snprintf(msg.payload, sizeof(msg.payload), "P%d_%d", p->id, i);
+        if (write(fd, &msg, sizeof(msg.hdr) + msg.hdr.len) < 0) break;
+        p->sent++;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Empty the queue between runs so every run starts from the same state
+static void drain_queue(void) {
+    static struct safe_lkm_desc descs[SAFE_LKM_BATCH_MAX];
+    static char buf[64];
+    struct safe_lkm_batch req = { .descs = (__u64)(unsigned long)descs,
+                                  .count = SAFE_LKM_BATCH_MAX };
+
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) return;
+    for (int i = 0; i < SAFE_LKM_BATCH_MAX; i++) {
+        descs[i].len = sizeof(buf);
+        descs[i].buf = (__u64)(unsigned long)buf;
+    }
+    while (ioctl(fd, SAFE_LKM_IOC_RECV_BATCH, &req) > 0)
+        ;
+    close(fd);
+}
+
+// Returns messages/sec for one run with nprod producers
+static double run_producers(int nprod, int per_producer) {
+    struct producer *prods = calloc(nprod, sizeof(*prods));
+    long total = 0;
+
+    pthread_barrier_init(&start_barrier, NULL, nprod + 1);
+    for (int i = 0; i < nprod; i++) {
+        prods[i].id = i;
+        prods[i].count = per_producer;
+        pthread_create(&prods[i].thread, NULL, producer_main, &prods[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    double start = now_sec();
+    for (int i = 0; i < nprod; i++) {
+        pthread_join(prods[i].thread, NULL);
+        total += prods[i].sent;
+    }
+    double elapsed = now_sec() - start;
+
+    pthread_barrier_destroy(&start_barrier);
+    free(prods);
+    drain_queue();
+    return elapsed > 0 ? total / elapsed : 0;
+}
+
+static int read_staging(void) {
+    FILE *fp = fopen(STAGING_PARAM, "r");
+    int c = fp ? fgetc(fp) : EOF;
+    if (fp) fclose(fp);
+    return c == 'Y' || c == '1';
+}
+
+static int write_staging(int on) {
+    FILE *fp = fopen(STAGING_PARAM, "w");
+    if (!fp) return -1;
+    fprintf(fp, "%d", on);
+    return fclose(fp);
+}
+
+int main(int argc, char **argv) {
+    int max_prod = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int per_producer = argc > 2 ? atoi(argv[2]) : 100000;
+
+    printf("\n");
+    printf("========================================\n");
+    printf("  Safe Kernel Module - Producer Scaling\n");
+    printf("  OS Assignment 2 - Fall 2025\n");
+    printf("========================================\n");
+
+    if (access(SAFE_LKM_DEV_PATH, F_OK) != 0) {
+        printf("\n%sERROR: Module not loaded. Please run: sudo insmod safe_lkm.ko%s\n", RED, RESET);
+        return 1;
+    }
+    if (max_prod < 1) max_prod = 1;
+
+    int original = read_staging();
+    int modes[2] = { 0, 1 };
+    int nmodes = 2;
+    if (write_staging(original) != 0) {
+        printf("%sNote: cannot switch %s, measuring current mode only%s\n",
+               YELLOW, STAGING_PARAM, RESET);
+        modes[0] = original;
+        nmodes = 1;
+    }
+
+    drain_queue();
+    printf("\n%s%d messages per producer%s\n", BLUE, per_producer, RESET);
+    printf("  %-10s", "producers");
+    for (int m = 0; m < nmodes; m++)
+        printf(" %18s", modes[m] ? "staging msg/s" : "global lock msg/s");
+    printf("\n");
+
+    // 1, 2, 4, ... and finally max_prod itself
+    for (int nprod = 1; ; nprod *= 2) {
+        if (nprod > max_prod) nprod = max_prod;
+        printf("  %-10d", nprod);
+        for (int m = 0; m < nmodes; m++) {
+            if (nmodes > 1) write_staging(modes[m]);
+            printf(" %18.0f", run_producers(nprod, per_producer));
+            fflush(stdout);
+        }
+        printf("\n");
+        if (nprod == max_prod) break;
+    }
+
+    if (nmodes > 1) write_staging(original);
+    printf("\n%sDone.%s\n\n", GREEN, RESET);
+    return 0;
+}
@@ -0,0 +1,376 @@
+// Queue Core Microbenchmark for Safe Kernel Module
+// Assignment 2 - OS Fall 2025
+//
+// Builds the module's queue core (safe_lkm_queue.h) in user space over
+// safe_lkm_shim.h, so it needs no module, root or kernel headers:
+//   1. ns/op for enqueue and dequeue on one thread, single and batched
+//   2. Throughput: N producer threads, 1 consumer thread
+//   3. Per-call latency percentiles, with 1 and with N producers, and the
+//      queue's own residence-time histograms for the same runs
+// Every run checks that each message is received exactly once.
+//
+// Options mirror the module parameters of the same name:
+//   -l prio_levels  -r normal_ring_size  -s (percpu_staging=1)
+//   -w (dequeue_policy=1)  -a age_deadline_ms
+//   -N nodes (numa_shards=1 on that many fake NUMA nodes, CPU c on node
+//      c % nodes): senders use their node's shard, the consumer picks one
+//
+// Usage: ./bench_queue [-t max_producers] [-n messages] [-l levels]
+//                      [-r ring_size] [-s] [-w] [-a ms] [-N nodes]
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "safe_lkm_uapi.h"
+
+// Tunables read by the queue core (module parameters in the kernel)
+static bool percpu_staging;
+static unsigned int dequeue_policy;
+static unsigned int level_weights[SAFE_LKM_PRIO_MAX];
+static int nr_level_weights;
+static unsigned int age_deadline_ms;
+static bool numa_shards;
+
+#include "safe_lkm_queue.h"
+
+#define GREEN "\033[0;32m"
+#define RED "\033[0;31m"
+#define RESET "\033[0m"
+#define YELLOW "\033[0;33m"
+#define BLUE "\033[0;34m"
+
+#define MAX_PRODUCERS 64
+#define BATCH 64
+
+static void demo_free_msg(struct demo_msg *m) {
+    free(m);
+}
+
+// Stand-in for demo_alloc_msg(): an inline-payload message
+static struct demo_msg *new_msg(struct demo_queue *q, int pid, int type) {
+    struct demo_msg *m = malloc(MSG_OBJ_SIZE);
+
+    m->pid = pid;
+    m->type = type;
+    m->len = 8;
+    m->level = demo_type_level(q, type);
+    m->expires_ns = 0;
+    m->data = m->inline_data;
+    memcpy(m->data, "payload!", 8);
+    INIT_LIST_HEAD(&m->list);
+    return m;
+}
+
+static struct demo_queue *new_queue(unsigned int levels, unsigned int ring_size) {
+    struct safe_lkm_queue_attr attr = {
+        .name = "bench",
+        .prio_levels = levels,
+        .ring_size = ring_size,
+    };
+    struct demo_queue *q = demo_queue_alloc(&attr);
+
+    if (IS_ERR(q)) {
+        fprintf(stderr, "%sdemo_queue_alloc: %s%s\n", RED, strerror(-PTR_ERR(q)), RESET);
+        exit(1);
+    }
+    return q;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Value at percentile p (0..100) of n sorted samples
+static u64 pct(const u64 *sorted, long n, double p) {
+    long i = (long)(p / 100.0 * (n - 1) + 0.5);
+    return n ? sorted[i] : 0;
+}
+
+// ---------------------------------------------------------------------------
+// 1. Single-Thread Cost
+// ---------------------------------------------------------------------------
+
+// Queue up to `round` messages, then drain them, until n have gone through;
+// a round never exceeds normal_ring_size, so no send sees a full ring
+static int single_thread(unsigned int levels, unsigned int ring_size, long n) {
+    struct demo_queue *q = new_queue(levels, ring_size), *local = demo_local_shard(q);
+    long round = ring_size && ring_size < 4096 ? ring_size : 4096;
+    struct demo_msg **msgs = malloc(round * sizeof(*msgs));
+    struct demo_batch *b = demo_batch_alloc();
+    struct demo_msg *m, *tmp;
+    u64 enq = 0, deq = 0, benq = 0, bdeq = 0, t0;
+    long sent = 0, got = 0;
+    u32 level;
+
+    printf("\n%sSingle thread, %ld messages, types 0..9, rounds of %ld%s\n",
+           BLUE, n, round, RESET);
+
+    for (long done = 0; done < n; done += round) {
+        long k = min(round, n - done);
+
+        for (long i = 0; i < k; i++)
+            msgs[i] = new_msg(q, 1, i % 10);
+        t0 = ktime_get_ns();
+        for (long i = 0; i < k; i++)
+            sent += demo_enqueue_msg(local, msgs[i], true) == 0;
+        enq += ktime_get_ns() - t0;
+
+        long r = 0;
+        t0 = ktime_get_ns();
+        while (r < k && demo_queue_receive(demo_pick_shard(q), &msgs[r]) == 0)
+            r++;
+        deq += ktime_get_ns() - t0;
+        for (long i = 0; i < r; i++)
+            demo_free_msg(msgs[i]);
+        got += r;
+
+        // Batched, the SEND_BATCH / RECV_BATCH shape: admit and collect,
+        // splice once; detach once, free outside the lock
+        for (long i = 0; i < k; i++)
+            msgs[i] = new_msg(q, 1, i % 10);
+        t0 = ktime_get_ns();
+        for (long i = 0; i < k; i += BATCH) {
+            for (long j = i; j < k && j < i + BATCH; j++) {
+                if (demo_admit(local, msgs[j], true, NULL) == 0) {
+                    demo_batch_add(b, msgs[j]);
+                    sent++;
+                }
+            }
+            demo_enqueue_batch(local, b);
+        }
+        benq += ktime_get_ns() - t0;
+
+        t0 = ktime_get_ns();
+        for (long i = 0; i < k; i += BATCH) {
+            got += demo_detach_batch(demo_pick_shard(q), b, BATCH);
+            for_each_set_bit(level, b->used, SAFE_LKM_PRIO_MAX) {
+                list_for_each_entry_safe(m, tmp, &b->lists[level], list)
+                    demo_free_msg(m);
+            }
+            demo_batch_init(b);
+        }
+        bdeq += ktime_get_ns() - t0;
+    }
+
+    printf("  %-24s %8.1f ns/op\n", "enqueue", (double)enq / n);
+    printf("  %-24s %8.1f ns/op\n", "dequeue", (double)deq / n);
+    printf("  %-24s %8.1f ns/op\n", "enqueue, batches of 64", (double)benq / n);
+    printf("  %-24s %8.1f ns/op\n", "dequeue, batches of 64", (double)bdeq / n);
+
+    kfree(b);
+    free(msgs);
+    demo_queue_free(q);
+    return sent == 2 * n && got == 2 * n ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------
+// 2./3. Producers and One Consumer
+// ---------------------------------------------------------------------------
+
+struct run {
+    struct demo_queue *q;
+    long per_producer;
+    bool record;              // Time every call
+    pthread_barrier_t start;
+};
+
+struct producer {
+    pthread_t thread;
+    struct run *run;
+    int id;
+    struct demo_msg **msgs;   // Allocated before the start barrier
+    u64 *lat;                 // Per-call enqueue cost (record)
+};
+
+static void *producer_main(void *arg) {
+    struct producer *p = arg;
+    struct run *r = p->run;
+
+    pthread_barrier_wait(&r->start);
+    for (long i = 0; i < r->per_producer; i++) {
+        u64 t0 = r->record ? ktime_get_ns() : 0;
+
+        // A full ring is back-pressure: retry until the consumer catches up
+        while (demo_enqueue_msg(demo_local_shard(r->q), p->msgs[i], true) == -EAGAIN)
+            sched_yield();
+        if (r->record)
+            p->lat[i] = ktime_get_ns() - t0;
+    }
+    return NULL;
+}
+
+// Run nprod producers against a consumer on the calling thread
+// Returns: messages/sec, or -1 if a message was lost or duplicated. With
+// enq_lat set, fills enq_lat/deq_lat (sorted) with the per-call costs and
+// resid[LL_BUCKETS] with the queue's residence histogram, both classes.
+static double run_producers(unsigned int levels, unsigned int ring_size, int nprod,
+                            long per_producer, u64 *enq_lat, u64 *deq_lat, u64 *resid) {
+    struct producer prods[MAX_PRODUCERS];
+    struct run r = { .per_producer = per_producer, .record = enq_lat != NULL };
+    long total = nprod * per_producer, got = 0;
+    long *seen = calloc(nprod, sizeof(*seen));
+    struct demo_msg *m;
+    int ok = 1;
+
+    r.q = new_queue(levels, ring_size);
+    pthread_barrier_init(&r.start, NULL, nprod + 1);
+    for (int i = 0; i < nprod; i++) {
+        prods[i] = (struct producer){ .run = &r, .id = i };
+        prods[i].msgs = malloc(per_producer * sizeof(*prods[i].msgs));
+        prods[i].lat = r.record ? enq_lat + i * per_producer : NULL;
+        for (long j = 0; j < per_producer; j++)
+            prods[i].msgs[j] = new_msg(r.q, i, (int)(j % 10));
+        pthread_create(&prods[i].thread, NULL, producer_main, &prods[i]);
+    }
+
+    pthread_barrier_wait(&r.start);
+    u64 t0 = ktime_get_ns();
+    while (got < total) {
+        u64 c0 = r.record ? ktime_get_ns() : 0;
+        if (demo_queue_receive(demo_pick_shard(r.q), &m) != 0) {
+            sched_yield();
+            continue;
+        }
+        if (r.record)
+            deq_lat[got] = ktime_get_ns() - c0;
+        if (m->pid < 0 || m->pid >= nprod)
+            ok = 0;
+        else
+            seen[m->pid]++;
+        demo_free_msg(m);
+        got++;
+    }
+    u64 elapsed = ktime_get_ns() - t0;
+
+    for (int i = 0; i < nprod; i++) {
+        pthread_join(prods[i].thread, NULL);
+        free(prods[i].msgs);
+        if (seen[i] != per_producer) ok = 0;
+    }
+    if (demo_queue_depth(r.q) != 0) ok = 0;           // Nothing extra
+
+    if (r.record) {
+        u64 hist[LL_BUCKETS];
+
+        memset(resid, 0, sizeof(hist));
+        for (int class = 0; class < NR_CLASSES; class++) {
+            demo_lat_read(r.q, LAT_RESIDENCE + class, hist);
+            for (int b = 0; b < LL_BUCKETS; b++)
+                resid[b] += hist[b];
+        }
+    }
+
+    pthread_barrier_destroy(&r.start);
+    demo_queue_free(r.q);
+    free(seen);
+
+    if (r.record) {
+        qsort(enq_lat, total, sizeof(u64), cmp_u64);
+        qsort(deq_lat, total, sizeof(u64), cmp_u64);
+    }
+    if (!ok) return -1;
+    return elapsed ? total * 1e9 / elapsed : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t max_producers] [-n messages] [-l levels] "
+            "[-r ring_size] [-s] [-w] [-a ms] [-N nodes]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int max_prod = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long n = 1000000;
+    unsigned int levels = 2, ring_size = 0;
+    int failures = 0, opt;
+
+    while ((opt = getopt(argc, argv, "t:n:l:r:swa:N:")) != -1) {
+        switch (opt) {
+        case 't': max_prod = atoi(optarg); break;
+        case 'n': n = atol(optarg); break;
+        case 'l': levels = atoi(optarg); break;
+        case 'r': ring_size = atoi(optarg); break;
+        case 's': percpu_staging = true; break;
+        case 'w': dequeue_policy = POLICY_WRR; break;
+        case 'a': age_deadline_ms = atoi(optarg); break;
+        case 'N':
+            shim_nr_nodes = atoi(optarg);
+            if (shim_nr_nodes < 1) usage(argv[0]);
+            numa_shards = shim_nr_nodes > 1;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (max_prod < 1) max_prod = 1;
+    if (max_prod > MAX_PRODUCERS) max_prod = MAX_PRODUCERS;
+    if (n < BATCH) n = BATCH;
+
+    printf("\n");
+    printf("========================================\n");
+    printf("  Safe Kernel Module - Queue Core\n");
+    printf("  OS Assignment 2 - Fall 2025\n");
+    printf("========================================\n");
+    printf("\nprio_levels=%u normal_ring_size=%u percpu_staging=%d dequeue_policy=%u age_deadline_ms=%u numa_nodes=%d\n",
+           levels, ring_size, percpu_staging, dequeue_policy, age_deadline_ms,
+           numa_shards ? shim_nr_nodes : 1);
+
+    failures += single_thread(levels, ring_size, n);
+
+    // Every producer count moves the same total number of messages
+    printf("\n%s%ld messages in total, N producers, 1 consumer%s\n", BLUE, n, RESET);
+    printf("  %-10s %14s\n", "producers", "msgs/s");
+    for (int nprod = 1; ; nprod *= 2) {
+        if (nprod > max_prod) nprod = max_prod;
+        double rate = run_producers(levels, ring_size, nprod, n / nprod, NULL, NULL, NULL);
+        printf("  %-10d %14.0f\n", nprod, rate);
+        if (rate < 0) failures++;
+        if (nprod == max_prod) break;
+    }
+
+    // "resident" is time from admission to dequeue, from the queue's own
+    // log-linear histograms (bucket upper bounds, 12.5% resolution)
+    printf("\n%sPer-call latency, ns (includes ~2 clock reads)%s\n", BLUE, RESET);
+    printf("  %-10s %-8s %8s %8s %8s %8s %10s\n",
+           "producers", "call", "p50", "p90", "p99", "p99.9", "max");
+    int counts[2] = { 1, max_prod };
+    for (int c = 0; c < (max_prod > 1 ? 2 : 1); c++) {
+        long per = n / counts[c], total = per * counts[c];
+        u64 *enq = malloc(total * sizeof(u64)), *deq = malloc(total * sizeof(u64));
+        u64 resid[LL_BUCKETS];
+
+        if (run_producers(levels, ring_size, counts[c], per, enq, deq, resid) < 0) {
+            failures++;
+        } else {
+            const char *names[2] = { "enqueue", "dequeue" };
+            u64 *lat[2] = { enq, deq };
+            for (int k = 0; k < 2; k++)
+                printf("  %-10d %-8s %8llu %8llu %8llu %8llu %10llu\n", counts[c], names[k],
+                       (unsigned long long)pct(lat[k], total, 50),
+                       (unsigned long long)pct(lat[k], total, 90),
+                       (unsigned long long)pct(lat[k], total, 99),
+                       (unsigned long long)pct(lat[k], total, 99.9),
+                       (unsigned long long)lat[k][total - 1]);
+            printf("  %-10d %-8s %8llu %8llu %8llu %8llu %10llu\n", counts[c], "resident",
+                   (unsigned long long)demo_ll_percentile(resid, total, 500),
+                   (unsigned long long)demo_ll_percentile(resid, total, 900),
+                   (unsigned long long)demo_ll_percentile(resid, total, 990),
+                   (unsigned long long)demo_ll_percentile(resid, total, 999),
+                   (unsigned long long)demo_ll_percentile(resid, total, 1000));
+        }
+        free(enq);
+        free(deq);
+    }
+
+    if (failures) {
+        printf("\n%s%d failure(s): messages lost or duplicated%s\n\n", RED, failures, RESET);
+        return 1;
+    }
+    printf("\n%sDone.%s\n\n", GREEN, RESET);
+    return 0;
+}
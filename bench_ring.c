@@ -0,0 +1,256 @@
+// Lock-Free Ring Benchmark and Fuzzer for Safe Kernel Module
+// Assignment 2 - OS Fall 2025
+//
+// Builds safe_lkm_ring.h in user space, so no module needs to be loaded.
+//   1. Fuzz: random producer counts, ring sizes and burst lengths; checks
+//      that every item arrives exactly once and in order per producer.
+//   2. Benchmark: N producers, 1 consumer, ring vs. mutex-protected list
+//      (the same shape as the module's normal lane with the global lock).
+//
+// Usage: ./bench_ring [max_producers] [items_per_producer] [fuzz_rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "safe_lkm_ring.h"
+
+#define GREEN "\033[0;32m"
+#define RED "\033[0;31m"
+#define RESET "\033[0m"
+#define YELLOW "\033[0;33m"
+#define BLUE "\033[0;34m"
+
+#define MAX_PRODUCERS 64
+#define EMPTY_SPINS 64      // Empty pops before the consumer yields the CPU
+
+// Items carry producer id and sequence number, encoded in the pointer value
+#define ITEM(p, seq)   ((void *)(((unsigned long)(seq) << 8 | (p)) + 1))
+#define ITEM_PROD(it)  (((unsigned long)(it) - 1) & 0xff)
+#define ITEM_SEQ(it)   (((unsigned long)(it) - 1) >> 8)
+
+// Baseline: singly linked FIFO under one mutex
+struct list_node {
+    struct list_node *next;
+    void *item;
+};
+
+struct locked_list {
+    pthread_mutex_t lock;
+    struct list_node *head, *tail;
+};
+
+enum backend { BACKEND_RING, BACKEND_LIST };
+
+struct run {
+    enum backend backend;
+    struct safe_lkm_ring ring;
+    struct locked_list list;
+    int nprod;
+    long per_producer;
+    int max_burst;            // Fuzz: producers yield after random bursts
+    pthread_barrier_t start;
+};
+
+struct producer {
+    pthread_t thread;
+    struct run *run;
+    int id;
+    unsigned int seed;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void list_push(struct locked_list *l, void *item) {
+    struct list_node *n = malloc(sizeof(*n));
+    n->next = NULL;
+    n->item = item;
+    pthread_mutex_lock(&l->lock);
+    if (l->tail) l->tail->next = n;
+    else l->head = n;
+    l->tail = n;
+    pthread_mutex_unlock(&l->lock);
+}
+
+static void *list_pop(struct locked_list *l) {
+    struct list_node *n;
+    void *item;
+
+    pthread_mutex_lock(&l->lock);
+    n = l->head;
+    if (n) {
+        l->head = n->next;
+        if (!l->head) l->tail = NULL;
+    }
+    pthread_mutex_unlock(&l->lock);
+
+    if (!n) return NULL;
+    item = n->item;
+    free(n);
+    return item;
+}
+
+static void *producer_main(void *arg) {
+    struct producer *p = arg;
+    struct run *r = p->run;
+    int burst = 0;
+
+    pthread_barrier_wait(&r->start);
+    for (long seq = 0; seq < r->per_producer; seq++) {
+        void *item = ITEM(p->id, seq);
+
+        if (r->backend == BACKEND_LIST) {
+            list_push(&r->list, item);
+            continue;
+        }
+        // A full ring is back-pressure: retry until the consumer catches up
+        while (!safe_lkm_ring_push(&r->ring, item))
+            sched_yield();
+
+        if (r->max_burst && ++burst >= 1 + rand_r(&p->seed) % r->max_burst) {
+            burst = 0;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Run producers against the consumer on the calling thread
+// Returns: items/sec, or -1 if an item was lost, duplicated or reordered
+static double run_once(enum backend backend, int nprod, long per_producer,
+                       unsigned long ring_size, int max_burst, unsigned int seed) {
+    struct producer prods[MAX_PRODUCERS];
+    long next_seq[MAX_PRODUCERS] = { 0 };
+    struct safe_lkm_ring_slot *slots = NULL;
+    struct run r;
+    long total = (long)nprod * per_producer, got = 0;
+    int ok = 1, misses = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.backend = backend;
+    r.nprod = nprod;
+    r.per_producer = per_producer;
+    r.max_burst = max_burst;
+    if (backend == BACKEND_RING) {
+        slots = malloc(SAFE_LKM_RING_SLOTS_BYTES(ring_size));
+        safe_lkm_ring_init(&r.ring, slots, ring_size);
+    } else {
+        pthread_mutex_init(&r.list.lock, NULL);
+    }
+
+    pthread_barrier_init(&r.start, NULL, nprod + 1);
+    for (int i = 0; i < nprod; i++) {
+        prods[i].run = &r;
+        prods[i].id = i;
+        prods[i].seed = seed + i;
+        pthread_create(&prods[i].thread, NULL, producer_main, &prods[i]);
+    }
+
+    pthread_barrier_wait(&r.start);
+    double start = now_sec();
+    while (got < total) {
+        void *item = backend == BACKEND_RING ? safe_lkm_ring_pop(&r.ring)
+                                             : list_pop(&r.list);
+        if (!item) {
+            // Bounded spin, then let producers run (they may share our CPU)
+            if (++misses >= EMPTY_SPINS) {
+                misses = 0;
+                sched_yield();
+            }
+            continue;
+        }
+        misses = 0;
+
+        unsigned long p = ITEM_PROD(item);
+        if (p >= (unsigned long)nprod || (long)ITEM_SEQ(item) != next_seq[p]) {
+            ok = 0;
+            break;
+        }
+        next_seq[p]++;
+        got++;
+    }
+    double elapsed = now_sec() - start;
+
+    for (int i = 0; i < nprod; i++)
+        pthread_join(prods[i].thread, NULL);
+    pthread_barrier_destroy(&r.start);
+
+    // Nothing may be left over once every item has been seen
+    if (ok && backend == BACKEND_RING &&
+        (safe_lkm_ring_pop(&r.ring) || safe_lkm_ring_count(&r.ring) != 0))
+        ok = 0;
+
+    free(slots);
+    if (!ok) return -1;
+    return elapsed > 0 ? total / elapsed : 0;
+}
+
+static int fuzz(int max_prod, int rounds) {
+    unsigned int seed = (unsigned int)time(NULL);
+    int failures = 0;
+
+    printf("\n%sFuzz: %d rounds (seed %u)%s\n", BLUE, rounds, seed, RESET);
+    srand(seed);
+    for (int i = 0; i < rounds; i++) {
+        int nprod = 1 + rand() % max_prod;
+        unsigned long size = 1UL << (1 + rand() % 10);   // 2 .. 1024 slots
+        long per_producer = 1000 + rand() % 20000;
+        int max_burst = rand() % 64;
+
+        if (run_once(BACKEND_RING, nprod, per_producer, size, max_burst, seed + i) < 0) {
+            printf("  %s✗ round %d: producers=%d size=%lu items=%ld burst=%d%s\n",
+                   RED, i, nprod, size, per_producer, max_burst, RESET);
+            failures++;
+        }
+    }
+
+    if (failures == 0)
+        printf("  %s✓ No lost, duplicated or reordered items%s\n", GREEN, RESET);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    int max_prod = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long per_producer = argc > 2 ? atol(argv[2]) : 1000000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 200;
+
+    printf("\n");
+    printf("========================================\n");
+    printf("  Safe Kernel Module - MPSC Ring\n");
+    printf("  OS Assignment 2 - Fall 2025\n");
+    printf("========================================\n");
+
+    if (max_prod < 1) max_prod = 1;
+    if (max_prod > MAX_PRODUCERS) max_prod = MAX_PRODUCERS;
+
+    int failures = fuzz(max_prod, rounds);
+
+    printf("\n%s%ld items per producer, 1 consumer, 1024-slot ring%s\n",
+           BLUE, per_producer, RESET);
+    printf("  %-10s %18s %18s\n", "producers", "ring items/s", "mutex list items/s");
+
+    // 1, 2, 4, ... and finally max_prod itself
+    for (int nprod = 1; ; nprod *= 2) {
+        if (nprod > max_prod) nprod = max_prod;
+        double ring = run_once(BACKEND_RING, nprod, per_producer, 1024, 0, 1);
+        double list = run_once(BACKEND_LIST, nprod, per_producer, 0, 0, 1);
+        printf("  %-10d %18.0f %18.0f\n", nprod, ring, list);
+        if (ring < 0 || list < 0) failures++;
+        if (nprod == max_prod) break;
+    }
+
+    if (failures) {
+        printf("\n%s%d failure(s)%s\n\n", RED, failures, RESET);
+        return 1;
+    }
+    printf("\n%sDone.%s\n\n", GREEN, RESET);
+    return 0;
+}
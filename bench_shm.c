@@ -0,0 +1,203 @@
+// Zero-Copy Payload Benchmark for Safe Kernel Module
+// Assignment 2 - OS Fall 2025
+//
+// Moves the same payloads through /dev/safe_lkm two ways and reports the
+// payload throughput of each:
+//   copy - SEND_BATCH/RECV_BATCH with user buffers (copied in and out)
+//   shm  - payloads written into mapped slots, descriptors flagged
+//          SAFE_LKM_DESC_SHM, received and checksummed in place
+// Both paths write every payload byte once and read it back once, so the
+// difference is the kernel's copies.
+//
+// Needs the module loaded with shared-memory slots, e.g.
+//   sudo insmod safe_lkm.ko shm_slots=256
+//
+// Usage: ./bench_shm [batch] [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "safe_lkm_user.h"
+
+#define MAX_PARAM "/sys/module/safe_lkm/parameters/msg_max_size"
+#define GREEN "\033[0;32m"
+#define RED "\033[0;31m"
+#define RESET "\033[0m"
+#define YELLOW "\033[0;33m"
+#define BLUE "\033[0;34m"
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int read_param(const char *path, unsigned int def) {
+    FILE *fp = fopen(path, "r");
+    unsigned int v = def;
+    if (fp) {
+        if (fscanf(fp, "%u", &v) != 1) v = def;
+        fclose(fp);
+    }
+    return v;
+}
+
+// Stand-in for producing a payload: every byte is written
+static void fill(char *p, size_t len, unsigned int seed) {
+    memset(p, 'a' + seed % 26, len);
+}
+
+// Stand-in for consuming a payload: every byte is read
+static unsigned long checksum(const char *p, size_t len) {
+    const unsigned long *w = (const unsigned long *)p;
+    unsigned long sum = 0;
+    for (size_t i = 0; i < len / sizeof(*w); i++) sum += w[i];
+    return sum;
+}
+
+// Returns: payload bytes/sec, or -1 on error
+static double run_copy(int fd, size_t size, int batch, int rounds) {
+    struct safe_lkm_desc *d = calloc(batch, sizeof(*d));
+    char *bufs = malloc(size * batch);
+    unsigned long sum = 0;
+    long bytes = 0;
+
+    double start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < batch; i++) {
+            fill(bufs + i * size, size, i);
+            d[i] = (struct safe_lkm_desc){ .pid = getpid(), .type = 1, .len = size,
+                                           .buf = (__u64)(unsigned long)(bufs + i * size) };
+        }
+        if (safe_lkm_send_batch(fd, d, batch) != batch) goto fail;
+
+        for (int i = 0; i < batch; i++)
+            d[i] = (struct safe_lkm_desc){ .len = size,
+                                           .buf = (__u64)(unsigned long)(bufs + i * size) };
+        if (safe_lkm_recv_batch(fd, d, batch) != batch) goto fail;
+        for (int i = 0; i < batch; i++) {
+            sum += checksum(bufs + i * size, d[i].len);
+            bytes += d[i].len;
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    free(d);
+    free(bufs);
+    return sum && elapsed > 0 ? bytes / elapsed : 0;
+
+fail:
+    perror("  copy path");
+    free(d);
+    free(bufs);
+    return -1;
+}
+
+// Returns: payload bytes/sec, or -1 on error
+static double run_shm(struct safe_lkm_shm *shm, size_t size, int batch, int rounds) {
+    struct safe_lkm_desc *d = calloc(batch, sizeof(*d));
+    uint64_t *offs = calloc(batch, sizeof(*offs));
+    unsigned long sum = 0;
+    long bytes = 0;
+
+    double start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        if (safe_lkm_shm_alloc(shm, offs, batch) != batch) goto fail;
+        for (int i = 0; i < batch; i++) {
+            fill(safe_lkm_shm_ptr(shm, offs[i]), size, i);
+            safe_lkm_shm_desc(&d[i], getpid(), 1, offs[i], size);
+        }
+        if (safe_lkm_send_batch(shm->fd, d, batch) != batch) goto fail;
+
+        for (int i = 0; i < batch; i++)
+            safe_lkm_shm_desc(&d[i], 0, 0, 0, 0);
+        if (safe_lkm_recv_batch(shm->fd, d, batch) != batch) goto fail;
+        for (int i = 0; i < batch; i++) {
+            if (!(d[i].flags & SAFE_LKM_DESC_SHM)) {
+                errno = EPROTO;
+                goto fail;
+            }
+            sum += checksum(safe_lkm_shm_ptr(shm, d[i].buf), d[i].len);
+            bytes += d[i].len;
+            offs[i] = d[i].buf;
+        }
+        if (safe_lkm_shm_free(shm, offs, batch) != batch) goto fail;
+    }
+    double elapsed = now_sec() - start;
+
+    free(d);
+    free(offs);
+    return sum && elapsed > 0 ? bytes / elapsed : 0;
+
+fail:
+    perror("  shm path");
+    free(d);
+    free(offs);
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int batch = argc > 1 ? atoi(argv[1]) : 16;
+    int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+    size_t sizes[] = { 4096, 16384, 65536, 262144, 1048576 };
+    struct safe_lkm_shm shm;
+    int failures = 0;
+
+    printf("\n");
+    printf("========================================\n");
+    printf("  Safe Kernel Module - Zero-Copy Slots\n");
+    printf("  OS Assignment 2 - Fall 2025\n");
+    printf("========================================\n");
+
+    if (access(SAFE_LKM_DEV_PATH, F_OK) != 0) {
+        printf("\n%sERROR: Module not loaded. Please run: sudo insmod safe_lkm.ko%s\n", RED, RESET);
+        return 1;
+    }
+    if (safe_lkm_shm_open(&shm, O_RDWR | O_NONBLOCK) < 0) {
+        printf("\n%sERROR: No shared-memory slots (%s). Load with: sudo insmod safe_lkm.ko shm_slots=256%s\n",
+               RED, strerror(errno), RESET);
+        return 1;
+    }
+
+    unsigned int max_size = read_param(MAX_PARAM, SAFE_LKM_MSG_DEFAULT_MAX);
+    if (batch < 1) batch = 1;
+    if ((uint32_t)batch > shm.slots) batch = shm.slots;
+
+    printf("\n%s%u slots of %u bytes, batch %d, %d rounds%s\n",
+           BLUE, shm.slots, shm.slot_size, batch, rounds, RESET);
+    printf("  %-10s %14s %14s %8s\n", "payload", "copy MB/s", "shm MB/s", "speedup");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t size = sizes[s];
+        if (size > shm.slot_size || size > max_size) {
+            printf("  %-10zu %sskipped (slot_size or msg_max_size too small)%s\n",
+                   size, YELLOW, RESET);
+            continue;
+        }
+        // Same total volume for every size (rounds x 16 KiB per descriptor)
+        int n = (int)((long)rounds * 16384 / size);
+        if (n < 10) n = 10;
+
+        double copy = run_copy(shm.fd, size, batch, n);
+        double zc = run_shm(&shm, size, batch, n);
+        if (copy < 0 || zc < 0) {
+            failures++;
+            continue;
+        }
+        printf("  %-10zu %14.0f %14.0f %7.2fx\n", size, copy / 1e6, zc / 1e6,
+               copy > 0 ? zc / copy : 0);
+    }
+
+    safe_lkm_shm_close(&shm);
+    if (failures) {
+        printf("\n%s%d failure(s)%s\n\n", RED, failures, RESET);
+        return 1;
+    }
+    printf("\n%sDone.%s\n\n", GREEN, RESET);
+    return 0;
+}
@@ -8,7 +8,7 @@ echo "========================================="
 echo ""
 
 # Compile basic tests
-echo "[1/3] Compiling test_basic.c..."
+echo "[1/9] Compiling test_basic.c..."
 gcc -o test_basic test_basic.c -Wall
 if [ $? -eq 0 ]; then
     echo "  ✓ test_basic compiled successfully"
@@ -18,7 +18,7 @@ else
 fi
 
 # Compile edge case tests
-echo "[2/3] Compiling test_edge.c..."
+echo "[2/9] Compiling test_edge.c..."
 gcc -o test_edge test_edge.c -Wall
 if [ $? -eq 0 ]; then
     echo "  ✓ test_edge compiled successfully"
@@ -28,7 +28,7 @@ else
 fi
 
 # Compile stress tests
-echo "[3/3] Compiling test_stress.c..."
+echo "[3/9] Compiling test_stress.c..."
 gcc -o test_stress test_stress.c -Wall
 if [ $? -eq 0 ]; then
     echo "  ✓ test_stress compiled successfully"
@@ -37,10 +37,76 @@ else
     exit 1
 fi
 
+# Compile producer scaling benchmark
+echo "[4/9] Compiling bench_producers.c..."
+gcc -o bench_producers bench_producers.c -Wall -pthread
+if [ $? -eq 0 ]; then
+    echo "  ✓ bench_producers compiled successfully"
+else
+    echo "  ✗ Failed to compile bench_producers"
+    exit 1
+fi
+
+# Compile lock-free ring benchmark/fuzzer (user space, no module needed)
+echo "[5/9] Compiling bench_ring.c..."
+gcc -O2 -o bench_ring bench_ring.c -Wall -pthread
+if [ $? -eq 0 ]; then
+    echo "  ✓ bench_ring compiled successfully"
+else
+    echo "  ✗ Failed to compile bench_ring"
+    exit 1
+fi
+
+# Compile zero-copy slot benchmark (with the user-space helper library)
+echo "[6/9] Compiling bench_shm.c..."
+gcc -O2 -o bench_shm bench_shm.c safe_lkm_user.c -Wall
+if [ $? -eq 0 ]; then
+    echo "  ✓ bench_shm compiled successfully"
+else
+    echo "  ✗ Failed to compile bench_shm"
+    exit 1
+fi
+
+# Compile queue core benchmark (user space over safe_lkm_shim.h, no module needed)
+echo "[7/9] Compiling bench_queue.c..."
+gcc -O2 -o bench_queue bench_queue.c -Wall -pthread
+if [ $? -eq 0 ]; then
+    echo "  ✓ bench_queue compiled successfully"
+else
+    echo "  ✗ Failed to compile bench_queue"
+    exit 1
+fi
+
+# Compile interrupt latency benchmark
+echo "[8/9] Compiling bench_irqlat.c..."
+gcc -O2 -o bench_irqlat bench_irqlat.c -Wall -pthread
+if [ $? -eq 0 ]; then
+    echo "  ✓ bench_irqlat compiled successfully"
+else
+    echo "  ✗ Failed to compile bench_irqlat"
+    exit 1
+fi
+
+# Compile queue snapshot tool (with the user-space helper library)
+echo "[9/9] Compiling safe_lkm_snap.c..."
+gcc -O2 -o safe_lkm_snap safe_lkm_snap.c safe_lkm_user.c -Wall
+if [ $? -eq 0 ]; then
+    echo "  ✓ safe_lkm_snap compiled successfully"
+else
+    echo "  ✗ Failed to compile safe_lkm_snap"
+    exit 1
+fi
+
 echo ""
 echo "========================================="
 echo "  All tests compiled successfully!"
 echo "========================================="
 echo ""
 echo "Run tests with: ./run_tests.sh"
+echo "Run producer scaling benchmark with: sudo ./bench_producers"
+echo "Run ring benchmark/fuzzer with: ./bench_ring"
+echo "Run zero-copy benchmark with: ./bench_shm (module loaded with shm_slots=N)"
+echo "Run queue core benchmark with: ./bench_queue (no module needed)"
+echo "Run interrupt latency benchmark with: sudo ./bench_irqlat"
+echo "Save/restore a backlog across a reload with: ./safe_lkm_snap save|load FILE"
 echo ""
@@ -5,10 +5,12 @@
 //
 // This module implements a safe, educational IPC message queue with priority
 // handling without modifying the actual kernel. It demonstrates:
-//   - Priority-based message queuing (High vs Normal priority)
+//   - Priority-based message queuing (High vs Normal, or N levels)
 //   - Thread-safe operations using spinlocks
 //   - Kernel memory management
 //   - /proc filesystem interface for user interaction
+//   - /dev/safe_lkm binary character device for programs
+//   - Optional shared-memory payload slots for zero-copy transfer
 //
 // ============================================================================
 
@@ -17,232 +19,2227 @@
 #include <linux/proc_fs.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/bitmap.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/hashtable.h>
+#include <linux/rbtree.h>
+#include <linux/percpu.h>
+#include <linux/ctype.h>
+
+#include "safe_lkm_uapi.h"
 
 #define PROC_NAME "safe_lkm"
-#define MSG_SIZE 256
-#define HIGH_PRIO_THRESHOLD 5
+#define PROC_STATS_NAME "safe_lkm_stats"
+#define PROC_QUEUES_NAME "safe_lkm_queues"
+#define PROC_LATENCY_NAME "safe_lkm_latency"
+#define PROC_MESSAGES_NAME "safe_lkm_messages"
+#define MSG_CACHE_NAME "safe_lkm_msg"
+
+// DRAIN stages records in a kernel buffer of this size and copies it out
+// whole, so a drain of small messages costs one copy_to_user per chunk
+#define DRAIN_CHUNK (64 * 1024)
+
+// Keep our own line in /proc/slabinfo instead of being merged into a
+// generic cache of the same size (SLAB_NO_MERGE exists from Linux 6.5)
+#ifdef SLAB_NO_MERGE
+#define MSG_CACHE_FLAGS SLAB_NO_MERGE
+#else
+#define MSG_CACHE_FLAGS 0
+#endif
+
+// ---------------------------------------------------------------------------
+// Module Parameters
+// ---------------------------------------------------------------------------
+
+static unsigned int msg_pool_reserve;
+module_param(msg_pool_reserve, uint, 0444);
+MODULE_PARM_DESC(msg_pool_reserve,
+                 "Message objects to pre-reserve in a mempool (0 = no reserve)");
+
+static unsigned int msg_max_size = SAFE_LKM_MSG_DEFAULT_MAX;
+module_param(msg_max_size, uint, 0444);
+MODULE_PARM_DESC(msg_max_size, "Largest accepted payload in bytes (max 16 MiB)");
+
+static bool percpu_staging;
+module_param(percpu_staging, bool, 0644);
+MODULE_PARM_DESC(percpu_staging,
+                 "Stage sends on per-CPU lists instead of the global lock (FIFO per CPU only)");
+
+static unsigned int prio_levels = 2;
+module_param(prio_levels, uint, 0444);
+MODULE_PARM_DESC(prio_levels,
+                 "Priority levels (2 = split at type 5, N > 2 = one per type 0..N-1, max 64)");
+
+static unsigned int dequeue_policy;
+module_param(dequeue_policy, uint, 0644);
+MODULE_PARM_DESC(dequeue_policy,
+                 "0 = strict priority (default), 1 = weighted round-robin across levels");
+
+static unsigned int level_weights[SAFE_LKM_PRIO_MAX];
+static int nr_level_weights;
+module_param_array(level_weights, uint, &nr_level_weights, 0644);
+MODULE_PARM_DESC(level_weights,
+                 "Messages per round-robin turn, level 0 first (default prio_levels - level)");
+
+static unsigned int age_deadline_ms;
+module_param(age_deadline_ms, uint, 0644);
+MODULE_PARM_DESC(age_deadline_ms,
+                 "Serve messages older than this first, whatever their level (0 = off)");
+
+static unsigned int shm_slots;
+module_param(shm_slots, uint, 0444);
+MODULE_PARM_DESC(shm_slots, "Shared-memory payload slots for mmap (0 = disabled)");
+
+static unsigned int shm_slot_size = 65536;
+module_param(shm_slot_size, uint, 0444);
+MODULE_PARM_DESC(shm_slot_size, "Bytes per shared-memory slot (multiple of 64)");
+
+static unsigned int queue_capacity;
+module_param(queue_capacity, uint, 0444);
+MODULE_PARM_DESC(queue_capacity, "Most messages in the default queue (0 = unlimited)");
+
+static unsigned int capacity_high;
+module_param(capacity_high, uint, 0444);
+MODULE_PARM_DESC(capacity_high, "Most high priority messages in the default queue (0 = unlimited)");
+
+static unsigned int capacity_normal;
+module_param(capacity_normal, uint, 0444);
+MODULE_PARM_DESC(capacity_normal, "Most normal priority messages in the default queue (0 = unlimited)");
+
+static unsigned int overflow_policy;
+module_param(overflow_policy, uint, 0444);
+MODULE_PARM_DESC(overflow_policy,
+                 "Send at capacity: 0 = fail, 1 = block, 2 = drop oldest normal, 3 = reject normal only");
+
+static unsigned int max_queues = 64;
+module_param(max_queues, uint, 0444);
+MODULE_PARM_DESC(max_queues, "Most named queues that can exist at once");
+
+static unsigned int normal_ring_size;
+module_param(normal_ring_size, uint, 0444);
+MODULE_PARM_DESC(normal_ring_size,
+                 "Slots in a lock-free ring for the lowest priority level (power of two up to 65536, 0 = linked list)");
+
+static unsigned int expire_sweep_ms = 1000;
+module_param(expire_sweep_ms, uint, 0444);
+MODULE_PARM_DESC(expire_sweep_ms,
+                 "Period of the sweep that frees expired messages (0 = only on receive)");
+
+static unsigned int max_tasks = 65536;
+module_param(max_tasks, uint, 0444);
+MODULE_PARM_DESC(max_tasks, "Most tasks in the task registry (T command)");
+
+static bool numa_shards;
+module_param(numa_shards, bool, 0444);
+MODULE_PARM_DESC(numa_shards,
+                 "One queue shard per NUMA node, messages allocated on the sender's node");
+
+// Tracepoints (msg_enqueue, msg_dequeue, msg_drop, msg_expire, queue_empty,
+// alloc_fail)
+#define CREATE_TRACE_POINTS
+#include "safe_lkm_trace.h"
+
+// The queue core: message lists, staging, ring, dequeue policy and
+// capacity (shared with the user-space benchmark, bench_queue.c)
+#include "safe_lkm_queue.h"
+
+static struct demo_queue *demo_default_queue;
+static atomic64_t demo_alloc_failures;
+
+// Dedicated slab cache for struct demo_msg, plus an optional reserve
+static struct kmem_cache *demo_msg_cache;
+static mempool_t *demo_msg_pool;
+
+// ---------------------------------------------------------------------------
+// Shared-Memory Payload Slots
+// ---------------------------------------------------------------------------
+//
+// With shm_slots=N the module allocates one vmalloc_user() region of N
+// fixed-size slots that every client can mmap() from /dev/safe_lkm. A
+// producer reserves slots (SHM_ALLOC), writes payloads straight into them
+// and sends descriptors flagged SAFE_LKM_DESC_SHM; the queued message then
+// points at the slot instead of owning a copy. A consumer that asks for
+// SAFE_LKM_DESC_SHM on receive gets the slot offset back and reads the
+// payload in place, then returns the slot (SHM_FREE). Consumers that do
+// not ask, including read() and /proc, get an ordinary copy.
+//
+// Slot states, protected by demo_shm_lock:
+//   free                  neither bit set
+//   owned by a client     used                (after SHM_ALLOC or an
+//                                              in-place receive)
+//   owned by the queue    used + queued       (after an SHM send)
+//
+// The region is shared by everyone who can open the device: it provides
+// no isolation beyond what the queue itself does.
+
+static char *demo_shm;                   // The mmap-able region
+static size_t demo_shm_size;             // Region size, page aligned
+static unsigned long *demo_shm_used;     // Slot reserved or queued
+static unsigned long *demo_shm_queued;   // Slot referenced by a message
+static unsigned int demo_shm_hint;       // Where the next search starts
+static DEFINE_SPINLOCK(demo_shm_lock);
+
+static inline bool demo_shm_contains(const char *data)
+{
+    return demo_shm && data >= demo_shm &&
+           data < demo_shm + (size_t)shm_slots * shm_slot_size;
+}
+
+// Slot index for a region offset
+// Returns: the slot, or -EINVAL if off is not the start of a slot
+static long demo_shm_slot(u64 off)
+{
+    if (!demo_shm || off % shm_slot_size ||
+        off >= (u64)shm_slots * shm_slot_size)
+        return -EINVAL;
+    return div_u64(off, shm_slot_size);
+}
+
+// Reserve up to n free slots for a client
+// Returns: number reserved, their offsets in offs[]
+static int demo_shm_alloc(u64 *offs, int n)
+{
+    unsigned long slot;
+    int got = 0;
+
+    spin_lock(&demo_shm_lock);
+    while (got < n) {
+        slot = find_next_zero_bit(demo_shm_used, shm_slots, demo_shm_hint);
+        if (slot >= shm_slots)
+            slot = find_first_zero_bit(demo_shm_used, shm_slots);
+        if (slot >= shm_slots)
+            break;
+        __set_bit(slot, demo_shm_used);
+        demo_shm_hint = slot + 1 < shm_slots ? slot + 1 : 0;
+        offs[got++] = (u64)slot * shm_slot_size;
+    }
+    spin_unlock(&demo_shm_lock);
+    return got;
+}
+
+// Return a client-owned slot
+// Returns: 0, or -EINVAL if the slot is not owned by a client
+static int demo_shm_free(u64 off)
+{
+    long slot = demo_shm_slot(off);
+    int ret = -EINVAL;
+
+    if (slot < 0)
+        return slot;
+
+    spin_lock(&demo_shm_lock);
+    if (test_bit(slot, demo_shm_used) && !test_bit(slot, demo_shm_queued)) {
+        __clear_bit(slot, demo_shm_used);
+        ret = 0;
+    }
+    spin_unlock(&demo_shm_lock);
+    return ret;
+}
+
+// Hand a client-owned slot to the queue for an SHM send
+// Returns: kernel address of the payload, or an ERR_PTR
+static char *demo_shm_claim(u64 off, u32 len)
+{
+    long slot = demo_shm_slot(off);
+    char *data = ERR_PTR(-EINVAL);
+
+    if (slot < 0)
+        return ERR_PTR(slot);
+    if (len > shm_slot_size)
+        return ERR_PTR(-EMSGSIZE);
+
+    spin_lock(&demo_shm_lock);
+    if (test_bit(slot, demo_shm_used) && !test_bit(slot, demo_shm_queued)) {
+        __set_bit(slot, demo_shm_queued);
+        data = demo_shm + off;
+    }
+    spin_unlock(&demo_shm_lock);
+    return data;
+}
+
+// A queued slot leaves the queue, either to a client (in-place receive,
+// keep = true) or back to the free pool (the message was copied or freed)
+static void demo_shm_release(const char *data, bool keep)
+{
+    unsigned long slot = (data - demo_shm) / shm_slot_size;
+
+    spin_lock(&demo_shm_lock);
+    __clear_bit(slot, demo_shm_queued);
+    if (!keep)
+        __clear_bit(slot, demo_shm_used);
+    spin_unlock(&demo_shm_lock);
+}
+
+// Give a message's slot to the client instead of freeing it with the message
+static void demo_shm_detach(struct demo_msg *m)
+{
+    demo_shm_release(m->data, true);
+    m->data = m->inline_data;
+}
+
+// Number of slots not free, read without the lock
+static unsigned int demo_shm_in_use(void)
+{
+    return demo_shm ? bitmap_weight(demo_shm_used, shm_slots) : 0;
+}
+
+static int demo_shm_init(void)
+{
+    if (!shm_slots)
+        return 0;
+    if (!shm_slot_size || shm_slot_size % 64 || shm_slot_size > SAFE_LKM_MSG_LIMIT)
+        return -EINVAL;
+
+    demo_shm_size = PAGE_ALIGN((size_t)shm_slots * shm_slot_size);
+    demo_shm = vmalloc_user(demo_shm_size);
+    demo_shm_used = bitmap_zalloc(shm_slots, GFP_KERNEL);
+    demo_shm_queued = bitmap_zalloc(shm_slots, GFP_KERNEL);
+    if (!demo_shm || !demo_shm_used || !demo_shm_queued)
+        return -ENOMEM;
+    return 0;
+}
+
+// Safe on a partially initialized region
+static void demo_shm_exit(void)
+{
+    bitmap_free(demo_shm_queued);
+    bitmap_free(demo_shm_used);
+    vfree(demo_shm);
+    demo_shm = NULL;
+}
 
 // ---------------------------------------------------------------------------
-// IPC Message Queue Data Structures
+// Message Allocation
 // ---------------------------------------------------------------------------
 
-// Message structure - represents a single IPC message
-struct demo_msg {
-    int pid;                  // Sender process ID
-    int type;                 // Message priority/type
-    char text[MSG_SIZE];      // Message content
-    struct list_head list;    // Kernel linked list node
+// With msg_pool_reserve set, allocations fall back to the pre-reserved
+// objects when the slab allocator cannot satisfy them, so a send waits for
+// a free object instead of failing under memory pressure (an atomic send
+// takes one if any is left, and fails otherwise). Objects come from node
+// (NUMA_NO_NODE for any); reserved objects may be remote.
+static struct demo_msg *demo_msg_obj_alloc(gfp_t gfp, int node)
+{
+    struct demo_msg *m;
+
+    if (demo_msg_pool) {
+        m = kmem_cache_alloc_node(demo_msg_cache,
+                                  (gfp & ~__GFP_DIRECT_RECLAIM) | __GFP_NOWARN, node);
+        return m ? m : mempool_alloc(demo_msg_pool, gfp);
+    }
+    return kmem_cache_alloc_node(demo_msg_cache, gfp, node);
+}
+
+// Return a message to the reserve or the slab cache
+static void demo_free_msg(struct demo_msg *m)
+{
+    if (demo_shm_contains(m->data))
+        demo_shm_release(m->data, false);
+    else if (m->data != m->inline_data)
+        kvfree(m->data);
+
+    if (demo_msg_pool)
+        mempool_free(m, demo_msg_pool);
+    else
+        kmem_cache_free(demo_msg_cache, m);
+}
+
+// Allocate a message node with room for a len byte payload; the caller
+// fills in m->data. Payloads above MSG_INLINE_SIZE use kvmalloc, which
+// falls back to vmalloc'd pages for sizes the slab allocator cannot serve
+// (with GFP_ATOMIC, plain kmalloc: vmalloc may sleep). Both come from the
+// node of q, so a message sent to a NUMA shard stays in its node's memory.
+// Returns: the new message, or NULL on allocation failure
+static struct demo_msg *__demo_alloc_msg(struct demo_queue *q, int pid, int type,
+                                         u32 len, gfp_t gfp)
+{
+    struct demo_msg *m;
+
+    m = demo_msg_obj_alloc(gfp, q->node);
+    if (!m) {
+        atomic64_inc(&demo_alloc_failures);
+        trace_alloc_fail(pid, len);
+        return NULL;
+    }
+
+    m->pid = pid;
+    m->type = type;
+    m->len = len;
+    m->level = demo_type_level(q, type);
+    m->expires_ns = 0;
+    m->data = m->inline_data;
+    INIT_LIST_HEAD(&m->list);
+
+    if (len > MSG_INLINE_SIZE) {
+        m->data = gfp == GFP_KERNEL ? kvmalloc_node(len, gfp, q->node) :
+                                      kmalloc_node(len, gfp, q->node);
+        if (!m->data) {
+            atomic64_inc(&demo_alloc_failures);
+            trace_alloc_fail(pid, len);
+            m->data = m->inline_data;
+            demo_free_msg(m);
+            return NULL;
+        }
+    }
+    return m;
+}
+
+static struct demo_msg *demo_alloc_msg(struct demo_queue *q, int pid, int type,
+                                       u32 len)
+{
+    return __demo_alloc_msg(q, pid, type, len, GFP_KERNEL);
+}
+
+// ---------------------------------------------------------------------------
+// IPC Functions - Default Queue
+// ---------------------------------------------------------------------------
+
+// Send a message to the default queue
+// Parameters:
+//   pid  - Process ID of sender
+//   type - Message priority/type (>= 5 is high priority)
+//   text - Message content (truncated to msg_max_size bytes)
+// Never waits for room: under SAFE_LKM_OVERFLOW_BLOCK a full queue fails.
+// Returns: 0 on success, -ENOMEM on allocation failure, -EAGAIN if the
+//          queue is at capacity or the normal priority ring is full
+int demo_send_msg(int pid, int type, const char *text)
+{
+    struct demo_queue *q = demo_local_shard(demo_default_queue);
+    struct demo_msg *m;
+    int ret;
+
+    m = demo_alloc_msg(q, pid, type, strnlen(text, msg_max_size));
+    if (!m)
+        return -ENOMEM;
+
+    memcpy(m->data, text, m->len);
+
+    ret = demo_enqueue_msg(q, m, true);
+    if (ret)
+        demo_free_msg(m);
+    return ret;
+}
+
+// Send a message to the default queue from any context
+// The entry point for in-kernel producers: safe in interrupt handlers,
+// softirqs and under spinlocks. It never sleeps and never takes a queue
+// lock (see demo_enqueue_atomic()), so a full queue fails whatever its
+// overflow policy. Everything else in this file runs in process context.
+// Parameters:
+//   pid, type - as for demo_send_msg()
+//   data, len - binary payload, at most msg_max_size bytes
+// Returns: 0 on success, -EMSGSIZE, -ENOMEM if an atomic allocation
+//          failed, -EAGAIN if the queue is at capacity or the ring is full
+int demo_send_msg_atomic(int pid, int type, const void *data, u32 len)
+{
+    struct demo_queue *q = demo_local_shard(demo_default_queue);
+    struct demo_msg *m;
+    int ret;
+
+    if (len > msg_max_size)
+        return -EMSGSIZE;
+    m = __demo_alloc_msg(q, pid, type, len, GFP_ATOMIC);
+    if (!m)
+        return -ENOMEM;
+
+    memcpy(m->data, data, len);
+
+    ret = demo_enqueue_atomic(q, m);
+    if (ret)
+        demo_free_msg(m);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(demo_send_msg_atomic);
+
+// Receive a message from the default queue, see demo_queue_receive()
+// With NUMA shards, from the shard holding the most urgent message.
+int demo_receive_msg(struct demo_msg **out)
+{
+    return demo_queue_receive(demo_pick_shard(demo_default_queue), out);
+}
+
+// Move a sender's messages on the default queue to the level of type prio
+// Returns: number of messages moved, see demo_queue_reprio()
+int demo_reprio_pid(int pid, int prio)
+{
+    struct demo_match f = { .flags = SAFE_LKM_MATCH_PID, .pid = pid };
+
+    return demo_queue_reprio(demo_default_queue, &f, prio);
+}
+
+// ---------------------------------------------------------------------------
+// Named Queues
+// ---------------------------------------------------------------------------
+//
+// Every queue, the default one included, lives in an IDR keyed by its id,
+// so finding a queue by id is a radix tree lookup whatever the number of
+// queues; names are only compared on create and lookup by name. The
+// registry mutex is never taken on the message path: a descriptor resolves
+// its queue once, at QUEUE_ATTACH, and keeps a reference from then on.
+//
+// LIFETIME: the registry holds one reference and every attached descriptor
+// another. QUEUE_DESTROY unlinks the queue, marks it dead, frees its
+// messages and wakes its receivers; the memory goes with the last
+// reference. The default queue is never destroyed while the module is
+// loaded, so descriptors on it need no reference.
+
+static DEFINE_IDR(demo_queues);
+static DEFINE_MUTEX(demo_queues_lock);
+
+static void demo_queue_release(struct kref *ref)
+{
+    // Its flush catches sends that raced with QUEUE_DESTROY
+    demo_queue_free(container_of(ref, struct demo_queue, ref));
+}
+
+static inline void demo_queue_put(struct demo_queue *q)
+{
+    kref_put(&q->ref, demo_queue_release);
+}
+
+// Give a queue an id in [min, max] under a unique name
+// Returns: 0, -EEXIST if the name is taken, -ENOSPC if no id is free
+static int demo_queue_register(struct demo_queue *q, int min, int max)
+{
+    struct demo_queue *other;
+    int id, ret;
+
+    mutex_lock(&demo_queues_lock);
+    idr_for_each_entry(&demo_queues, other, id) {
+        if (!strcmp(other->name, q->name)) {
+            ret = -EEXIST;
+            goto out;
+        }
+    }
+    ret = idr_alloc(&demo_queues, q, min, max + 1, GFP_KERNEL);
+    if (ret >= 0) {
+        q->id = ret;
+        ret = 0;
+    }
+out:
+    mutex_unlock(&demo_queues_lock);
+    return ret;
+}
+
+// Take a reference to the queue with this id
+// Returns: the queue, or NULL if there is none
+static struct demo_queue *demo_queue_get(u32 id)
+{
+    struct demo_queue *q;
+
+    mutex_lock(&demo_queues_lock);
+    q = idr_find(&demo_queues, id);
+    if (q)
+        kref_get(&q->ref);
+    mutex_unlock(&demo_queues_lock);
+    return q;
+}
+
+// Fill in attr for the queue named attr->name
+// Returns: 0, or -ENOENT if there is none
+static int demo_queue_lookup(struct safe_lkm_queue_attr *attr)
+{
+    struct demo_queue *q;
+    int id, ret = -ENOENT;
+
+    mutex_lock(&demo_queues_lock);
+    idr_for_each_entry(&demo_queues, q, id) {
+        if (strcmp(q->name, attr->name))
+            continue;
+        attr->id = q->id;
+        attr->prio_levels = q->prio_levels;
+        attr->capacity = q->capacity;
+        attr->ring_size = q->ring_size;
+        attr->capacity_high = q->class_capacity[CLASS_HIGH];
+        attr->capacity_normal = q->class_capacity[CLASS_NORMAL];
+        attr->overflow = q->overflow;
+        ret = 0;
+        break;
+    }
+    mutex_unlock(&demo_queues_lock);
+    return ret;
+}
+
+// Take a registered queue out of service and drop the registry's reference
+// Must be called with demo_queues_lock held.
+static void demo_queue_unlink(struct demo_queue *q)
+{
+    struct demo_queue *s;
+    int i;
+
+    idr_remove(&demo_queues, q->id);
+    demo_for_each_shard(q, s, i)
+        WRITE_ONCE(s->dead, true);
+    WRITE_ONCE(q->dead, true);
+    demo_queue_flush(q);
+    wake_up_interruptible_all(&q->readq);
+    wake_up_interruptible_all(&q->writeq);
+    demo_queue_put(q);
+}
+
+// Destroy a named queue by id
+// Returns: 0, -EPERM for the default queue, -ENOENT if there is no such queue
+static int demo_queue_destroy(u32 id)
+{
+    struct demo_queue *q;
+
+    if (id == SAFE_LKM_QUEUE_DEFAULT)
+        return -EPERM;
+
+    mutex_lock(&demo_queues_lock);
+    q = idr_find(&demo_queues, id);
+    if (q)
+        demo_queue_unlink(q);
+    mutex_unlock(&demo_queues_lock);
+    return q ? 0 : -ENOENT;
+}
+
+// ---------------------------------------------------------------------------
+// Expiry Sweeper
+// ---------------------------------------------------------------------------
+//
+// Receives discard expired messages as they reach the front (see "Message
+// Expiry" in safe_lkm_queue.h). Every expire_sweep_ms a work item also
+// sweeps each queue, so a queue nobody reads still gives back the memory
+// and capacity its expired messages hold. The sweep holds a reference to
+// the queue it is expiring, not demo_queues_lock, so queue creation,
+// lookup and attach never wait for it.
+
+static void demo_sweep(struct work_struct *work);
+static DECLARE_DELAYED_WORK(demo_sweep_work, demo_sweep);
+
+static void demo_sweep(struct work_struct *work)
+{
+    struct demo_queue *q;
+    int id = 0;
+
+    for (;; id++) {
+        mutex_lock(&demo_queues_lock);
+        q = idr_get_next(&demo_queues, &id);
+        if (q)
+            kref_get(&q->ref);
+        mutex_unlock(&demo_queues_lock);
+        if (!q)
+            break;
+
+        demo_queue_expire(q);
+        demo_queue_put(q);
+    }
+
+    schedule_delayed_work(&demo_sweep_work, msecs_to_jiffies(expire_sweep_ms));
+}
+
+// ---------------------------------------------------------------------------
+// Task Registry
+// ---------------------------------------------------------------------------
+//
+// The T, A, C and D commands of /proc/safe_lkm manage a registry of tasks,
+// each a pid with a priority and a CPU. A task is on three structures:
+//   - a hash table keyed by pid, so finding a task is O(1) on average
+//   - an rbtree ordered by priority (higher first, FIFO among equals), so
+//     a priority change is an O(log n) erase and insert, and the highest
+//     priority task is the tree's cached leftmost node
+//   - the task list of its CPU, so a migration is an O(1) list move and a
+//     CPU's tasks are found without looking at anyone else's
+// All three are protected by demo_tasks_lock. Only /proc file operations
+// use the registry, in process context, so it is a mutex; tasks are
+// allocated before it is taken. At most max_tasks tasks exist at once.
+
+#define TASK_HASH_BITS 10
+
+struct demo_task {
+    int pid;                    // Registry key, not checked against real tasks
+    int prio;                   // Higher is more important
+    int cpu;                    // CPU whose task list this task is on
+    struct hlist_node hnode;    // demo_task_hash
+    struct rb_node rb;          // demo_task_tree
+    struct list_head cpu_list;  // demo_task_cpus.tasks of cpu
+};
+
+struct demo_task_cpu {
+    struct list_head tasks;
+    unsigned int count;
 };
 
-// Message queue with dual priority levels
-struct demo_msg_queue {
-    struct list_head high;    // High priority queue (type >= 5)
-    struct list_head normal;  // Normal priority queue (type < 5)
-    int count;                // Total message count
-};
+static DEFINE_HASHTABLE(demo_task_hash, TASK_HASH_BITS);
+static struct rb_root_cached demo_task_tree = RB_ROOT_CACHED;
+static DEFINE_PER_CPU(struct demo_task_cpu, demo_task_cpus);
+static DEFINE_MUTEX(demo_tasks_lock);
+static unsigned int demo_task_count;
+
+// Must be called with demo_tasks_lock held.
+static struct demo_task *demo_task_find(int pid)
+{
+    struct demo_task *t;
+
+    hash_for_each_possible(demo_task_hash, t, hnode, pid) {
+        if (t->pid == pid)
+            return t;
+    }
+    return NULL;
+}
+
+// Tree order: higher priority first; equal priorities keep insertion order
+static bool demo_task_less(struct rb_node *a, const struct rb_node *b)
+{
+    return rb_entry(a, struct demo_task, rb)->prio >
+           rb_entry(b, struct demo_task, rb)->prio;
+}
+
+// Register a task on the calling CPU (T command)
+// Returns: 0, -EEXIST if pid is registered, -ENOSPC at max_tasks, -ENOMEM
+static int demo_task_create(int pid, int prio)
+{
+    struct demo_task_cpu *tc;
+    struct demo_task *t;
+    int ret = 0;
+
+    t = kmalloc(sizeof(*t), GFP_KERNEL);
+    if (!t)
+        return -ENOMEM;
+    t->pid = pid;
+    t->prio = prio;
+
+    mutex_lock(&demo_tasks_lock);
+    if (demo_task_find(pid)) {
+        ret = -EEXIST;
+    } else if (demo_task_count >= max_tasks) {
+        ret = -ENOSPC;
+    } else {
+        t->cpu = raw_smp_processor_id();
+        tc = per_cpu_ptr(&demo_task_cpus, t->cpu);
+        hash_add(demo_task_hash, &t->hnode, pid);
+        rb_add_cached(&t->rb, &demo_task_tree, demo_task_less);
+        list_add_tail(&t->cpu_list, &tc->tasks);
+        tc->count++;
+        demo_task_count++;
+        t = NULL;
+    }
+    mutex_unlock(&demo_tasks_lock);
+
+    kfree(t);
+    return ret;
+}
+
+// Change a task's priority (A command): it goes behind the tasks already
+// at the new priority
+// Returns: 0, or -ENOENT if pid is not registered
+static int demo_task_set_prio(int pid, int prio)
+{
+    struct demo_task *t;
+
+    mutex_lock(&demo_tasks_lock);
+    t = demo_task_find(pid);
+    if (t && t->prio != prio) {
+        rb_erase_cached(&t->rb, &demo_task_tree);
+        t->prio = prio;
+        rb_add_cached(&t->rb, &demo_task_tree, demo_task_less);
+    }
+    mutex_unlock(&demo_tasks_lock);
+    return t ? 0 : -ENOENT;
+}
+
+// Move a task to another CPU's list (C command)
+// Returns: 0, -EINVAL if cpu is not a possible CPU, -ENOENT if pid is not
+//          registered
+static int demo_task_migrate(int pid, int cpu)
+{
+    struct demo_task *t;
+
+    if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_possible(cpu))
+        return -EINVAL;
+
+    mutex_lock(&demo_tasks_lock);
+    t = demo_task_find(pid);
+    if (t && t->cpu != cpu) {
+        per_cpu_ptr(&demo_task_cpus, t->cpu)->count--;
+        list_move_tail(&t->cpu_list, &per_cpu_ptr(&demo_task_cpus, cpu)->tasks);
+        per_cpu_ptr(&demo_task_cpus, cpu)->count++;
+        t->cpu = cpu;
+    }
+    mutex_unlock(&demo_tasks_lock);
+    return t ? 0 : -ENOENT;
+}
+
+// Unlink a task from every structure
+// Must be called with demo_tasks_lock held.
+static void demo_task_unlink(struct demo_task *t)
+{
+    hash_del(&t->hnode);
+    rb_erase_cached(&t->rb, &demo_task_tree);
+    list_del(&t->cpu_list);
+    per_cpu_ptr(&demo_task_cpus, t->cpu)->count--;
+    demo_task_count--;
+}
+
+// Remove a task (D command)
+// Returns: 0, or -ENOENT if pid is not registered
+static int demo_task_delete(int pid)
+{
+    struct demo_task *t;
+
+    mutex_lock(&demo_tasks_lock);
+    t = demo_task_find(pid);
+    if (t)
+        demo_task_unlink(t);
+    mutex_unlock(&demo_tasks_lock);
+
+    kfree(t);
+    return t ? 0 : -ENOENT;
+}
+
+// Number of tasks and the highest priority one, for the status file
+// Returns: the task count; *pid and *prio are only set if it is non-zero
+static unsigned int demo_task_top(int *pid, int *prio)
+{
+    struct rb_node *first;
+    unsigned int count;
+
+    mutex_lock(&demo_tasks_lock);
+    count = demo_task_count;
+    first = rb_first_cached(&demo_task_tree);
+    if (first) {
+        *pid = rb_entry(first, struct demo_task, rb)->pid;
+        *prio = rb_entry(first, struct demo_task, rb)->prio;
+    }
+    mutex_unlock(&demo_tasks_lock);
+    return count;
+}
+
+static void demo_tasks_init(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        INIT_LIST_HEAD(&per_cpu_ptr(&demo_task_cpus, cpu)->tasks);
+}
+
+// ---------------------------------------------------------------------------
+// Proc Filesystem Interface
+// ---------------------------------------------------------------------------
+
+// Read function - displays current queue status
+static ssize_t proc_read(struct file *file, char __user *buf,
+                         size_t count, loff_t *ppos)
+{
+    struct demo_queue *q = demo_default_queue;
+    char kbuff[1536];
+    int len;
+    struct demo_snapshot snap;
+    int total, high_count, normal_count;
+    int top_pid = 0, top_prio = 0;
+    unsigned int tasks;
+
+    if (*ppos > 0) return 0;
+
+    // Read the counters (no list walk under the lock)
+    demo_snapshot(q, &snap);
+    total = snap.count;
+    high_count = snap.depth[CLASS_HIGH];
+    normal_count = snap.depth[CLASS_NORMAL];
+    tasks = demo_task_top(&top_pid, &top_prio);
+
+    // Build status information
+    len = snprintf(kbuff, sizeof(kbuff), 
+                   "=== IPC Priority Message Queue - Assignment 2 (Option B) ===\n\n"
+                   "Current Status:\n"
+                   "  Total messages: %d\n"
+                   "  High priority (type >= %d): %d messages\n"
+                   "  Normal priority (type < %d): %d messages\n"
+                   "  Priority levels: %u\n"
+                   "  Tasks: %u (highest priority: pid %d, prio %d)\n\n"
+                   "Available Commands (write to this file):\n"
+                   "  S <pid> <type> <message> - Send message\n"
+                   "  R                        - Receive message\n"
+                   "  T <pid> <prio>           - Register task\n"
+                   "  A <pid> <prio> [<type>]  - Change task priority; with a\n"
+                   "                             type, also move its queued\n"
+                   "                             messages to that type's level\n"
+                   "  C <pid> <cpu>            - Move task to a CPU\n"
+                   "  D <pid>                  - Remove task\n\n"
+                   "Priority Rules:\n"
+                   "  - Messages with type >= %d are HIGH priority\n"
+                   "  - Messages with type < %d are NORMAL priority\n"
+                   "  - HIGH priority messages are received first\n"
+                   "  - Within same priority: FIFO order\n"
+                   "  - With prio_levels > 2, a higher type is received first\n\n"
+                   "Examples:\n"
+                   "  echo \"S 1001 3 Hello\" > /proc/safe_lkm    (Normal priority)\n"
+                   "  echo \"S 1002 10 Urgent\" > /proc/safe_lkm  (High priority)\n"
+                   "  echo \"R\" > /proc/safe_lkm                 (Receive message)\n\n",
+                   total, HIGH_PRIO_THRESHOLD, high_count,
+                   HIGH_PRIO_THRESHOLD, normal_count, q->prio_levels,
+                   tasks, top_pid, top_prio,
+                   HIGH_PRIO_THRESHOLD, HIGH_PRIO_THRESHOLD);
+
+    // snprintf() reports the untruncated length
+    len = min_t(size_t, min_t(size_t, len, sizeof(kbuff) - 1), count);
+    if (copy_to_user(buf, kbuff, len)) return -EFAULT;
+    *ppos = len;
+    return len;
+}
+
+// Write function - handles commands from user space
+static ssize_t proc_write(struct file *file, const char __user *buf,
+                          size_t count, loff_t *ppos)
+{
+    char kbuf[128];
+    int pid, type, arg, ret = 0;
+    char text[64];
+    struct demo_msg *received_msg;
+
+    if (count > sizeof(kbuf)-1) return -EINVAL;
+    if (copy_from_user(kbuf, buf, count)) return -EFAULT;
+    kbuf[count] = '\0';
+
+    // Parse and execute commands
+    if (sscanf(kbuf, "S %d %d %63[^\n]", &pid, &type, text) == 3) {
+        // Send message command
+        if (demo_send_msg(pid, type, text) == -EAGAIN)
+            printk(KERN_WARNING "[safe_lkm] Queue full, message dropped\n");
+    } else if (strncmp(kbuf, "R", 1) == 0) {
+        // Receive message command
+        if (demo_receive_msg(&received_msg) == 0) {
+            printk(KERN_INFO "[safe_lkm] User received: PID=%d, Type=%d, Text=%.*s\n",
+                   received_msg->pid, received_msg->type,
+                   (int)min_t(u32, received_msg->len, MSG_INLINE_SIZE),
+                   received_msg->data);
+            demo_free_msg(received_msg);
+        }
+    } else if (sscanf(kbuf, "T %d %d", &pid, &arg) == 2) {
+        ret = demo_task_create(pid, arg);
+    } else if (sscanf(kbuf, "A %d %d %d", &pid, &arg, &type) == 3) {
+        // Task priorities and message types are different scales: the
+        // backlog only moves when a type is given. A pid that only has
+        // messages queued is not an error.
+        ret = demo_task_set_prio(pid, arg);
+        if (demo_reprio_pid(pid, type) > 0 && ret == -ENOENT)
+            ret = 0;
+    } else if (sscanf(kbuf, "A %d %d", &pid, &arg) == 2) {
+        // Registry only: a reprioritization would build the queue indexes
+        ret = demo_task_set_prio(pid, arg);
+    } else if (sscanf(kbuf, "C %d %d", &pid, &arg) == 2) {
+        ret = demo_task_migrate(pid, arg);
+    } else if (sscanf(kbuf, "D %d", &pid) == 1) {
+        ret = demo_task_delete(pid);
+    } else {
+        printk(KERN_WARNING "[safe_lkm] Unknown command: %s\n", kbuf);
+        printk(KERN_INFO "[safe_lkm] Valid commands: S <pid> <type> <msg>, R, "
+               "T/A <pid> <prio>, A <pid> <prio> <type>, C <pid> <cpu>, D <pid>\n");
+    }
+
+    // Task commands fail quietly but for a rate-limited line: scripts
+    // replay them in bulk
+    if (ret)
+        printk_ratelimited(KERN_WARNING "[safe_lkm] %c %d: error %d\n",
+                           kbuf[0], pid, ret);
+    return count;
+}
+
+static const struct proc_ops proc_fops = {
+    .proc_read = proc_read,
+    .proc_write = proc_write,
+    .proc_lseek = default_llseek,
+};
+
+// Stats file - one key=value pair per line, meant for scrapers
+// The key names and their meaning are a stable interface: new keys may be
+// appended, existing ones are never renamed or removed. Queue counters are
+// for the default queue; /proc/safe_lkm_queues covers the named ones.
+//   enqueued, dequeued      - messages ever enqueued/dequeued
+//   depth                   - messages currently queued
+//   peak_depth              - highest depth since load
+//   bytes_queued            - payload bytes currently queued
+//   alloc_failures          - sends that failed to allocate memory
+//   staged                  - messages on per-CPU stages, not yet counted
+//                             in depth (approximate, percpu_staging=1)
+//   ring_queued             - normal messages still in the lock-free ring,
+//                             already included in depth (normal_ring_size=N)
+//   ring_full               - sends rejected because the ring was full
+//   <key>_high, <key>_normal - the same counters split into type >= 5 and
+//                             type < 5 (with 3-5 levels, the top level
+//                             reports as high)
+//   prio_levels             - number of priority levels
+//   depth_level<N>          - messages queued at level N, 0 = served first
+//   latency_p99_us_high, latency_p99_us_normal
+//                           - 99th percentile time from send to dequeue
+//                             since load, in us (power-of-two resolution)
+//   latency_p99_us_level<N> - the same per priority level
+//   dequeue_policy          - 0 strict priority, 1 weighted round-robin
+//   aged                    - messages served ahead of a higher level
+//                             because they passed age_deadline_ms
+//   shm_slots               - shared-memory payload slots (shm_slots=N)
+//   shm_slots_used          - slots reserved by clients or queued
+//   capacity                - queue_capacity, 0 = unlimited
+//   queue_full              - sends rejected because of capacity
+//   capacity_high           - capacity_high, 0 = unlimited
+//   capacity_normal         - capacity_normal, 0 = unlimited
+//   overflow_policy         - SAFE_LKM_OVERFLOW_* in effect
+//   dropped                 - queued messages discarded to make room
+//   blocked                 - sends that had to wait for room
+//   expired                 - messages discarded undelivered because
+//                             they passed their deadline (SET_TTL)
+//   tasks                   - tasks in the registry (T command)
+//   reprioritized           - queued messages moved to another level
+//                             (A command, REPRIO); a moved message counts
+//                             in enqueued_* of the class it moved to, so
+//                             enqueued_* - dequeued_* = depth_* still holds
+//   numa_shards             - queue shards, one per online NUMA node with
+//                             numa_shards=1, else 1
+//   last_seq                - sequence number of the last message sent,
+//                             0 before the first (see SAFE_LKM_IOC_PEEK)
+//   exported                - messages moved out by SAFE_LKM_IOC_EXPORT;
+//                             not dequeues, so they are not in dequeued_*
+//                             or the latency keys, and enqueued_* -
+//                             dequeued_* - exported = depth overall
+static int stats_show(struct seq_file *sf, void *v)
+{
+    struct demo_queue *q = demo_default_queue;
+    struct demo_snapshot snap;
+    u32 level;
+
+    demo_snapshot(q, &snap);
+
+    seq_printf(sf, "enqueued=%llu\n",
+               snap.enqueued[CLASS_HIGH] + snap.enqueued[CLASS_NORMAL]);
+    seq_printf(sf, "dequeued=%llu\n",
+               snap.dequeued[CLASS_HIGH] + snap.dequeued[CLASS_NORMAL]);
+    seq_printf(sf, "depth=%d\n", snap.count);
+    seq_printf(sf, "peak_depth=%d\n", snap.peak);
+    seq_printf(sf, "bytes_queued=%llu\n", snap.bytes);
+    seq_printf(sf, "alloc_failures=%lld\n", atomic64_read(&demo_alloc_failures));
+    seq_printf(sf, "enqueued_high=%llu\n", snap.enqueued[CLASS_HIGH]);
+    seq_printf(sf, "enqueued_normal=%llu\n", snap.enqueued[CLASS_NORMAL]);
+    seq_printf(sf, "dequeued_high=%llu\n", snap.dequeued[CLASS_HIGH]);
+    seq_printf(sf, "dequeued_normal=%llu\n", snap.dequeued[CLASS_NORMAL]);
+    seq_printf(sf, "depth_high=%d\n", snap.depth[CLASS_HIGH]);
+    seq_printf(sf, "depth_normal=%d\n", snap.depth[CLASS_NORMAL]);
+    seq_printf(sf, "staged=%ld\n", snap.staged);
+    seq_printf(sf, "ring_queued=%lu\n", snap.ring_queued);
+    seq_printf(sf, "ring_full=%lld\n", snap.ring_full);
+    seq_printf(sf, "prio_levels=%u\n", q->prio_levels);
+    for (level = 0; level < q->prio_levels; level++)
+        seq_printf(sf, "depth_level%u=%d\n", level, snap.level_depth[level]);
+    seq_printf(sf, "latency_p99_us_high=%llu\n", snap.p99_us[CLASS_HIGH]);
+    seq_printf(sf, "latency_p99_us_normal=%llu\n", snap.p99_us[CLASS_NORMAL]);
+    for (level = 0; level < q->prio_levels; level++)
+        seq_printf(sf, "latency_p99_us_level%u=%llu\n", level, snap.level_p99_us[level]);
+    seq_printf(sf, "dequeue_policy=%u\n", READ_ONCE(dequeue_policy));
+    seq_printf(sf, "aged=%llu\n", snap.aged);
+    seq_printf(sf, "shm_slots=%u\n", demo_shm ? shm_slots : 0);
+    seq_printf(sf, "shm_slots_used=%u\n", demo_shm_in_use());
+    seq_printf(sf, "capacity=%u\n", q->capacity);
+    seq_printf(sf, "queue_full=%lld\n", snap.full);
+    seq_printf(sf, "capacity_high=%u\n", q->class_capacity[CLASS_HIGH]);
+    seq_printf(sf, "capacity_normal=%u\n", q->class_capacity[CLASS_NORMAL]);
+    seq_printf(sf, "overflow_policy=%u\n", q->overflow);
+    seq_printf(sf, "dropped=%lld\n", snap.dropped);
+    seq_printf(sf, "blocked=%lld\n", snap.blocked);
+    seq_printf(sf, "expired=%lld\n", snap.expired);
+    seq_printf(sf, "tasks=%u\n", READ_ONCE(demo_task_count));
+    seq_printf(sf, "reprioritized=%llu\n", snap.reprioritized);
+    seq_printf(sf, "numa_shards=%u\n", q->nr_shards);
+    seq_printf(sf, "last_seq=%llu\n", snap.seq);
+    seq_printf(sf, "exported=%llu\n", snap.exported);
+    return 0;
+}
+
+// Queue list - a header line, then one line per queue:
+//   id name prio_levels capacity depth enqueued dequeued full dropped expired
+static int queues_show(struct seq_file *sf, void *v)
+{
+    struct demo_snapshot *snap;
+    struct demo_queue *q;
+    int id;
+
+    snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap) return -ENOMEM;
+
+    seq_printf(sf, "%-4s %-31s %6s %10s %10s %12s %12s %10s %10s %10s\n", "id", "name",
+               "levels", "capacity", "depth", "enqueued", "dequeued", "full",
+               "dropped", "expired");
+    mutex_lock(&demo_queues_lock);
+    idr_for_each_entry(&demo_queues, q, id) {
+        demo_snapshot(q, snap);
+        seq_printf(sf, "%-4u %-31s %6u %10u %10d %12llu %12llu %10lld %10lld %10lld\n",
+                   q->id, q->name, q->prio_levels, q->capacity,
+                   snap->count + (int)snap->staged,
+                   snap->enqueued[CLASS_HIGH] + snap->enqueued[CLASS_NORMAL],
+                   snap->dequeued[CLASS_HIGH] + snap->dequeued[CLASS_NORMAL],
+                   snap->full, snap->dropped, snap->expired);
+    }
+    mutex_unlock(&demo_queues_lock);
+
+    kfree(snap);
+    return 0;
+}
+
+// Latency histograms of the default queue, in ns (see "Latency Histograms"
+// in safe_lkm_queue.h). Per histogram, a summary line
+//   <name> count=<n> p50=<ns> p90=<ns> p99=<ns> p999=<ns> max=<ns>
+// where percentiles are bucket upper bounds, then one line per non-empty
+// bucket
+//   <name> <lo> <hi> <count>            samples in [lo, hi)
+// Names: residence_high, residence_normal (send to dequeue, type >= 5 and
+// type < 5), enqueue (one message linked), dequeue (one receive).
+static int latency_show(struct seq_file *sf, void *v)
+{
+    static const char * const names[NR_LAT_KINDS] = {
+        [LAT_RESIDENCE + CLASS_HIGH] = "residence_high",
+        [LAT_RESIDENCE + CLASS_NORMAL] = "residence_normal",
+        [LAT_ENQUEUE] = "enqueue",
+        [LAT_DEQUEUE] = "dequeue",
+    };
+    struct demo_queue *q = demo_default_queue;
+    u64 *hist, total;
+    int kind;
+    u32 b;
+
+    hist = kmalloc_array(LL_BUCKETS, sizeof(*hist), GFP_KERNEL);
+    if (!hist) return -ENOMEM;
+
+    for (kind = 0; kind < NR_LAT_KINDS; kind++) {
+        total = demo_lat_read(q, kind, hist);
+        seq_printf(sf, "%s count=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n",
+                   names[kind], total,
+                   demo_ll_percentile(hist, total, 500),
+                   demo_ll_percentile(hist, total, 900),
+                   demo_ll_percentile(hist, total, 990),
+                   demo_ll_percentile(hist, total, 999),
+                   demo_ll_percentile(hist, total, 1000));
+        for (b = 0; b < LL_BUCKETS; b++) {
+            if (hist[b])
+                seq_printf(sf, "%s %llu %llu %llu\n", names[kind],
+                           demo_ll_bucket_lo(b), demo_ll_bucket_lo(b + 1), hist[b]);
+        }
+    }
+
+    kfree(hist);
+    return 0;
+}
+
+// Message dump - a header line, then one line per message queued on the
+// default queue, in delivery order:
+//   seq level pid type len age_us data
+// with up to SAFE_LKM_PEEK_DATA payload bytes, unprintable ones as '.'.
+// Messages are read off a browse cursor PEEK_CHUNK at a time (see "IPC
+// Functions - Browse"), so dumping a large backlog never holds the queue
+// lock for long, and come with the same caveats as SAFE_LKM_IOC_PEEK.
+struct msgs_iter {
+    struct demo_cursor c;
+    loff_t base;               // Position of recs[0]; records start at 1
+    int n;                     // Records in recs
+    struct safe_lkm_peek_rec recs[PEEK_CHUNK];
+};
+
+static void *msgs_get(struct msgs_iter *it, loff_t pos)
+{
+    // Seeking back starts the pass over
+    if (pos < it->base) {
+        demo_cursor_start(&it->c, demo_default_queue, 0);
+        it->base = 1;
+        it->n = 0;
+    }
+    while (pos >= it->base + it->n) {
+        it->base += it->n;
+        it->n = demo_queue_peek(&it->c, it->recs, PEEK_CHUNK);
+        if (it->n == 0)
+            return NULL;
+    }
+    return &it->recs[pos - it->base];
+}
+
+static void *msgs_start(struct seq_file *sf, loff_t *pos)
+{
+    struct msgs_iter *it = sf->private;
+
+    if (*pos == 0) {
+        demo_cursor_start(&it->c, demo_default_queue, 0);
+        it->base = 1;
+        it->n = 0;
+        return SEQ_START_TOKEN;
+    }
+    return msgs_get(it, *pos);
+}
+
+static void *msgs_next(struct seq_file *sf, void *v, loff_t *pos)
+{
+    return msgs_get(sf->private, ++*pos);
+}
+
+static void msgs_stop(struct seq_file *sf, void *v)
+{
+}
+
+static int msgs_show(struct seq_file *sf, void *v)
+{
+    struct safe_lkm_peek_rec *rec = v;
+    char data[SAFE_LKM_PEEK_DATA + 1];
+    u32 i, len;
+
+    if (v == SEQ_START_TOKEN) {
+        seq_printf(sf, "%-12s %5s %8s %6s %8s %10s %s\n", "seq", "level", "pid",
+                   "type", "len", "age_us", "data");
+        return 0;
+    }
+
+    len = min_t(u32, rec->len, SAFE_LKM_PEEK_DATA);
+    for (i = 0; i < len; i++)
+        data[i] = isprint(rec->data[i]) ? rec->data[i] : '.';
+    data[len] = '\0';
+    seq_printf(sf, "%-12llu %5u %8d %6d %8u %10llu %s\n", rec->seq, rec->level,
+               rec->pid, rec->type, rec->len, div_u64(rec->age_ns, NSEC_PER_USEC), data);
+    return 0;
+}
+
+static const struct seq_operations msgs_seq_ops = {
+    .start = msgs_start,
+    .next = msgs_next,
+    .stop = msgs_stop,
+    .show = msgs_show,
+};
+
+static int msgs_open(struct inode *inode, struct file *file)
+{
+    struct msgs_iter *it = __seq_open_private(file, &msgs_seq_ops, sizeof(*it));
+
+    if (!it) return -ENOMEM;
+    demo_cursor_init(&it->c);
+    return 0;
+}
+
+static int msgs_release(struct inode *inode, struct file *file)
+{
+    struct seq_file *sf = file->private_data;
+    struct msgs_iter *it = sf->private;
+
+    demo_cursor_stop(&it->c);
+    return seq_release_private(inode, file);
+}
+
+static const struct proc_ops msgs_fops = {
+    .proc_open = msgs_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = msgs_release,
+};
+
+// ---------------------------------------------------------------------------
+// Character Device Interface (/dev/safe_lkm)
+// ---------------------------------------------------------------------------
+
+// Per-open-file state
+struct demo_client {
+    long rcv_timeout;          // Jiffies a receive may block (MAX_SCHEDULE_TIMEOUT = forever)
+    u64 ttl_ns;                // Lifetime of messages sent, 0 = never expire
+    struct demo_queue *q;      // Attached queue; a reference unless the default
+    struct mutex peek_lock;    // Serializes PEEKs on the browse cursor
+    struct demo_cursor cursor; // SAFE_LKM_IOC_PEEK position
+};
+
+static int dev_open(struct inode *inode, struct file *file)
+{
+    struct demo_client *c = kmalloc(sizeof(*c), GFP_KERNEL);
+
+    if (!c) return -ENOMEM;
+    c->rcv_timeout = MAX_SCHEDULE_TIMEOUT;
+    c->ttl_ns = 0;
+    c->q = demo_default_queue;
+    mutex_init(&c->peek_lock);
+    demo_cursor_init(&c->cursor);
+    file->private_data = c;
+    return 0;
+}
+
+static int dev_release(struct inode *inode, struct file *file)
+{
+    struct demo_client *c = file->private_data;
+
+    demo_cursor_stop(&c->cursor);
+    if (c->q != demo_default_queue)
+        demo_queue_put(c->q);
+    kfree(c);
+    return 0;
+}
+
+// The queue a file's operations go to
+// Only changes once, from the default queue, so callers may use it for the
+// whole operation without a reference of their own.
+static inline struct demo_queue *dev_queue(struct file *file)
+{
+    struct demo_client *c = file->private_data;
+
+    return READ_ONCE(c->q);
+}
+
+// Deadline of a message sent on this file now (SAFE_LKM_IOC_SET_TTL)
+static inline u64 dev_expiry(struct file *file)
+{
+    struct demo_client *c = file->private_data;
+
+    return c->ttl_ns ? ktime_get_ns() + c->ttl_ns : 0;
+}
+
+// Sleep until a message may be available
+// Parameters:
+//   file    - the receiving file (O_NONBLOCK and receive timeout)
+//   q       - the queue to wait on
+//   f       - only wake for a message this filter accepts, or NULL for any
+//   timeout - jiffies left to wait, updated so retries share one deadline
+// Returns: 0 when woken with something to receive, -EAGAIN if the caller
+//          must not block or the timeout expired, -ERESTARTSYS on a signal,
+//          -ENODEV if the queue was destroyed
+static int dev_wait_msg(struct file *file, struct demo_queue *q,
+                        const struct demo_match *f, long *timeout)
+{
+    long ret;
+
+    if (READ_ONCE(q->dead))
+        return -ENODEV;
+    if ((file->f_flags & O_NONBLOCK) || *timeout == 0)
+        return -EAGAIN;
+
+    ret = wait_event_interruptible_timeout(q->readq,
+                                           f ? demo_queue_has_match(q, f) :
+                                               demo_msg_available(q),
+                                           *timeout);
+    if (ret < 0)
+        return ret;
+    if (READ_ONCE(q->dead))
+        return -ENODEV;
+    if (ret == 0)
+        return -EAGAIN;
+    if (*timeout != MAX_SCHEDULE_TIMEOUT)
+        *timeout = ret;
+    return 0;
+}
+
+// Write function - one binary message per write: header + payload
+// The payload is copied straight into the queued node, no parsing involved.
+static ssize_t dev_write(struct file *file, const char __user *buf,
+                         size_t count, loff_t *ppos)
+{
+    struct demo_queue *q = demo_local_shard(dev_queue(file));
+    struct safe_lkm_hdr hdr;
+    struct demo_msg *m;
+    int ret;
+
+    if (count < sizeof(hdr)) return -EINVAL;
+    if (copy_from_user(&hdr, buf, sizeof(hdr))) return -EFAULT;
+    if (hdr.len > msg_max_size) return -EMSGSIZE;
+    if (count != sizeof(hdr) + hdr.len) return -EINVAL;
+
+    m = demo_alloc_msg(q, hdr.pid, hdr.type, hdr.len);
+    if (!m) return -ENOMEM;
+
+    if (copy_from_user(m->data, buf + sizeof(hdr), hdr.len)) {
+        demo_free_msg(m);
+        return -EFAULT;
+    }
+    m->expires_ns = dev_expiry(file);
+
+    ret = demo_enqueue_msg(q, m, file->f_flags & O_NONBLOCK);
+    if (ret) {
+        demo_free_msg(m);
+        return ret;
+    }
+    return count;
+}
+
+// Read function - dequeues the next message and returns header + payload
+// The payload is copied straight from the dequeued node, outside the lock.
+// Blocks while the queue is empty, see dev_wait_msg().
+// Returns: bytes copied, or an error from dev_wait_msg()
+static ssize_t dev_read(struct file *file, char __user *buf,
+                        size_t count, loff_t *ppos)
+{
+    struct demo_client *c = file->private_data;
+    struct demo_queue *q = dev_queue(file), *s;
+    long timeout = c->rcv_timeout;
+    struct safe_lkm_hdr hdr;
+    struct demo_msg *m;
+    size_t len;
+    int ret;
+
+    if (count < sizeof(hdr)) return -EINVAL;
+    for (;;) {
+        s = demo_pick_shard(q);
+        if (demo_queue_receive(s, &m) == 0)
+            break;
+        ret = dev_wait_msg(file, q, NULL, &timeout);
+        if (ret) return ret;
+    }
+
+    hdr.pid = m->pid;
+    hdr.type = m->type;
+    hdr.len = m->len;
+    len = min_t(size_t, m->len, count - sizeof(hdr));
+
+    if (copy_to_user(buf, &hdr, sizeof(hdr)) ||
+        copy_to_user(buf + sizeof(hdr), m->data, len)) {
+        demo_requeue_msg(s, m);
+        return -EFAULT;
+    }
+
+    demo_free_msg(m);
+    return sizeof(hdr) + len;
+}
+
+// Build the message for one SEND_BATCH descriptor: a copy of the user
+// buffer, or with SAFE_LKM_DESC_SHM a reference to a client-owned slot
+// Returns: the message, or an ERR_PTR
+static struct demo_msg *dev_desc_msg(struct demo_queue *q,
+                                     const struct safe_lkm_desc *desc)
+{
+    struct demo_msg *m;
+    char *data;
+
+    if (desc->flags & ~SAFE_LKM_DESC_SHM)
+        return ERR_PTR(-EINVAL);
+    if (desc->len > msg_max_size)
+        return ERR_PTR(-EMSGSIZE);
 
-static struct demo_msg_queue msg_queue;
-static spinlock_t demo_msg_lock;
+    if (desc->flags & SAFE_LKM_DESC_SHM) {
+        data = demo_shm_claim(desc->buf, desc->len);
+        if (IS_ERR(data))
+            return ERR_PTR(PTR_ERR(data));
+        m = demo_alloc_msg(q, desc->pid, desc->type, 0);
+        if (!m) {
+            demo_shm_release(data, true);
+            return ERR_PTR(-ENOMEM);
+        }
+        m->data = data;
+        m->len = desc->len;
+        return m;
+    }
 
-// ---------------------------------------------------------------------------
-// IPC Functions - Send Message
-// ---------------------------------------------------------------------------
+    m = demo_alloc_msg(q, desc->pid, desc->type, desc->len);
+    if (!m)
+        return ERR_PTR(-ENOMEM);
+    if (copy_from_user(m->data, u64_to_user_ptr(desc->buf), desc->len)) {
+        demo_free_msg(m);
+        return ERR_PTR(-EFAULT);
+    }
+    return m;
+}
 
-// Send a message to the IPC queue
-// Parameters:
-//   pid  - Process ID of sender
-//   type - Message priority/type (>= 5 is high priority)
-//   text - Message content (max 255 chars)
-// Returns: 0 on success, -ENOMEM on allocation failure
-int demo_send_msg(int pid, int type, const char *text)
+// SEND_BATCH - build per-priority runs outside the lock, then splice once
+// With the normal priority ring enabled, normal messages are pushed to the
+// ring as they are built; a full ring ends the batch with -EAGAIN. Room is
+// reserved per message as it is built, so the queue's overflow policy
+// applies to each one; under SAFE_LKM_OVERFLOW_BLOCK the messages built so
+// far are queued before the batch waits for more room.
+static long dev_send_batch(struct file *file, struct safe_lkm_batch *batch)
 {
+    struct demo_queue *q = demo_local_shard(dev_queue(file));
+    struct safe_lkm_desc __user *udescs = u64_to_user_ptr(batch->descs);
+    struct safe_lkm_desc desc;
+    struct demo_batch *b;
     struct demo_msg *m;
-    unsigned long flags;
+    u32 count = min_t(u32, batch->count, SAFE_LKM_BATCH_MAX);
+    long ret = 0;
+    u32 i;
 
-    m = kmalloc(sizeof(*m), GFP_KERNEL);
-    if (!m) {
-        printk(KERN_WARNING "[safe_lkm] Failed to allocate message\n");
-        return -ENOMEM;
+    if (READ_ONCE(q->dead)) return -ENODEV;
+
+    b = demo_batch_alloc();
+    if (!b) return -ENOMEM;
+
+    for (i = 0; i < count; i++) {
+        if (copy_from_user(&desc, &udescs[i], sizeof(desc))) {
+            ret = -EFAULT;
+            break;
+        }
+        m = dev_desc_msg(q, &desc);
+        if (IS_ERR(m)) {
+            ret = PTR_ERR(m);
+            break;
+        }
+        m->expires_ns = dev_expiry(file);
+
+        ret = demo_admit(q, m, file->f_flags & O_NONBLOCK, b);
+        if (!ret && demo_use_ring(q, m))
+            ret = demo_link_msg(q, m);
+        if (ret) {
+            // An unsent slot stays with the client
+            if (demo_shm_contains(m->data))
+                demo_shm_detach(m);
+            demo_free_msg(m);
+            break;
+        }
+        if (demo_use_ring(q, m))
+            continue;
+
+        trace_msg_enqueue(m->pid, m->type, m->len);
+        demo_batch_add(b, m);
     }
 
-    m->pid = pid;
-    m->type = type;
-    strncpy(m->text, text, MSG_SIZE-1);
-    m->text[MSG_SIZE-1] = '\0';
-    INIT_LIST_HEAD(&m->list);
+    if (!bitmap_empty(b->used, SAFE_LKM_PRIO_MAX))
+        demo_enqueue_batch(q, b);
+    kfree(b);
 
-    spin_lock_irqsave(&demo_msg_lock, flags);
-    if (type >= HIGH_PRIO_THRESHOLD) {
-        list_add_tail(&m->list, &msg_queue.high);
-        printk(KERN_INFO "[safe_lkm] High priority message from PID %d: %s\n", pid, text);
+    return i > 0 ? i : ret;
+}
+
+// Copy one detached message out to its descriptor
+// A descriptor flagged SAFE_LKM_DESC_SHM takes a slot-resident payload in
+// place: buf is set to the slot offset and the slot passes to the caller.
+// Any other payload is copied and the flag is cleared.
+static int dev_copy_desc(struct safe_lkm_desc __user *udesc, struct demo_msg *m)
+{
+    struct safe_lkm_desc desc;
+    bool in_place;
+    u32 len;
+
+    if (copy_from_user(&desc, udesc, sizeof(desc))) return -EFAULT;
+
+    in_place = (desc.flags & SAFE_LKM_DESC_SHM) && demo_shm_contains(m->data);
+    if (in_place) {
+        desc.buf = m->data - demo_shm;
     } else {
-        list_add_tail(&m->list, &msg_queue.normal);
-        printk(KERN_INFO "[safe_lkm] Normal priority message from PID %d: %s\n", pid, text);
+        len = min_t(u32, m->len, desc.len);
+        if (copy_to_user(u64_to_user_ptr(desc.buf), m->data, len)) return -EFAULT;
     }
-    msg_queue.count++;
-    spin_unlock_irqrestore(&demo_msg_lock, flags);
 
+    desc.pid = m->pid;
+    desc.type = m->type;
+    desc.len = m->len;
+    desc.flags = in_place ? SAFE_LKM_DESC_SHM : 0;
+    if (copy_to_user(udesc, &desc, sizeof(desc))) return -EFAULT;
+
+    if (in_place)
+        demo_shm_detach(m);
     return 0;
 }
 
-// ---------------------------------------------------------------------------
-// IPC Functions - Receive Message
-// ---------------------------------------------------------------------------
+// RECV_BATCH - detach a run in one critical section, copy out unlocked
+// Blocks like dev_read() until at least one message can be detached.
+static long dev_recv_batch(struct file *file, struct safe_lkm_batch *batch)
+{
+    struct safe_lkm_desc __user *udescs = u64_to_user_ptr(batch->descs);
+    struct demo_client *c = file->private_data;
+    struct demo_queue *q = dev_queue(file), *s;
+    long timeout = c->rcv_timeout;
+    struct demo_msg *m, *tmp;
+    struct demo_batch *b;
+    u32 count = min_t(u32, batch->count, SAFE_LKM_BATCH_MAX);
+    long ret = 0;
+    int n, i = 0;
+    u32 level;
 
-// Receive a message from the IPC queue
-// Priority: HIGH priority messages are retrieved first, then NORMAL
-// Parameters:
-//   out - Pointer to message structure to store received message
-// Returns: 0 on success, -ENOMSG if queue is empty
-int demo_receive_msg(struct demo_msg *out)
-{
-    struct demo_msg *m = NULL;
-    unsigned long flags;
-    int ret = -ENOMSG;
-
-    spin_lock_irqsave(&demo_msg_lock, flags);
-    if (!list_empty(&msg_queue.high)) {
-        m = list_first_entry(&msg_queue.high, struct demo_msg, list);
-        list_del(&m->list);
-        printk(KERN_INFO "[safe_lkm] Received high priority message: %s\n", m->text);
-    } else if (!list_empty(&msg_queue.normal)) {
-        m = list_first_entry(&msg_queue.normal, struct demo_msg, list);
-        list_del(&m->list);
-        printk(KERN_INFO "[safe_lkm] Received normal priority message: %s\n", m->text);
+    if (count == 0) return 0;
+
+    b = demo_batch_alloc();
+    if (!b) return -ENOMEM;
+
+    for (;;) {
+        s = demo_pick_shard(q);
+        n = demo_detach_batch(s, b, count);
+        if (n) break;
+        trace_queue_empty(task_tgid_vnr(current));
+        ret = dev_wait_msg(file, q, NULL, &timeout);
+        if (ret) goto out;
     }
-    
-    if (m) {
-        memcpy(out, m, sizeof(*out));
-        kfree(m);
-        msg_queue.count--;
-        ret = 0;
+
+    // Levels are in delivery order: level 0 first
+    for_each_set_bit(level, b->used, SAFE_LKM_PRIO_MAX) {
+        list_for_each_entry_safe(m, tmp, &b->lists[level], list) {
+            ret = dev_copy_desc(&udescs[i], m);
+            if (ret) break;
+            trace_msg_dequeue(m->pid, m->type, m->len);
+            demo_batch_del(b, m);
+            demo_free_msg(m);
+            i++;
+        }
+        if (ret) break;
+    }
+
+    // A faulting buffer must not lose messages: hand the rest back in order
+    if (i < n)
+        demo_requeue_front(s, b, false);
+out:
+    kfree(b);
+    return i > 0 ? i : ret;
+}
+
+// State of one DRAIN or EXPORT call
+struct dev_drain {
+    char __user *ubuf;          // Where the next record goes
+    char *stage;                // Records packed but not yet copied out
+    size_t size;                // Bytes in stage
+    size_t used;                // Bytes of stage filled
+    int staged;                 // Messages with a record in stage
+    u32 count;                  // Messages copied out
+    struct demo_room room;      // Record layout, bytes of the buffer left
+    bool export;                // struct safe_lkm_export_rec records
+    u64 real_off;               // CLOCK_REALTIME minus ktime_get_ns() (EXPORT)
+};
+
+// Record header of a DRAIN or EXPORT call, whichever d makes
+union dev_drain_hdr {
+    struct safe_lkm_hdr hdr;
+    struct safe_lkm_export_rec rec;
+};
+
+// Fill in the record header for m
+static void dev_drain_hdr(const struct dev_drain *d, const struct demo_msg *m,
+                          union dev_drain_hdr *h)
+{
+    h->hdr.pid = m->pid;
+    h->hdr.type = m->type;
+    h->hdr.len = m->len;
+    if (d->export) {
+        h->rec.level = m->level;
+        h->rec.time_ns = m->enq_ns + d->real_off;
+        h->rec.expires_ns = m->expires_ns ? m->expires_ns + d->real_off : 0;
+    }
+}
+
+// Copy the staged records out, then free their messages
+// They are the first d->staged messages of b in delivery order.
+// Returns: 0, or -EFAULT with the messages still in b
+static int dev_drain_flush(struct dev_drain *d, struct demo_batch *b)
+{
+    struct demo_msg *m, *tmp;
+    u32 level;
+
+    if (d->used && copy_to_user(d->ubuf, d->stage, d->used))
+        return -EFAULT;
+    d->ubuf += d->used;
+    d->used = 0;
+
+    for_each_set_bit(level, b->used, SAFE_LKM_PRIO_MAX) {
+        list_for_each_entry_safe(m, tmp, &b->lists[level], list) {
+            if (!d->staged)
+                return 0;
+            trace_msg_dequeue(m->pid, m->type, m->len);
+            demo_batch_del(b, m);
+            demo_free_msg(m);
+            d->staged--;
+            d->count++;
+        }
+    }
+    return 0;
+}
+
+// Copy one record straight out, for a message bigger than the stage
+static int dev_drain_direct(struct dev_drain *d, const struct demo_msg *m)
+{
+    static const char zero[SAFE_LKM_EXPORT_ALIGN];
+    size_t rec = demo_room_reclen(&d->room, m->len);
+    size_t hlen = d->room.hdr;
+    union dev_drain_hdr h;
+
+    dev_drain_hdr(d, m, &h);
+    if (copy_to_user(d->ubuf, &h, hlen) ||
+        copy_to_user(d->ubuf + hlen, m->data, m->len) ||
+        copy_to_user(d->ubuf + hlen + m->len, zero, rec - hlen - m->len))
+        return -EFAULT;
+    d->ubuf += rec;
+    d->staged = 1;              // Free it like a staged one
+    return 0;
+}
+
+// Pack every message of a detached batch into records and copy them out
+// Returns: 0, or -EFAULT with the messages not copied out still in b
+static int dev_drain_pack(struct dev_drain *d, struct demo_batch *b)
+{
+    size_t hlen = d->room.hdr, rec;
+    union dev_drain_hdr h;
+    struct demo_msg *m, *tmp;
+    char *p;
+    u32 level;
+    int ret;
+
+    for_each_set_bit(level, b->used, SAFE_LKM_PRIO_MAX) {
+        list_for_each_entry_safe(m, tmp, &b->lists[level], list) {
+            rec = demo_room_reclen(&d->room, m->len);
+
+            if (rec > d->size - d->used) {
+                ret = dev_drain_flush(d, b);
+                if (ret) return ret;
+            }
+            if (rec > d->size) {
+                ret = dev_drain_direct(d, m) ?: dev_drain_flush(d, b);
+                if (ret) return ret;
+                continue;
+            }
+
+            // Padding is zeroed: stage is copied out whole
+            p = d->stage + d->used;
+            dev_drain_hdr(d, m, &h);
+            memcpy(p, &h, hlen);
+            memcpy(p + hlen, m->data, m->len);
+            memset(p + hlen + m->len, 0, rec - hlen - m->len);
+            d->used += rec;
+            d->staged++;
+        }
+    }
+    return dev_drain_flush(d, b);
+}
+
+// DRAIN - detach runs of up to SAFE_LKM_BATCH_MAX messages, one lock hold
+// each, and copy them out as packed records until the buffer is full
+// Blocks like dev_read() until at least one message can be detached.
+// EXPORT is the same with export records, and returns 0 on an empty queue;
+// it is not a dequeue (see demo_cut_msgs()).
+static long dev_drain(struct file *file, struct safe_lkm_drain __user *ureq, bool export)
+{
+    struct demo_client *c = file->private_data;
+    struct demo_queue *q = dev_queue(file), *s;
+    long timeout = c->rcv_timeout;
+    struct safe_lkm_drain req;
+    struct dev_drain d = { };
+    struct demo_batch *b;
+    u32 max;
+    long ret = 0;
+    int n;
+
+    if (copy_from_user(&req, ureq, sizeof(req))) return -EFAULT;
+
+    d.export = export;
+    d.room.export = export;
+    if (export) {
+        d.room.hdr = sizeof(struct safe_lkm_export_rec);
+        d.room.align = SAFE_LKM_EXPORT_ALIGN;
+        d.real_off = ktime_get_real_ns() - ktime_get_ns();
     } else {
-        printk(KERN_INFO "[safe_lkm] No messages available\n");
+        d.room.hdr = sizeof(struct safe_lkm_hdr);
+        d.room.align = SAFE_LKM_DRAIN_ALIGN;
     }
-    spin_unlock_irqrestore(&demo_msg_lock, flags);
-    
+    if (req.len < demo_room_reclen(&d.room, 0)) return -EMSGSIZE;
+
+    max = req.max ?: U32_MAX;
+    d.room.bytes = req.len;
+    d.ubuf = u64_to_user_ptr(req.buf);
+    d.size = min_t(size_t, req.len, DRAIN_CHUNK);
+
+    b = demo_batch_alloc();
+    d.stage = kvmalloc(d.size, GFP_KERNEL);
+    if (!b || !d.stage) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    while (d.count < max && d.room.bytes) {
+        s = demo_pick_shard(q);
+        n = demo_detach_run(s, b, min_t(u32, max - d.count, SAFE_LKM_BATCH_MAX), &d.room);
+        if (n == 0) {
+            if (d.count) break;
+            if (!d.room.bytes) {
+                ret = -EMSGSIZE;    // The next message alone does not fit
+                break;
+            }
+            if (export) break;
+            trace_queue_empty(task_tgid_vnr(current));
+            ret = dev_wait_msg(file, q, NULL, &timeout);
+            if (ret) break;
+            continue;
+        }
+
+        ret = dev_drain_pack(&d, b);
+        if (ret) {
+            // Not lost: the messages not yet copied out go back in order
+            demo_requeue_front(s, b, export);
+            break;
+        }
+        demo_batch_init(b);
+    }
+
+    if (d.count) {
+        req.count = d.count;
+        req.bytes = d.ubuf - (char __user *)u64_to_user_ptr(req.buf);
+        if (copy_to_user(ureq, &req, sizeof(req)))
+            ret = -EFAULT;
+        else
+            ret = d.count;
+    }
+out:
+    kvfree(d.stage);
+    kfree(b);
     return ret;
 }
 
-// ---------------------------------------------------------------------------
-// Proc Filesystem Interface
-// ---------------------------------------------------------------------------
+// A CLOCK_REALTIME time from an export record as a ktime_get_ns() time
+// now and real_now are the current time on either clock; a time before
+// boot becomes 1, so a deadline that long past still reads as one.
+static u64 dev_import_time(u64 real_ns, u64 now, u64 real_now)
+{
+    if (real_ns > real_now)
+        return now + (real_ns - real_now);
+    return real_now - real_ns < now ? now - (real_now - real_ns) : 1;
+}
 
-// Read function - displays current queue status
-static ssize_t proc_read(struct file *file, char __user *buf,
-                         size_t count, loff_t *ppos)
+// IMPORT - queue export records in order on an empty queue, or one holding
+// only earlier imports, admitted as by dev_send_batch() and spliced on in
+// runs of up to SAFE_LKM_BATCH_MAX, one lock hold each
+static long dev_import(struct file *file, struct safe_lkm_drain __user *ureq)
 {
-    char kbuff[512];
-    int len;
-    unsigned long flags;
-    int high_count = 0, normal_count = 0;
+    struct demo_queue *q = demo_local_shard(dev_queue(file));
+    struct safe_lkm_export_rec rec;
+    struct safe_lkm_drain req;
+    struct safe_lkm_desc desc;
+    struct demo_batch *b;
     struct demo_msg *m;
+    u64 off = 0, now, real_now, enq_ns, last_seq = 0;
+    u32 max, count = 0;
+    int pending = 0;
+    long ret = 0;
+    bool ring;
 
-    if (*ppos > 0) return 0;
+    if (copy_from_user(&req, ureq, sizeof(req))) return -EFAULT;
+    if (READ_ONCE(q->dead)) return -ENODEV;
+    ret = demo_queue_import_begin(dev_queue(file));
+    if (ret) return ret;
+
+    b = demo_batch_alloc();
+    if (!b) return -ENOMEM;
+
+    max = req.max ?: U32_MAX;
+    now = ktime_get_ns();
+    real_now = ktime_get_real_ns();
+
+    while (count < max && off < req.len) {
+        if (req.len - off < sizeof(rec)) {
+            ret = -EINVAL;
+            break;
+        }
+        if (copy_from_user(&rec, u64_to_user_ptr(req.buf + off), sizeof(rec))) {
+            ret = -EFAULT;
+            break;
+        }
+        if (SAFE_LKM_EXPORT_RECLEN((u64)rec.hdr.len) > req.len - off) {
+            ret = -EINVAL;
+            break;
+        }
+
+        desc = (struct safe_lkm_desc){
+            .pid = rec.hdr.pid,
+            .type = rec.hdr.type,
+            .len = rec.hdr.len,
+            .buf = req.buf + off + sizeof(rec),
+        };
+        m = dev_desc_msg(q, &desc);
+        if (IS_ERR(m)) {
+            ret = PTR_ERR(m);
+            break;
+        }
+        if (rec.level < q->prio_levels)
+            m->level = rec.level;
+        if (rec.expires_ns)
+            m->expires_ns = dev_import_time(rec.expires_ns, now, real_now);
+        enq_ns = min(dev_import_time(rec.time_ns, now, real_now), now);
+
+        // A message on the ring may be received as soon as it is linked
+        ring = demo_use_ring(q, m);
+        ret = demo_admit(q, m, file->f_flags & O_NONBLOCK, b);
+        if (!ret) {
+            m->enq_ns = enq_ns;     // Admission stamped it with now
+            last_seq = m->seq;
+            if (ring)
+                ret = demo_link_msg(q, m);
+        }
+        if (ret) {
+            demo_free_msg(m);
+            break;
+        }
+        off += SAFE_LKM_EXPORT_RECLEN(rec.hdr.len);
+        count++;
+        if (ring)
+            continue;
 
-    // Count messages in each queue
-    spin_lock_irqsave(&demo_msg_lock, flags);
-    list_for_each_entry(m, &msg_queue.high, list) {
-        high_count++;
+        trace_msg_enqueue(m->pid, m->type, m->len);
+        demo_batch_add(b, m);
+        if (++pending == SAFE_LKM_BATCH_MAX) {
+            demo_enqueue_batch(q, b);
+            pending = 0;
+        }
     }
-    list_for_each_entry(m, &msg_queue.normal, list) {
-        normal_count++;
+
+    if (!bitmap_empty(b->used, SAFE_LKM_PRIO_MAX))
+        demo_enqueue_batch(q, b);
+    kfree(b);
+
+    if (count) {
+        // The next IMPORT may go on from here, see demo_queue_import_begin()
+        WRITE_ONCE(q->home->import_seq, last_seq);
+        req.count = count;
+        req.bytes = off;
+        if (copy_to_user(ureq, &req, sizeof(req)))
+            return -EFAULT;
+        return count;
     }
-    spin_unlock_irqrestore(&demo_msg_lock, flags);
+    return ret;
+}
 
-    // Build status information
-    len = snprintf(kbuff, sizeof(kbuff), 
-                   "=== IPC Priority Message Queue - Assignment 2 (Option B) ===\n\n"
-                   "Current Status:\n"
-                   "  Total messages: %d\n"
-                   "  High priority (type >= %d): %d messages\n"
-                   "  Normal priority (type < %d): %d messages\n\n"
-                   "Available Commands (write to this file):\n"
-                   "  S <pid> <type> <message> - Send message\n"
-                   "  R                        - Receive message\n\n"
-                   "Priority Rules:\n"
-                   "  - Messages with type >= %d are HIGH priority\n"
-                   "  - Messages with type < %d are NORMAL priority\n"
-                   "  - HIGH priority messages are received first\n"
-                   "  - Within same priority: FIFO order\n\n"
-                   "Examples:\n"
-                   "  echo \"S 1001 3 Hello\" > /proc/safe_lkm    (Normal priority)\n"
-                   "  echo \"S 1002 10 Urgent\" > /proc/safe_lkm  (High priority)\n"
-                   "  echo \"R\" > /proc/safe_lkm                 (Receive message)\n\n",
-                   msg_queue.count, HIGH_PRIO_THRESHOLD, high_count,
-                   HIGH_PRIO_THRESHOLD, normal_count,
-                   HIGH_PRIO_THRESHOLD, HIGH_PRIO_THRESHOLD);
+// RECV_MATCH - the oldest message from a sender and/or of a type
+// Blocks like dev_read() until a matching message is queued.
+static long dev_recv_match(struct file *file, struct safe_lkm_match __user *umatch)
+{
+    struct demo_client *c = file->private_data;
+    struct demo_queue *q = dev_queue(file), *s;
+    long timeout = c->rcv_timeout;
+    struct safe_lkm_match req;
+    struct demo_match f;
+    struct demo_msg *m;
+    int ret;
 
-    if (copy_to_user(buf, kbuff, len)) return -EFAULT;
-    *ppos = len;
-    return len;
+    if (copy_from_user(&req, umatch, sizeof(req))) return -EFAULT;
+    if (req.pad || !req.match ||
+        (req.match & ~(SAFE_LKM_MATCH_PID | SAFE_LKM_MATCH_TYPE)))
+        return -EINVAL;
+
+    f.flags = req.match;
+    f.pid = req.pid;
+    f.type = req.type;
+    for (;;) {
+        s = demo_match_shard(q, &f);
+        if (demo_queue_receive_match(s, &f, &m) == 0)
+            break;
+        trace_queue_empty(task_tgid_vnr(current));
+        ret = dev_wait_msg(file, q, &f, &timeout);
+        if (ret) return ret;
+    }
+
+    ret = dev_copy_desc(&umatch->desc, m);
+    if (ret) {
+        demo_requeue_msg(s, m);
+        return ret;
+    }
+    demo_free_msg(m);
+    return 0;
 }
 
-// Write function - handles commands from user space
-static ssize_t proc_write(struct file *file, const char __user *buf,
-                          size_t count, loff_t *ppos)
+// REPRIO - move a sender's and/or a type's queued messages to another level
+static long dev_reprio(struct file *file, struct safe_lkm_reprio __user *ureq)
 {
-    char kbuf[128];
-    int pid, type;
-    char text[64];
-    struct demo_msg received_msg;
+    struct safe_lkm_reprio req;
+    struct demo_match f;
 
-    if (count > sizeof(kbuf)-1) return -EINVAL;
-    if (copy_from_user(kbuf, buf, count)) return -EFAULT;
-    kbuf[count] = '\0';
+    if (copy_from_user(&req, ureq, sizeof(req))) return -EFAULT;
+    if (!req.match || (req.match & ~(SAFE_LKM_MATCH_PID | SAFE_LKM_MATCH_TYPE)))
+        return -EINVAL;
 
-    // Parse and execute commands
-    if (sscanf(kbuf, "S %d %d %63[^\n]", &pid, &type, text) == 3) {
-        // Send message command
-        demo_send_msg(pid, type, text);
-    } else if (strncmp(kbuf, "R", 1) == 0) {
-        // Receive message command
-        if (demo_receive_msg(&received_msg) == 0) {
-            printk(KERN_INFO "[safe_lkm] User received: PID=%d, Type=%d, Text=%s\n",
-                   received_msg.pid, received_msg.type, received_msg.text);
+    f.flags = req.match;
+    f.pid = req.pid;
+    f.type = req.type;
+    return demo_queue_reprio(dev_queue(file), &f, req.prio);
+}
+
+// PEEK - copy out the next records of this file's browse pass
+// Records are gathered PEEK_CHUNK at a time and copied out with no queue
+// lock held.
+static long dev_peek(struct file *file, struct safe_lkm_peek __user *ureq)
+{
+    struct demo_client *c = file->private_data;
+    struct demo_queue *q = dev_queue(file);
+    struct safe_lkm_peek_rec __user *urecs;
+    struct safe_lkm_peek_rec *recs;
+    struct safe_lkm_peek req;
+    u32 done = 0;
+    long ret = 0;
+    int n;
+
+    if (copy_from_user(&req, ureq, sizeof(req))) return -EFAULT;
+    if ((req.flags & ~SAFE_LKM_PEEK_START) || req.count > SAFE_LKM_BATCH_MAX)
+        return -EINVAL;
+
+    recs = kmalloc_array(PEEK_CHUNK, sizeof(*recs), GFP_KERNEL);
+    if (!recs) return -ENOMEM;
+    urecs = u64_to_user_ptr(req.recs);
+
+    mutex_lock(&c->peek_lock);
+    if (req.flags & SAFE_LKM_PEEK_START)
+        demo_cursor_start(&c->cursor, q, req.seq);
+    else if (c->cursor.q != q)
+        demo_cursor_stop(&c->cursor);   // Begun before QUEUE_ATTACH: over
+
+    while (done < req.count) {
+        n = demo_queue_peek(&c->cursor, recs, min_t(u32, req.count - done, PEEK_CHUNK));
+        if (n == 0)
+            break;
+        if (copy_to_user(urecs + done, recs, n * sizeof(*recs))) {
+            ret = -EFAULT;
+            break;
+        }
+        done += n;
+    }
+    mutex_unlock(&c->peek_lock);
+
+    kfree(recs);
+    return ret ?: done;
+}
+
+// SHM_ALLOC / SHM_FREE - offsets move in chunks to keep the stack small
+static long dev_shm_slots(unsigned int cmd, struct safe_lkm_shm_req *req)
+{
+    u64 __user *uoffs = u64_to_user_ptr(req->offsets);
+    u32 count = min_t(u32, req->count, SAFE_LKM_BATCH_MAX);
+    u64 offs[64];
+    long ret = 0;
+    u32 done = 0;
+    int n, i;
+
+    if (!demo_shm) return -ENODEV;
+
+    while (done < count) {
+        n = min_t(u32, count - done, ARRAY_SIZE(offs));
+
+        if (cmd == SAFE_LKM_IOC_SHM_ALLOC) {
+            i = demo_shm_alloc(offs, n);
+            if (i == 0) {
+                ret = -ENOBUFS;
+                break;
+            }
+            if (copy_to_user(uoffs + done, offs, i * sizeof(u64))) {
+                while (i--)
+                    demo_shm_free(offs[i]);
+                ret = -EFAULT;
+                break;
+            }
+            done += i;
+            if (i < n) break;    // Out of slots
+            continue;
+        }
+
+        if (copy_from_user(offs, uoffs + done, n * sizeof(u64))) {
+            ret = -EFAULT;
+            break;
         }
+        for (i = 0; i < n && !ret; i++) {
+            ret = demo_shm_free(offs[i]);
+            if (!ret) done++;
+        }
+        if (ret) break;
+    }
+
+    return done > 0 ? done : ret;
+}
+
+// QUEUE_CREATE / LOOKUP / DESTROY / ATTACH, see "Named Queues"
+static long dev_queue_ioctl(struct demo_client *c, unsigned int cmd,
+                            unsigned long arg)
+{
+    struct safe_lkm_queue_attr attr;
+    struct demo_queue *q;
+    u32 id;
+    int ret;
+
+    if (cmd == SAFE_LKM_IOC_QUEUE_DESTROY || cmd == SAFE_LKM_IOC_QUEUE_ATTACH) {
+        if (get_user(id, (__u32 __user *)arg))
+            return -EFAULT;
+        if (cmd == SAFE_LKM_IOC_QUEUE_DESTROY)
+            return demo_queue_destroy(id);
+
+        if (id == SAFE_LKM_QUEUE_DEFAULT)
+            return c->q == demo_default_queue ? 0 : -EBUSY;
+        q = demo_queue_get(id);
+        if (!q)
+            return -ENOENT;
+        // Attaching is one-way, so concurrent users of c->q never see it freed
+        if (cmpxchg(&c->q, demo_default_queue, q) != demo_default_queue) {
+            demo_queue_put(q);
+            return -EBUSY;
+        }
+        return 0;
+    }
+
+    if (copy_from_user(&attr, (void __user *)arg, sizeof(attr)))
+        return -EFAULT;
+    if (!attr.name[0] || strnlen(attr.name, sizeof(attr.name)) == sizeof(attr.name))
+        return -EINVAL;
+
+    if (cmd == SAFE_LKM_IOC_QUEUE_LOOKUP) {
+        ret = demo_queue_lookup(&attr);
+        if (ret)
+            return ret;
     } else {
-        printk(KERN_WARNING "[safe_lkm] Unknown command: %s\n", kbuf);
-        printk(KERN_INFO "[safe_lkm] Valid commands: S <pid> <type> <msg> or R\n");
+        if (attr.pad)
+            return -EINVAL;
+        if (!attr.prio_levels)
+            attr.prio_levels = prio_levels;
+        q = demo_queue_alloc(&attr);
+        if (IS_ERR(q))
+            return PTR_ERR(q);
+        ret = demo_queue_register(q, 1, max_queues);
+        if (ret) {
+            demo_queue_put(q);
+            return ret;
+        }
+        attr.id = q->id;
+        attr.prio_levels = q->prio_levels;
     }
 
-    return count;
+    if (copy_to_user((void __user *)arg, &attr, sizeof(attr)))
+        return -EFAULT;
+    return attr.id;
 }
 
-static const struct proc_ops proc_fops = {
-    .proc_read = proc_read,
-    .proc_write = proc_write,
-    .proc_lseek = default_llseek,
+// Ioctl function - batched operations and options, see safe_lkm_uapi.h
+static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct demo_client *c = file->private_data;
+    struct safe_lkm_shm_info info;
+    struct safe_lkm_shm_req req;
+    struct safe_lkm_batch batch;
+    __s32 ms;
+
+    switch (cmd) {
+    case SAFE_LKM_IOC_SEND_BATCH:
+    case SAFE_LKM_IOC_RECV_BATCH:
+        if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+            return -EFAULT;
+        if (batch.pad) return -EINVAL;
+        if (cmd == SAFE_LKM_IOC_SEND_BATCH)
+            return dev_send_batch(file, &batch);
+        return dev_recv_batch(file, &batch);
+    case SAFE_LKM_IOC_SET_RCVTIMEO:
+        if (get_user(ms, (__s32 __user *)arg))
+            return -EFAULT;
+        if (ms < SAFE_LKM_RCVTIMEO_FOREVER)
+            return -EINVAL;
+        c->rcv_timeout = ms == SAFE_LKM_RCVTIMEO_FOREVER ?
+                         MAX_SCHEDULE_TIMEOUT : (long)msecs_to_jiffies(ms);
+        return 0;
+    case SAFE_LKM_IOC_SET_TTL:
+        if (get_user(ms, (__s32 __user *)arg))
+            return -EFAULT;
+        if (ms < 0)
+            return -EINVAL;
+        c->ttl_ns = (u64)ms * NSEC_PER_MSEC;
+        return 0;
+    case SAFE_LKM_IOC_SHM_INFO:
+        if (!demo_shm) return -ENODEV;
+        info.size = demo_shm_size;
+        info.slot_size = shm_slot_size;
+        info.slots = shm_slots;
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            return -EFAULT;
+        return 0;
+    case SAFE_LKM_IOC_SHM_ALLOC:
+    case SAFE_LKM_IOC_SHM_FREE:
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EFAULT;
+        if (req.pad) return -EINVAL;
+        return dev_shm_slots(cmd, &req);
+    case SAFE_LKM_IOC_DRAIN:
+        return dev_drain(file, (struct safe_lkm_drain __user *)arg, false);
+    case SAFE_LKM_IOC_EXPORT:
+        return dev_drain(file, (struct safe_lkm_drain __user *)arg, true);
+    case SAFE_LKM_IOC_IMPORT:
+        return dev_import(file, (struct safe_lkm_drain __user *)arg);
+    case SAFE_LKM_IOC_RECV_MATCH:
+        return dev_recv_match(file, (struct safe_lkm_match __user *)arg);
+    case SAFE_LKM_IOC_REPRIO:
+        return dev_reprio(file, (struct safe_lkm_reprio __user *)arg);
+    case SAFE_LKM_IOC_PEEK:
+        return dev_peek(file, (struct safe_lkm_peek __user *)arg);
+    case SAFE_LKM_IOC_QUEUE_CREATE:
+    case SAFE_LKM_IOC_QUEUE_LOOKUP:
+    case SAFE_LKM_IOC_QUEUE_DESTROY:
+    case SAFE_LKM_IOC_QUEUE_ATTACH:
+        return dev_queue_ioctl(c, cmd, arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+// Poll function - readable when a receive would not block, writable when
+// a send at any priority would find room (without dropping anything)
+static __poll_t dev_poll(struct file *file, poll_table *wait)
+{
+    struct demo_queue *q = dev_queue(file);
+    __poll_t mask = 0;
+
+    poll_wait(file, &q->readq, wait);
+    poll_wait(file, &q->writeq, wait);
+    if (demo_msg_available(q))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    // Room is counted queue-wide, whichever shard writes land in
+    if (READ_ONCE(q->dead) ||
+        (demo_has_room(q, CLASS_HIGH) && demo_has_room(q, CLASS_NORMAL)))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+// Mmap function - map the shared payload region, see safe_lkm_uapi.h
+static int dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    if (!demo_shm) return -ENODEV;
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > demo_shm_size)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, demo_shm, 0);
+}
+
+static const struct file_operations dev_fops = {
+    .owner = THIS_MODULE,
+    .open = dev_open,
+    .release = dev_release,
+    .read = dev_read,
+    .write = dev_write,
+    .poll = dev_poll,
+    .mmap = dev_mmap,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice safe_lkm_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = SAFE_LKM_DEV_NAME,
+    .fops = &dev_fops,
+    .mode = 0666,
 };
 
 // ---------------------------------------------------------------------------
 // Module Cleanup Functions
 // ---------------------------------------------------------------------------
 
-// Clean up all messages in the queue
-static void cleanup_messages(void)
+// Free every registered task
+static void cleanup_tasks(void)
 {
-    struct demo_msg *m, *tmp;
-    unsigned long flags;
-    int count = 0;
+    struct demo_task *t;
+    struct hlist_node *tmp;
+    int bkt;
 
-    spin_lock_irqsave(&demo_msg_lock, flags);
-    list_for_each_entry_safe(m, tmp, &msg_queue.high, list) {
-        list_del(&m->list);
-        kfree(m);
-        count++;
+    mutex_lock(&demo_tasks_lock);
+    hash_for_each_safe(demo_task_hash, bkt, tmp, t, hnode) {
+        demo_task_unlink(t);
+        kfree(t);
     }
-    list_for_each_entry_safe(m, tmp, &msg_queue.normal, list) {
-        list_del(&m->list);
-        kfree(m);
-        count++;
+    mutex_unlock(&demo_tasks_lock);
+}
+
+// Destroy every named queue and empty the default one
+static void cleanup_messages(void)
+{
+    struct demo_queue *q;
+    int id, count;
+
+    mutex_lock(&demo_queues_lock);
+    idr_for_each_entry(&demo_queues, q, id) {
+        if (q != demo_default_queue)
+            demo_queue_unlink(q);
     }
-    msg_queue.count = 0;
-    spin_unlock_irqrestore(&demo_msg_lock, flags);
+    mutex_unlock(&demo_queues_lock);
 
+    count = demo_queue_flush(demo_default_queue);
     if (count > 0) {
         printk(KERN_INFO "[safe_lkm] Cleaned up %d messages\n", count);
     }
@@ -254,27 +2251,157 @@ static void cleanup_messages(void)
 
 static int __init safe_lkm_init(void)
 {
-    // Initialize spinlock for thread-safe operations
-    spin_lock_init(&demo_msg_lock);
+    int ret;
+
+    if (msg_max_size > SAFE_LKM_MSG_LIMIT) {
+        printk(KERN_ERR "[safe_lkm] msg_max_size %u exceeds limit %u\n",
+               msg_max_size, SAFE_LKM_MSG_LIMIT);
+        return -EINVAL;
+    }
+
+    if (prio_levels < 2 || prio_levels > SAFE_LKM_PRIO_MAX) {
+        printk(KERN_ERR "[safe_lkm] prio_levels must be 2..%d\n", SAFE_LKM_PRIO_MAX);
+        return -EINVAL;
+    }
+
+    if (overflow_policy > SAFE_LKM_OVERFLOW_REJECT_NORMAL) {
+        printk(KERN_ERR "[safe_lkm] overflow_policy must be 0..%d\n",
+               SAFE_LKM_OVERFLOW_REJECT_NORMAL);
+        return -EINVAL;
+    }
+
+    // The default queue, with its per-CPU stages and, when
+    // normal_ring_size=N, the lock-free normal priority ring
+    demo_default_queue = demo_queue_alloc(&(struct safe_lkm_queue_attr){
+        .name = "default",
+        .prio_levels = prio_levels,
+        .capacity = queue_capacity,
+        .ring_size = normal_ring_size,
+        .capacity_high = capacity_high,
+        .capacity_normal = capacity_normal,
+        .overflow = overflow_policy,
+    });
+    if (IS_ERR(demo_default_queue)) {
+        printk(KERN_ERR "[safe_lkm] Invalid or unallocatable normal_ring_size %u\n",
+               normal_ring_size);
+        return PTR_ERR(demo_default_queue);
+    }
+    ret = demo_queue_register(demo_default_queue, SAFE_LKM_QUEUE_DEFAULT,
+                              SAFE_LKM_QUEUE_DEFAULT);
+    if (ret)
+        goto err_queue;
+
+    // Shared-memory payload slots (used when shm_slots=N)
+    ret = demo_shm_init();
+    if (ret) {
+        printk(KERN_ERR "[safe_lkm] Invalid or unallocatable shm_slots %u x %u\n",
+               shm_slots, shm_slot_size);
+        goto err_shm;
+    }
 
-    // Initialize message queue data structures
-    INIT_LIST_HEAD(&msg_queue.high);
-    INIT_LIST_HEAD(&msg_queue.normal);
-    msg_queue.count = 0;
+    // Create the message slab cache and optional reserve
+    demo_msg_cache = kmem_cache_create(MSG_CACHE_NAME, MSG_OBJ_SIZE,
+                                       0, MSG_CACHE_FLAGS, NULL);
+    if (!demo_msg_cache) {
+        printk(KERN_ERR "[safe_lkm] Failed to create %s cache\n", MSG_CACHE_NAME);
+        ret = -ENOMEM;
+        goto err_shm;
+    }
+    if (msg_pool_reserve) {
+        demo_msg_pool = mempool_create_slab_pool(msg_pool_reserve, demo_msg_cache);
+        if (!demo_msg_pool) {
+            printk(KERN_ERR "[safe_lkm] Failed to reserve %u messages\n", msg_pool_reserve);
+            ret = -ENOMEM;
+            goto err_cache;
+        }
+    }
 
-    // Create /proc entry for user interface
+    // Create /proc entry for user interface (and the task registry behind
+    // its T/A/C/D commands)
+    demo_tasks_init();
     if (!proc_create(PROC_NAME, 0666, NULL, &proc_fops)) {
         printk(KERN_ERR "[safe_lkm] Failed to create /proc/%s\n", PROC_NAME);
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto err_pool;
+    }
+
+    if (!proc_create_single(PROC_STATS_NAME, 0444, NULL, stats_show)) {
+        printk(KERN_ERR "[safe_lkm] Failed to create /proc/%s\n", PROC_STATS_NAME);
+        ret = -ENOMEM;
+        goto err_proc;
+    }
+
+    if (!proc_create_single(PROC_QUEUES_NAME, 0444, NULL, queues_show)) {
+        printk(KERN_ERR "[safe_lkm] Failed to create /proc/%s\n", PROC_QUEUES_NAME);
+        ret = -ENOMEM;
+        goto err_stats;
+    }
+
+    if (!proc_create_single(PROC_LATENCY_NAME, 0444, NULL, latency_show)) {
+        printk(KERN_ERR "[safe_lkm] Failed to create /proc/%s\n", PROC_LATENCY_NAME);
+        ret = -ENOMEM;
+        goto err_queues;
+    }
+
+    if (!proc_create(PROC_MESSAGES_NAME, 0444, NULL, &msgs_fops)) {
+        printk(KERN_ERR "[safe_lkm] Failed to create /proc/%s\n", PROC_MESSAGES_NAME);
+        ret = -ENOMEM;
+        goto err_latency;
+    }
+
+    // Create /dev entry for binary clients
+    ret = misc_register(&safe_lkm_dev);
+    if (ret) {
+        printk(KERN_ERR "[safe_lkm] Failed to register %s\n", SAFE_LKM_DEV_PATH);
+        goto err_messages;
     }
 
+    if (expire_sweep_ms)
+        schedule_delayed_work(&demo_sweep_work, msecs_to_jiffies(expire_sweep_ms));
+
     printk(KERN_INFO "[safe_lkm] IPC Priority Message Queue loaded\n");
     printk(KERN_INFO "[safe_lkm] Use: echo 'S <pid> <type> <msg>' > /proc/%s\n", PROC_NAME);
     printk(KERN_INFO "[safe_lkm] Use: echo 'R' > /proc/%s\n", PROC_NAME);
     printk(KERN_INFO "[safe_lkm] View status: cat /proc/%s\n", PROC_NAME);
-    printk(KERN_INFO "[safe_lkm] Priority threshold: %d (>= HIGH, < NORMAL)\n", HIGH_PRIO_THRESHOLD);
+    printk(KERN_INFO "[safe_lkm] Binary interface: %s\n", SAFE_LKM_DEV_PATH);
+    if (prio_levels == 2)
+        printk(KERN_INFO "[safe_lkm] Priority threshold: %d (>= HIGH, < NORMAL)\n", HIGH_PRIO_THRESHOLD);
+    else
+        printk(KERN_INFO "[safe_lkm] Priority levels: %u (type %u and above first)\n",
+               prio_levels, prio_levels - 1);
+    if (demo_msg_pool)
+        printk(KERN_INFO "[safe_lkm] Reserved %u message objects\n", msg_pool_reserve);
+    if (normal_ring_size)
+        printk(KERN_INFO "[safe_lkm] Normal priority ring: %u slots\n", normal_ring_size);
+    if (queue_capacity || capacity_high || capacity_normal)
+        printk(KERN_INFO "[safe_lkm] Capacity: %u total, %u high, %u normal (0 = unlimited), overflow policy %u\n",
+               queue_capacity, capacity_high, capacity_normal, overflow_policy);
+    if (demo_shm)
+        printk(KERN_INFO "[safe_lkm] Shared-memory slots: %u x %u bytes\n",
+               shm_slots, shm_slot_size);
     
     return 0;
+
+err_messages:
+    remove_proc_entry(PROC_MESSAGES_NAME, NULL);
+err_latency:
+    remove_proc_entry(PROC_LATENCY_NAME, NULL);
+err_queues:
+    remove_proc_entry(PROC_QUEUES_NAME, NULL);
+err_stats:
+    remove_proc_entry(PROC_STATS_NAME, NULL);
+err_proc:
+    remove_proc_entry(PROC_NAME, NULL);
+err_pool:
+    mempool_destroy(demo_msg_pool);
+err_cache:
+    kmem_cache_destroy(demo_msg_cache);
+err_shm:
+    demo_shm_exit();
+    idr_remove(&demo_queues, SAFE_LKM_QUEUE_DEFAULT);
+err_queue:
+    demo_queue_put(demo_default_queue);
+    return ret;
 }
 
 // ---------------------------------------------------------------------------
@@ -283,11 +2410,32 @@ static int __init safe_lkm_init(void)
 
 static void __exit safe_lkm_exit(void)
 {
+    // Stop accepting binary clients before tearing down the queue
+    misc_deregister(&safe_lkm_dev);
+    cancel_delayed_work_sync(&demo_sweep_work);
+
     // Clean up all allocated messages
     cleanup_messages();
     
-    // Remove /proc entry
+    // Remove /proc entries
+    remove_proc_entry(PROC_MESSAGES_NAME, NULL);
+    remove_proc_entry(PROC_LATENCY_NAME, NULL);
+    remove_proc_entry(PROC_QUEUES_NAME, NULL);
+    remove_proc_entry(PROC_STATS_NAME, NULL);
     remove_proc_entry(PROC_NAME, NULL);
+    cleanup_tasks();
+
+    // Only the default queue is left, and no one can reach it any more
+    idr_remove(&demo_queues, SAFE_LKM_QUEUE_DEFAULT);
+    idr_destroy(&demo_queues);
+    demo_queue_put(demo_default_queue);
+
+    // Release the reserve before the cache it was carved from
+    mempool_destroy(demo_msg_pool);
+    kmem_cache_destroy(demo_msg_cache);
+
+    // Queued slots were released above; client mappings keep their pages
+    demo_shm_exit();
     
     printk(KERN_INFO "[safe_lkm] IPC Priority Message Queue unloaded\n");
 }
@@ -313,6 +2461,22 @@ MODULE_VERSION("1.0");
 //
 // LOAD MODULE:
 //   $ sudo insmod safe_lkm.ko
+//   $ sudo insmod safe_lkm.ko msg_pool_reserve=4096   # keep 4096 spare nodes
+//   $ sudo insmod safe_lkm.ko msg_max_size=1048576    # allow 1 MiB payloads
+//   $ sudo insmod safe_lkm.ko percpu_staging=1        # per-CPU send staging
+//     (also switchable at runtime via /sys/module/safe_lkm/parameters/)
+//   $ sudo insmod safe_lkm.ko normal_ring_size=4096   # lock-free lowest level
+//   $ sudo insmod safe_lkm.ko prio_levels=32          # types 0..31, 31 first
+//   $ sudo insmod safe_lkm.ko dequeue_policy=1 level_weights=4,1
+//                                                     # 4 high per 1 normal
+//   $ sudo insmod safe_lkm.ko age_deadline_ms=100     # serve stale msgs first
+//   $ sudo insmod safe_lkm.ko shm_slots=256           # 256 x 64 KiB mmap slots
+//   $ sudo insmod safe_lkm.ko queue_capacity=10000    # bound the default queue
+//   $ sudo insmod safe_lkm.ko queue_capacity=10000 overflow_policy=1
+//                                                     # senders wait for room
+//   $ sudo insmod safe_lkm.ko max_queues=16           # at most 16 named queues
+//   $ sudo insmod safe_lkm.ko numa_shards=1           # one shard per NUMA node
+//     (without NUMA hardware, boot with numa=fake=2 to get two nodes)
 //
 // SEND MESSAGES:
 //   $ echo "S 1001 3 HelloWorld" > /proc/safe_lkm    # Normal priority
@@ -321,14 +2485,63 @@ MODULE_VERSION("1.0");
 // RECEIVE MESSAGES:
 //   $ echo "R" > /proc/safe_lkm                      # Receives high priority first
 //
+// TASK REGISTRY:
+//   $ echo "T 4001 7" > /proc/safe_lkm               # Register pid 4001, prio 7
+//   $ echo "A 4001 12" > /proc/safe_lkm              # Change its priority
+//   $ echo "A 4001 12 9" > /proc/safe_lkm            # ... and move its queued
+//                                                     # msgs to type 9's level
+//   $ echo "C 4001 2" > /proc/safe_lkm               # Move it to CPU 2
+//   $ echo "D 4001" > /proc/safe_lkm                 # Remove it
+//
+// BINARY INTERFACE (programs):
+//   write(fd, struct safe_lkm_hdr + payload)  -> send one message
+//   read(fd, buf, n)                          -> receive header + payload
+//   ioctl(fd, SAFE_LKM_IOC_SEND_BATCH, &batch) -> send many messages
+//   ioctl(fd, SAFE_LKM_IOC_RECV_BATCH, &batch) -> receive many messages
+//   ioctl(fd, SAFE_LKM_IOC_SET_RCVTIMEO, &ms)  -> receive timeout
+//   ioctl(fd, SAFE_LKM_IOC_SET_TTL, &ms)       -> later sends expire
+//   ioctl(fd, SAFE_LKM_IOC_RECV_MATCH, &match) -> oldest message from a pid
+//                                                 and/or of a type
+//   ioctl(fd, SAFE_LKM_IOC_DRAIN, &drain)      -> a backlog as packed records
+//   ioctl(fd, SAFE_LKM_IOC_REPRIO, &reprio)    -> move queued messages of a
+//                                                 pid and/or type to a level
+//   ioctl(fd, SAFE_LKM_IOC_PEEK, &peek)        -> look at queued messages
+//                                                 without receiving them
+//   ioctl(fd, SAFE_LKM_IOC_EXPORT, &drain)     -> dequeue a backlog as export
+//                                                 records (level, times kept)
+//   ioctl(fd, SAFE_LKM_IOC_IMPORT, &drain)     -> queue export records again
+//                                                 (empty queue only)
+//   poll/select/epoll on fd                    -> EPOLLIN when non-empty,
+//                                                 EPOLLOUT when not full
+//   mmap(fd) + SAFE_LKM_IOC_SHM_* + SAFE_LKM_DESC_SHM
+//                                              -> zero-copy payloads
+//                                                 (safe_lkm_user.h)
+//   ioctl(fd, SAFE_LKM_IOC_QUEUE_CREATE, &attr) -> new named queue
+//   ioctl(fd, SAFE_LKM_IOC_QUEUE_ATTACH, &id)   -> fd now uses that queue
+//   Receives block while the queue is empty unless O_NONBLOCK is set.
+//   See safe_lkm_uapi.h for the layout.
+//
 // VIEW STATUS:
 //   $ cat /proc/safe_lkm
+//   $ cat /proc/safe_lkm_stats                       # key=value counters
+//   $ cat /proc/safe_lkm_queues                      # one line per queue
+//   $ cat /proc/safe_lkm_latency                     # latency histograms
+//   $ cat /proc/safe_lkm_messages                    # every queued message
 //
 // CHECK LOGS:
 //   $ dmesg | tail -20
 //
+// TRACE PER-MESSAGE EVENTS (see safe_lkm_trace.h):
+//   $ echo 1 | sudo tee /sys/kernel/tracing/events/safe_lkm/enable
+//   $ sudo cat /sys/kernel/tracing/trace_pipe
+//
 // UNLOAD MODULE:
 //   $ sudo rmmod safe_lkm
+//   Queued messages are freed. To keep a backlog across a reload, save it
+//   first and load it into the new module (stop producers in between):
+//   $ ./safe_lkm_snap save backlog.snap
+//   $ sudo rmmod safe_lkm && sudo insmod safe_lkm.ko
+//   $ ./safe_lkm_snap load backlog.snap
 //
 // ============================================================================
 // IMPLEMENTATION DETAILS
@@ -337,22 +2550,103 @@ MODULE_VERSION("1.0");
 // PRIORITY MECHANISM:
 //   - Messages with type >= 5 are HIGH priority
 //   - Messages with type < 5 are NORMAL priority
-//   - Two separate queues (high and normal)
 //   - High priority messages retrieved first
 //   - FIFO order within each priority level
+//   - prio_levels=N (up to 64) gives every type 0..N-1 its own level,
+//     higher type first; status and stats still report the type >= 5 split
+//   - Optional weighted round-robin across levels and deadline aging, so
+//     a flood of high priority traffic cannot starve lower levels; see
+//     "Dequeue Policy" above
 //
 // THREAD SAFETY:
-//   - Spinlocks protect concurrent access
-//   - spin_lock_irqsave/restore for interrupt safety
+//   - Spinlocks protect concurrent access, one per queue, so traffic on
+//     one named queue never contends with another
+//   - Queue locks are plain spinlocks: every path that takes one runs in
+//     process context, so interrupts stay enabled during list walks.
+//     In-kernel producers in atomic context use demo_send_msg_atomic(),
+//     which only touches the ring and the IRQ-safe per-CPU stages
+//   - Optional per-CPU staging keeps producers off the queue lock; see
+//     "Per-CPU Enqueue Staging" above for the ordering guarantees
+//   - Optional lock-free MPSC ring for the lowest level (normal_ring_size):
+//     senders never take the queue lock, receivers drain it under the lock
+//   - Blocking receivers sleep on a wait queue woken by every send path;
+//     senders only touch it when someone is actually sleeping
+//   - Senders blocked at capacity sleep on a second wait queue woken by
+//     every receive path, under the same rule
+//   - Optional NUMA shards (numa_shards): one lock per node, so senders on
+//     different nodes never share a lock or a cache line; see "NUMA
+//     Shards" in safe_lkm_queue.h for what ordering survives across shards
 //
 // MEMORY MANAGEMENT:
-//   - Dynamic allocation with kmalloc/kfree
+//   - Messages come from a dedicated "safe_lkm_msg" kmem_cache, visible
+//     in /proc/slabinfo, instead of the generic kmalloc-512 cache
+//   - Optional mempool reserve (msg_pool_reserve) backed by that cache
+//   - Payloads are binary and variable length: up to 64 bytes are stored
+//     inline in the slab object, larger ones (up to msg_max_size) in a
+//     separate kvmalloc buffer sized to the payload
+//   - Optional shared-memory slots (shm_slots): one vmalloc_user region
+//     mapped by clients; a message sent from a slot only references it,
+//     and the slot goes back to the pool when the message is copied out
+//     or freed, or to the receiver on an in-place receive
+//   - Optional capacity, total and per high/normal class, reserved at
+//     admission so the bound is exact; at capacity a send fails, blocks,
+//     drops the oldest normal message or, for high priority, ignores the
+//     total bound (overflow_policy)
+//   - Optional message lifetime per descriptor (SAFE_LKM_IOC_SET_TTL):
+//     expired messages are never delivered; receives drop them as they
+//     reach the front and a periodic sweep (expire_sweep_ms) frees the
+//     rest without walking past a live message
 //   - Automatic cleanup on module unload
 //   - No memory leaks
 //
 // DATA STRUCTURES:
-//   - Kernel linked lists (list_head)
-//   - Separate high/normal priority queues
+//   - Kernel linked lists (list_head), one FIFO per priority level
+//   - A bitmap of non-empty levels: the next level to serve is one
+//     find_first_bit(), so enqueue/dequeue cost does not grow with N
+//   - Optional bounded ring of message pointers for the lowest level,
+//     one contiguous slot array (safe_lkm_ring.h, shared with bench_ring)
+//   - Per-queue pid and type hash indexes, built by the first selective
+//     receive (RECV_MATCH) or reprioritization (REPRIO, A); either walks
+//     one bucket, not the levels
+//   - Task registry (T/A/C/D): a pid hash, an rbtree by priority and one
+//     task list per CPU, so lookup, reprioritize and migrate cost O(1),
+//     O(log n) and O(1) whatever the number of tasks
+//   - Optional per-NUMA-node queue shards (numa_shards), each allocated on
+//     its node with its messages and payloads; receivers take from the
+//     local shard unless another node holds a more urgent message
+//   - Named queues in an IDR keyed by id; each descriptor caches its
+//     queue at attach time, so the message path does no lookup
+//   - The queue core (lists, staging, ring, dequeue policy, capacity)
+//     lives in safe_lkm_queue.h, which also builds in user space over
+//     safe_lkm_shim.h; bench_queue.c times it there without the module
+//
+// OBSERVABILITY:
+//   - Per-level depth, totals, peak depth and queued bytes are counters
+//     updated at enqueue/dequeue time; /proc/safe_lkm and
+//     /proc/safe_lkm_stats read them without walking the lists
+//   - Queueing latency is kept in per-level log2 histograms and reported
+//     as p99 per level and per high/normal class
+//   - Residence time per high/normal class and the cost of each enqueue
+//     and dequeue also go into per-CPU log-linear histograms (12.5%
+//     resolution), recorded without the lock; /proc/safe_lkm_latency
+//   - The send/receive paths do not printk; per-message activity is
+//     reported through the msg_enqueue, msg_dequeue, queue_empty and
+//     alloc_fail tracepoints, which cost nothing while disabled
+//   - Queued messages can be listed without dequeuing them (PEEK,
+//     /proc/safe_lkm_messages) by a cursor walking the level lists a
+//     chunk at a time; paths that unlink a message move any cursor off it
+//     first, which costs one list_empty() while nobody is browsing
+//
+// USER INTERFACES:
+//   - /proc/safe_lkm: text commands and status, meant for humans
+//   - /dev/safe_lkm: fixed binary header + payload, meant for programs;
+//     no sscanf/snprintf on the message path, and received messages are
+//     actually returned to the caller
+//   - Batch ioctls take the queue lock once per batch: sends splice whole
+//     runs onto the level lists, receives cut runs off their fronts
+//   - EXPORT/IMPORT move a whole backlog through the same batch paths, so
+//     saving and restoring one across a reload (safe_lkm_snap) costs about
+//     as much as draining and sending it in batches
 //
 // ============================================================================
 // End of IPC Priority Message Queue Module
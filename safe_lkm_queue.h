@@ -0,0 +1,2753 @@
+// ============================================================================
+// Safe Kernel Module - Queue Core
+// Assignment 2 — OS Fall 2025 (Option B: IPC Mechanism)
+// ============================================================================
+//
+// Everything a queue does with messages once they exist: the priority
+// lists and their counters, per-CPU staging, the lowest level ring, the
+// dequeue policy, capacity, NUMA shards, browsing and the batched paths. Allocating messages,
+// the queue registry and the /proc and /dev interfaces stay in safe_lkm.c.
+//
+// The same header builds in the kernel (safe_lkm.c) and in user space
+// (bench_queue.c, over the kernel API stand-ins in safe_lkm_shim.h), so the
+// queue can be benchmarked without loading the module.
+//
+// THE INCLUDING FILE PROVIDES:
+//   - demo_free_msg(), which releases messages the queue drops or flushes
+//   - the tunables percpu_staging, dequeue_policy, level_weights[],
+//     nr_level_weights, age_deadline_ms and numa_shards (module parameters
+//     in the kernel), defined before this header is included
+//   - in the kernel, the tracepoints from safe_lkm_trace.h
+//
+// ============================================================================
+
+#ifndef SAFE_LKM_QUEUE_H
+#define SAFE_LKM_QUEUE_H
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/bitmap.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/overflow.h>
+#else
+#include "safe_lkm_shim.h"
+#endif
+
+#include "safe_lkm_uapi.h"
+#include "safe_lkm_ring.h"
+
+#define MSG_INLINE_SIZE 64
+#define HIGH_PRIO_THRESHOLD 5
+
+// ---------------------------------------------------------------------------
+// Data Structures
+// ---------------------------------------------------------------------------
+
+// Message structure - represents a single IPC message
+// Payloads up to MSG_INLINE_SIZE bytes live in inline_data[] inside the
+// same slab object; larger ones get a separate buffer sized to the payload.
+struct demo_msg {
+    int pid;                  // Sender process ID
+    int type;                 // Message priority/type
+    u32 len;                  // Payload length in bytes (binary, no NUL)
+    u32 level;                // Priority level derived from type, 0 = highest
+    u64 enq_ns;               // ktime_get_ns() when the message was admitted
+    u64 seq;                  // Sequence number, see "IPC Functions - Browse"
+    u64 expires_ns;           // ktime_get_ns() deadline, 0 = never expires
+    char *data;               // Payload: inline_data or an external buffer
+    struct list_head list;    // Kernel linked list node
+    struct list_head by_pid;  // Selective receive indexes, valid while the
+    struct list_head by_type; //   queue is indexed (see "Selective Receive")
+    char inline_data[];       // Small payload storage (MSG_INLINE_SIZE)
+};
+
+#define MSG_OBJ_SIZE (sizeof(struct demo_msg) + MSG_INLINE_SIZE)
+
+// Reporting classes: /proc/safe_lkm and the stats file keep the original
+// high/normal split whatever the number of priority levels
+enum demo_class {
+    CLASS_HIGH,               // type >= HIGH_PRIO_THRESHOLD
+    CLASS_NORMAL,             // type < HIGH_PRIO_THRESHOLD
+    NR_CLASSES
+};
+
+// Message queue with prio_levels priority levels, level 0 served first
+// The nonempty bitmap mirrors depth[] != 0, so the highest non-empty level
+// is a single find_first_bit() over one word for any level count.
+// All counters are maintained at enqueue/dequeue time under the queue lock,
+// so status and stats readers never have to walk the lists.
+struct demo_msg_queue {
+    struct list_head levels[SAFE_LKM_PRIO_MAX];   // FIFO per priority level
+    DECLARE_BITMAP(nonempty, SAFE_LKM_PRIO_MAX);  // Levels with messages
+    int count;                        // Total message count
+    int depth[SAFE_LKM_PRIO_MAX];     // Messages currently queued, per level
+    int peak;                         // Highest count ever reached
+    u64 bytes;                        // Payload bytes currently queued
+    u64 enqueued[SAFE_LKM_PRIO_MAX];  // Messages ever enqueued, per level
+    u64 dequeued[SAFE_LKM_PRIO_MAX];  // Messages ever dequeued, per level
+};
+
+// A run of messages on private per-level lists, on its way into or out of
+// the queue. Only the levels flagged in used are initialized, so starting
+// and splicing a batch costs the same for any level count. Too big for the
+// stack: batches live in the per-CPU stages or are kmalloc'd per ioctl.
+struct demo_batch {
+    struct list_head lists[SAFE_LKM_PRIO_MAX];
+    int n[SAFE_LKM_PRIO_MAX];         // Messages per level
+    u64 bytes[SAFE_LKM_PRIO_MAX];     // Payload bytes per level
+    DECLARE_BITMAP(used, SAFE_LKM_PRIO_MAX);
+};
+
+// Counters copied out under the lock for the status and stats files
+struct demo_snapshot {
+    int count;
+    int peak;
+    u64 bytes;
+    int depth[NR_CLASSES];
+    u64 enqueued[NR_CLASSES];
+    u64 dequeued[NR_CLASSES];
+    int level_depth[SAFE_LKM_PRIO_MAX];
+    u64 p99_us[NR_CLASSES];               // Queueing latency, 99th percentile
+    u64 level_p99_us[SAFE_LKM_PRIO_MAX];
+    u64 aged;
+    u64 reprioritized;
+    u64 exported;
+    u64 seq;                              // Last sequence number given out
+    long staged;                          // Approximate, read without locks
+    unsigned long ring_queued;
+    s64 ring_full, full, dropped, blocked, expired;
+};
+
+// Dequeue policies (dequeue_policy)
+enum demo_policy {
+    POLICY_STRICT,            // Highest non-empty level first
+    POLICY_WRR,               // Levels take turns, level_weights[] each
+};
+
+// What demo_pick_level() chose a level by, for demo_charge_level()
+enum demo_pick {
+    PICK_TOP,                 // Highest non-empty level, or out of turn
+    PICK_AGED,                // An overdue head below the top level
+    PICK_WRR,                 // The round-robin turn
+    PICK_WRR_SHARD,           // The turn, take reserved on the home queue
+};
+
+// Queueing latency histogram: bucket b counts dequeues that waited
+// [2^(b-1), 2^b) ns, bucket 0 those that waited 0 ns
+#define LAT_BUCKETS 64
+
+// Log-linear histogram, see "Latency Histograms": values below LL_SUB ns get
+// a bucket each, every power of two above is split into LL_SUB buckets
+#define LL_SUB_BITS 3
+#define LL_SUB (1 << LL_SUB_BITS)
+#define LL_MAX_SHIFT 40           // From 2^40 ns (about 18 min) up: last bucket
+#define LL_BUCKETS ((LL_MAX_SHIFT - LL_SUB_BITS + 1) * LL_SUB)
+
+// Selective receive index buckets, per key (pid, type) and queue
+#define INDEX_BITS 8
+#define INDEX_BUCKETS (1 << INDEX_BITS)
+
+// What each per-CPU histogram measures
+enum demo_lat_kind {
+    LAT_RESIDENCE,                            // + class: admission to dequeue
+    LAT_ENQUEUE = LAT_RESIDENCE + NR_CLASSES, // One message linked
+    LAT_DEQUEUE,                              // One demo_queue_receive()
+    NR_LAT_KINDS,
+};
+
+struct demo_lat_stats {
+    u64 hist[NR_LAT_KINDS][LL_BUCKETS];
+};
+
+// One message queue: the default queue (id 0), which always exists and
+// backs /proc/safe_lkm, or a named queue created at runtime (see "Named
+// Queues"). Each queue is a separate allocation with its own lock, lists,
+// counters and wait queue, so clients of different queues never share a
+// cache line on the message path.
+//
+// LOCKING: q->lock is only taken in process context (file operations,
+// /proc and the expiry sweeper), so it is a plain spinlock and interrupts
+// stay enabled while it is held, list walks included. Code running in
+// interrupt or other atomic context must not take it: it sends with
+// demo_enqueue_atomic(), which only touches the lock-free ring and the
+// per-CPU stages, whose locks are IRQ-safe.
+struct demo_queue {
+    spinlock_t lock;                  // Protects msgs and the policy state
+    struct demo_msg_queue msgs;
+    u32 prio_levels;                  // 2..SAFE_LKM_PRIO_MAX
+    u32 high_levels;                  // Levels 0..high_levels-1 report as high
+
+    // Capacity, see "Capacity and Backpressure"
+    u32 capacity;                     // Most messages queued, 0 = unlimited
+    u32 class_capacity[NR_CLASSES];   // Most messages per class, 0 = unlimited
+    u32 overflow;                     // SAFE_LKM_OVERFLOW_*
+    atomic_t admitted;                // Messages holding room, all classes
+                                      //   (on the home queue only)
+    atomic64_t seq;                   // Last sequence number given out (on
+                                      //   the home queue only)
+    u64 import_seq;                   // Sequence number of the last message
+                                      //   IMPORT queued (home queue only)
+    atomic_t class_admitted[NR_CLASSES];  // The same per class
+    atomic64_t full;                  // Sends rejected at capacity
+    atomic64_t dropped;               // Queued messages dropped to make room
+    atomic64_t blocked;               // Sends that waited for room
+    wait_queue_head_t writeq;         // Senders waiting for room
+
+    // Message expiry, see "Message Expiry"
+    bool has_ttl;                     // A message with a deadline was admitted
+    atomic64_t expired;               // Messages discarded past their deadline
+
+    // Selective receive indexes, protected by lock
+    bool indexed;                     // Built by the first selective receive
+                                      //   or reprioritization
+    u64 reprioritized;                // Messages moved by demo_queue_reprio()
+    u64 exported;                     // Messages moved out by EXPORT, not
+                                      //   counted in msgs.dequeued
+    struct list_head by_pid[INDEX_BUCKETS];
+    struct list_head by_type[INDEX_BUCKETS];
+    struct list_head cursors;         // Browse cursors walking this shard,
+                                      //   protected by lock
+
+    // Lowest priority level ring backend (ring_size != 0)
+    u32 ring_size;
+    struct safe_lkm_ring ring;
+    u64 __percpu *ring_bytes_in;      // Payload bytes pushed
+    u64 ring_bytes_out;               // Bytes moved to the list
+    atomic64_t ring_full;             // Sends rejected, ring full
+
+    // Per-CPU enqueue staging (percpu_staging=1)
+    struct demo_stage __percpu *stages;
+    struct cpumask staged_cpus;       // CPUs that may have staged messages
+
+    // Dequeue policy state, protected by lock
+    u32 wrr_level;                    // Level whose turn it is
+    int wrr_credit;                   // Messages it may still deliver
+    u64 aged;                         // Messages served early by aging
+    u64 lat_hist[SAFE_LKM_PRIO_MAX][LAT_BUCKETS];
+
+    struct demo_lat_stats __percpu *lat;  // See "Latency Histograms"
+
+    wait_queue_head_t readq;          // Blocked receivers and poll()ers
+
+    // NUMA shards (numa_shards=1), see "NUMA Shards"
+    int node;                         // Memory node, NUMA_NO_NODE if unsharded
+    u32 nr_shards;                    // Entries in shards[], 1 if unsharded
+    struct demo_queue **shards;       // One per online node, NULL if unsharded
+    struct demo_queue **node_shard;   // Shard serving each node id
+    struct demo_queue *home;          // Queue this is a shard of, else itself
+
+    // Registry, see "Named Queues" in safe_lkm.c
+    u32 id;
+    bool dead;                        // Destroyed: sends fail, receivers wake
+    struct kref ref;
+    char name[SAFE_LKM_QUEUE_NAME_MAX];
+};
+
+// Release a message dropped or flushed by the queue (see above)
+static void demo_free_msg(struct demo_msg *m);
+
+// Every queue that holds q's messages: its shards, or q itself
+#define demo_for_each_shard(q, s, i)                                    \
+    for ((i) = 0; (i) < (q)->nr_shards &&                               \
+                  ((s) = (q)->shards ? (q)->shards[i] : (q), true); (i)++)
+
+// Priority level for a message type, 0 = highest
+// Two levels keep the original split at HIGH_PRIO_THRESHOLD; with more,
+// types 0..N-1 get one level each and larger types share the top one.
+static inline u32 demo_type_level(struct demo_queue *q, int type)
+{
+    if (q->prio_levels == 2)
+        return type >= HIGH_PRIO_THRESHOLD ? 0 : 1;
+    return q->prio_levels - 1 - clamp(type, 0, (int)q->prio_levels - 1);
+}
+
+// ---------------------------------------------------------------------------
+// Queue Accounting
+// ---------------------------------------------------------------------------
+
+static inline enum demo_class demo_level_class(struct demo_queue *q, u32 level)
+{
+    return level < q->high_levels ? CLASS_HIGH : CLASS_NORMAL;
+}
+
+static inline struct list_head *demo_level_list(struct demo_queue *q, u32 level)
+{
+    return &q->msgs.levels[level];
+}
+
+// Highest priority non-empty level, or prio_levels if the lists are empty
+// Must be called with q->lock held.
+static inline u32 demo_top_level(struct demo_queue *q)
+{
+    return find_first_bit(q->msgs.nonempty, q->prio_levels);
+}
+
+// Depth the peak is taken of: messages on the lists and in the ring
+// Must be called with q->lock held.
+static inline int demo_peak_depth(struct demo_queue *q)
+{
+    int depth = q->msgs.count;
+
+    if (q->ring_size)
+        depth += safe_lkm_ring_count(&q->ring);
+    return depth;
+}
+
+// Raise the peak to the current depth
+// Ring sends do not take the lock, so their part of a peak is caught by
+// the next link or unlink under it, or by a snapshot of the current depth.
+// Must be called with q->lock held.
+static inline void demo_note_peak(struct demo_queue *q)
+{
+    int depth = demo_peak_depth(q);
+
+    if (depth > q->msgs.peak)
+        q->msgs.peak = depth;
+}
+
+// Account for n messages (bytes payload) joining a level
+// Must be called with q->lock held.
+static inline void demo_account_add(struct demo_queue *q, u32 level, int n, u64 bytes)
+{
+    if (!n)
+        return;
+    q->msgs.count += n;
+    q->msgs.depth[level] += n;
+    q->msgs.enqueued[level] += n;
+    q->msgs.bytes += bytes;
+    __set_bit(level, q->msgs.nonempty);
+    demo_note_peak(q);
+}
+
+// Account for n messages (bytes payload) leaving a level without being
+// dequeued, i.e. exported: only the depth and the room change
+// Their room goes back to senders; waking them is up to the caller, after
+// the lock is dropped (demo_wake_writers).
+// Must be called with q->lock held.
+static inline void demo_account_out(struct demo_queue *q, u32 level, int n, u64 bytes)
+{
+    demo_note_peak(q);
+    atomic_sub(n, &q->home->admitted);
+    atomic_sub(n, &q->home->class_admitted[demo_level_class(q, level)]);
+    q->msgs.count -= n;
+    q->msgs.depth[level] -= n;
+    q->msgs.bytes -= bytes;
+    if (!q->msgs.depth[level])
+        __clear_bit(level, q->msgs.nonempty);
+}
+
+// Account for n messages (bytes payload) dequeued from a level
+// Must be called with q->lock held.
+static inline void demo_account_del(struct demo_queue *q, u32 level, int n, u64 bytes)
+{
+    demo_account_out(q, level, n, bytes);
+    q->msgs.dequeued[level] += n;
+}
+
+static inline void demo_batch_init(struct demo_batch *b)
+{
+    bitmap_zero(b->used, SAFE_LKM_PRIO_MAX);
+}
+
+// The list for one level of a batch, initialized on first use
+static inline struct list_head *demo_batch_list(struct demo_batch *b, u32 level)
+{
+    if (!__test_and_set_bit(level, b->used)) {
+        INIT_LIST_HEAD(&b->lists[level]);
+        b->n[level] = 0;
+        b->bytes[level] = 0;
+    }
+    return &b->lists[level];
+}
+
+// Append a message to the matching level of a private batch
+static inline void demo_batch_add(struct demo_batch *b, struct demo_msg *m)
+{
+    list_add_tail(&m->list, demo_batch_list(b, m->level));
+    b->n[m->level]++;
+    b->bytes[m->level] += m->len;
+}
+
+// Unlink one delivered message from a batch
+static inline void demo_batch_del(struct demo_batch *b, struct demo_msg *m)
+{
+    list_del(&m->list);
+    b->n[m->level]--;
+    b->bytes[m->level] -= m->len;
+}
+
+// Move every run of src to the tail of the same level in dst
+// src is empty (and re-initialized) on return.
+static inline void demo_batch_splice(struct demo_batch *dst, struct demo_batch *src)
+{
+    u32 level;
+
+    for_each_set_bit(level, src->used, SAFE_LKM_PRIO_MAX) {
+        list_splice_tail_init(&src->lists[level], demo_batch_list(dst, level));
+        dst->n[level] += src->n[level];
+        dst->bytes[level] += src->bytes[level];
+    }
+    demo_batch_init(src);
+}
+
+// Batches are too big for the kernel stack with SAFE_LKM_PRIO_MAX levels
+static inline struct demo_batch *demo_batch_alloc(void)
+{
+    struct demo_batch *b = kmalloc(sizeof(*b), GFP_KERNEL);
+
+    if (b)
+        demo_batch_init(b);
+    return b;
+}
+
+// ---------------------------------------------------------------------------
+// Selective Receive Indexes
+// ---------------------------------------------------------------------------
+//
+// Besides its level list, a queued message can be on two hash buckets: one
+// keyed by sender pid, one by type. A bucket keeps its messages in
+// admission order (enq_ns), so its first entry with the wanted key is the
+// oldest queued message with that key; messages of other keys that share
+// the bucket are skipped. Messages mostly join in that order already, so
+// an insert compares against the bucket's tail (or head, for a requeue) and
+// stops; only a message that waited in a stage or the ring while a newer
+// one was linked directly walks back past it. A queue builds its indexes on its
+// first selective receive (see "Selective Receive") or reprioritization
+// and keeps them from then on; until then each helper here is one test of q->indexed.
+// All of them must be called with q->lock held.
+
+static inline u32 demo_index_hash(int key)
+{
+    return ((u32)key * 0x61C88647u) >> (32 - INDEX_BITS);
+}
+
+static inline struct list_head *demo_pid_bucket(struct demo_queue *q, int pid)
+{
+    return &q->by_pid[demo_index_hash(pid)];
+}
+
+static inline struct list_head *demo_type_bucket(struct demo_queue *q, int type)
+{
+    return &q->by_type[demo_index_hash(type)];
+}
+
+// Link m into a bucket in enq_ns order, searching back from the tail
+#define demo_index_insert(head, m, member)                              \
+    do {                                                                \
+        struct list_head *__pos = (head)->prev;                         \
+        while (__pos != (head) &&                                       \
+               list_entry(__pos, struct demo_msg, member)->enq_ns >     \
+               (m)->enq_ns)                                             \
+            __pos = __pos->prev;                                        \
+        list_add(&(m)->member, __pos);                                  \
+    } while (0)
+
+// Link m into a bucket in enq_ns order, searching on from the head
+#define demo_index_insert_front(head, m, member)                        \
+    do {                                                                \
+        struct list_head *__pos = (head)->next;                         \
+        while (__pos != (head) &&                                       \
+               list_entry(__pos, struct demo_msg, member)->enq_ns <     \
+               (m)->enq_ns)                                             \
+            __pos = __pos->next;                                        \
+        list_add_tail(&(m)->member, __pos);                             \
+    } while (0)
+
+// Index a message that joined the back of its level
+static inline void demo_index_add(struct demo_queue *q, struct demo_msg *m)
+{
+    if (!q->indexed)
+        return;
+    demo_index_insert(demo_pid_bucket(q, m->pid), m, by_pid);
+    demo_index_insert(demo_type_bucket(q, m->type), m, by_type);
+}
+
+// Index a message put back at the front of its level
+static inline void demo_index_add_front(struct demo_queue *q, struct demo_msg *m)
+{
+    if (!q->indexed)
+        return;
+    demo_index_insert_front(demo_pid_bucket(q, m->pid), m, by_pid);
+    demo_index_insert_front(demo_type_bucket(q, m->type), m, by_type);
+}
+
+// Index a run of messages about to be spliced onto the back of a level
+static inline void demo_index_run(struct demo_queue *q, struct list_head *run)
+{
+    struct demo_msg *m;
+
+    if (!q->indexed)
+        return;
+    list_for_each_entry(m, run, list)
+        demo_index_add(q, m);
+}
+
+// Index a run of messages about to be spliced onto the front of a level
+static inline void demo_index_run_front(struct demo_queue *q, struct list_head *run)
+{
+    struct demo_msg *m;
+
+    if (!q->indexed)
+        return;
+    list_for_each_entry_reverse(m, run, list)
+        demo_index_add_front(q, m);
+}
+
+// Drop a message leaving its level from the indexes
+static inline void demo_index_del(struct demo_queue *q, struct demo_msg *m)
+{
+    if (!q->indexed)
+        return;
+    list_del(&m->by_pid);
+    list_del(&m->by_type);
+}
+
+// ---------------------------------------------------------------------------
+// Browse Cursors
+// ---------------------------------------------------------------------------
+//
+// A browse cursor (see "IPC Functions - Browse") remembers where a reader
+// stopped in a shard's level lists between lock holds: a level and the
+// next message to look at. While it walks a shard it is on the shard's
+// cursors list, and every path that takes a message off a level list
+// first moves the cursors pointing at it on to its successor
+// (demo_cursor_skip), so a cursor never points at a message that is gone.
+// With no one browsing this costs one list_empty() per message.
+// Both helpers must be called with q->lock held.
+
+// A reader's position in a queue
+struct demo_cursor {
+    struct list_head node;    // On the cursors list of the shard it walks
+    struct demo_queue *q;     // Queue being browsed, NULL outside a pass
+    u32 shard;                // Index of the shard being walked
+    u32 level;                // Level being walked, prio_levels = shard done
+    struct demo_msg *next;    // Next message to look at, NULL = level head
+    u64 min_seq;              // Report messages numbered from here
+    u64 end_seq;              // Last message sent before the pass began
+};
+
+// Move every cursor pointing at m on to its successor; m is about to
+// leave its level list
+static inline void demo_cursor_skip(struct demo_queue *q, struct demo_msg *m)
+{
+    struct demo_cursor *c;
+
+    if (list_empty(&q->cursors))
+        return;
+    list_for_each_entry(c, &q->cursors, node) {
+        if (c->next != m)
+            continue;
+        if (list_is_last(&m->list, demo_level_list(q, m->level))) {
+            c->next = NULL;
+            c->level = m->level + 1;
+        } else {
+            c->next = list_entry(m->list.next, struct demo_msg, list);
+        }
+    }
+}
+
+// Send every cursor back to the head of its level, the lists were emptied
+static inline void demo_cursor_rewind(struct demo_queue *q)
+{
+    struct demo_cursor *c;
+
+    list_for_each_entry(c, &q->cursors, node)
+        c->next = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Per-CPU Enqueue Staging
+// ---------------------------------------------------------------------------
+//
+// With percpu_staging=1, producers append to a list owned by their CPU (one
+// set of stages per queue) and never touch the queue lock. Consumers move
+// every staged run into the priority lists (demo_drain_stages) before they
+// dequeue.
+//
+// ORDERING: within a priority level, messages staged on the same CPU are
+// delivered in the order they were sent. Runs from different CPUs are
+// merged CPU by CPU at drain time, so messages from two CPUs may be
+// interleaved differently from their wall-clock send order, and a task
+// that migrates between sends can see its own messages reordered. Strict
+// FIFO across producers needs percpu_staging=0 (the default).
+
+struct demo_stage {
+    spinlock_t lock;          // Producer on this CPU vs. a draining consumer
+    int count;                // Staged messages, read locklessly
+    struct demo_batch batch;  // Staged messages, per level
+} ____cacheline_aligned_in_smp;
+
+// Append one message (m) or a whole run (b) to this CPU's stage, whatever
+// percpu_staging says; safe in any context
+static inline void __demo_stage(struct demo_queue *q, struct demo_msg *m,
+                                struct demo_batch *b)
+{
+    struct demo_stage *stage;
+    unsigned long flags;
+    bool was_empty;
+    int cpu, n;
+    u32 level;
+
+    cpu = get_cpu();
+    stage = per_cpu_ptr(q->stages, cpu);
+
+    spin_lock_irqsave(&stage->lock, flags);
+    was_empty = stage->count == 0;
+    if (m) {
+        demo_batch_add(&stage->batch, m);
+        n = 1;
+    } else {
+        n = 0;
+        for_each_set_bit(level, b->used, SAFE_LKM_PRIO_MAX)
+            n += b->n[level];
+        demo_batch_splice(&stage->batch, b);
+    }
+    WRITE_ONCE(stage->count, stage->count + n);
+    spin_unlock_irqrestore(&stage->lock, flags);
+
+    // Only the empty -> non-empty transition touches the shared mask
+    if (was_empty)
+        cpumask_set_cpu(cpu, &q->staged_cpus);
+    put_cpu();
+}
+
+// Append one message (m) or a whole run (b) to this CPU's stage
+// Returns false when staging is off, in which case nothing was consumed.
+static inline bool demo_stage(struct demo_queue *q, struct demo_msg *m,
+                              struct demo_batch *b)
+{
+    if (!READ_ONCE(percpu_staging))
+        return false;
+    __demo_stage(q, m, b);
+    return true;
+}
+
+// Move every staged run onto the priority lists
+// Must be called with q->lock held (lock order: queue, then stage).
+// Stage locks are taken with interrupts off, as atomic senders stage too.
+static inline void demo_drain_stages(struct demo_queue *q)
+{
+    struct demo_stage *stage;
+    struct demo_batch *sb;
+    unsigned long flags;
+    int cpu;
+    u32 level;
+
+    if (cpumask_empty(&q->staged_cpus))
+        return;
+
+    for_each_cpu(cpu, &q->staged_cpus) {
+        if (!cpumask_test_and_clear_cpu(cpu, &q->staged_cpus))
+            continue;
+
+        stage = per_cpu_ptr(q->stages, cpu);
+        sb = &stage->batch;
+        spin_lock_irqsave(&stage->lock, flags);
+        for_each_set_bit(level, sb->used, SAFE_LKM_PRIO_MAX) {
+            demo_index_run(q, &sb->lists[level]);
+            list_splice_tail_init(&sb->lists[level], demo_level_list(q, level));
+            demo_account_add(q, level, sb->n[level], sb->bytes[level]);
+        }
+        demo_batch_init(sb);
+        WRITE_ONCE(stage->count, 0);
+        spin_unlock_irqrestore(&stage->lock, flags);
+    }
+}
+
+// Approximate number of staged messages, read without any locks
+static inline long demo_staged_count(struct demo_queue *q)
+{
+    long n = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        n += READ_ONCE(per_cpu_ptr(q->stages, cpu)->count);
+    return n;
+}
+
+static inline int demo_stages_init(struct demo_queue *q)
+{
+    struct demo_stage *stage;
+    int cpu;
+
+    q->stages = alloc_percpu(struct demo_stage);
+    if (!q->stages)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        stage = per_cpu_ptr(q->stages, cpu);
+        spin_lock_init(&stage->lock);
+        stage->count = 0;
+        demo_batch_init(&stage->batch);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Lowest Priority Ring Backend
+// ---------------------------------------------------------------------------
+//
+// With normal_ring_size=N, sends at the lowest priority level (the normal
+// lane with the default two levels) go into a bounded lock-free MPSC ring
+// (safe_lkm_ring.h) instead of that level's list, so producers take no lock
+// at all. The single consumer is whoever holds the queue lock: it moves ring
+// entries onto the list on demand (demo_ring_refill), and from there they
+// are dequeued and accounted exactly like list messages. The list therefore
+// only ever holds messages older than anything still in the ring, which
+// keeps the level FIFO, and since nothing ranks below the lowest level the
+// ring only has to be looked at once every list is empty. A full ring
+// rejects the send with -EAGAIN.
+
+static inline u32 demo_ring_level(struct demo_queue *q)
+{
+    return q->prio_levels - 1;
+}
+
+static inline bool demo_use_ring(struct demo_queue *q, const struct demo_msg *m)
+{
+    return q->ring_size && m->level == demo_ring_level(q);
+}
+
+// Publish a lowest priority message without taking q->lock
+// Returns: true on success, false if the ring is full
+static inline bool demo_ring_push(struct demo_queue *q, struct demo_msg *m)
+{
+    u32 len = m->len;   // m may be consumed as soon as it is published
+    bool ok;
+
+    preempt_disable();
+    ok = safe_lkm_ring_push(&q->ring, m);
+    if (ok)
+        this_cpu_add(*q->ring_bytes_in, len);
+    preempt_enable();
+
+    if (!ok)
+        atomic64_inc(&q->ring_full);
+    return ok;
+}
+
+// Move up to max ring entries onto the lowest level's list
+// Must be called with q->lock held (this is the single consumer).
+static inline void demo_ring_refill(struct demo_queue *q, int max)
+{
+    u32 level = demo_ring_level(q);
+    struct demo_msg *m;
+
+    if (!q->ring_size)
+        return;
+
+    while (max-- > 0 && (m = safe_lkm_ring_pop(&q->ring))) {
+        list_add_tail(&m->list, demo_level_list(q, level));
+        demo_index_add(q, m);
+        demo_account_add(q, level, 1, m->len);
+        q->ring_bytes_out += m->len;
+    }
+}
+
+// Fold ring-resident messages into a counter snapshot
+// Must be called with q->lock held.
+static inline void demo_ring_snapshot(struct demo_queue *q, struct demo_snapshot *snap)
+{
+    enum demo_class class = demo_level_class(q, demo_ring_level(q));
+    unsigned long queued;
+    u64 bytes_in = 0;
+    int cpu;
+
+    if (!q->ring_size)
+        return;
+
+    for_each_possible_cpu(cpu)
+        bytes_in += *per_cpu_ptr(q->ring_bytes_in, cpu);
+
+    queued = safe_lkm_ring_count(&q->ring);
+    snap->count += queued;
+    snap->depth[class] += queued;
+    snap->enqueued[class] += queued;
+    snap->level_depth[demo_ring_level(q)] += queued;
+    snap->bytes += bytes_in - q->ring_bytes_out;
+    snap->ring_queued += queued;
+}
+
+static inline int demo_ring_init(struct demo_queue *q)
+{
+    struct safe_lkm_ring_slot *slots;
+
+    if (!q->ring_size)
+        return 0;
+    if (!is_power_of_2(q->ring_size))
+        return -EINVAL;
+
+    slots = kvmalloc_node(array_size(q->ring_size, sizeof(*slots)), GFP_KERNEL, q->node);
+    q->ring_bytes_in = alloc_percpu(u64);
+    if (!slots || !q->ring_bytes_in) {
+        kvfree(slots);
+        return -ENOMEM;
+    }
+
+    safe_lkm_ring_init(&q->ring, slots, q->ring_size);
+    return 0;
+}
+
+// Safe on a partially initialized ring
+static inline void demo_ring_exit(struct demo_queue *q)
+{
+    kvfree(q->ring.slots);
+    free_percpu(q->ring_bytes_in);
+}
+
+// ---------------------------------------------------------------------------
+// Dequeue Policy
+// ---------------------------------------------------------------------------
+//
+// Strict priority (the default) always serves the highest non-empty level,
+// so a steady stream of high priority traffic can starve everything below
+// it. Two opt-in mechanisms bound that:
+//
+//   dequeue_policy=1  weighted round-robin: non-empty levels take turns and
+//                     each turn delivers up to level_weights[level] messages
+//                     (deficit round-robin with a cost of one per message);
+//                     an emptied level forfeits the rest of its turn
+//   age_deadline_ms   any level whose oldest message has waited longer than
+//                     the deadline is served next, oldest first; checking
+//                     costs one look at each non-empty level's head
+//
+// Both only reorder across levels: FIFO within a level always holds. The
+// policy parameters are module-wide; the state (turn, credit, histograms)
+// is per queue and protected by q->lock.
+
+static inline int demo_level_weight(struct demo_queue *q, u32 level)
+{
+    unsigned int w = 0;
+
+    if (level < nr_level_weights)
+        w = READ_ONCE(level_weights[level]);
+    return w ? w : q->prio_levels - level;
+}
+
+// Level whose head message is the oldest past age_deadline_ms
+// Returns: that level, or prio_levels if no head is overdue
+static inline u32 demo_aged_level(struct demo_queue *q, u64 now)
+{
+    u64 deadline = (u64)READ_ONCE(age_deadline_ms) * NSEC_PER_MSEC;
+    u64 oldest = now;
+    u32 level, found = q->prio_levels;
+    struct demo_msg *head;
+
+    for_each_set_bit(level, q->msgs.nonempty, q->prio_levels) {
+        head = list_first_entry(demo_level_list(q, level), struct demo_msg, list);
+        if (now - head->enq_ns > deadline && head->enq_ns < oldest) {
+            oldest = head->enq_ns;
+            found = level;
+        }
+    }
+    return found;
+}
+
+// Next level in round-robin order among the ones set in nonempty, keeping
+// its turn while credit remains
+static inline u32 demo_wrr_turn(struct demo_queue *q, const unsigned long *nonempty)
+{
+    u32 level = q->wrr_level;
+
+    if (q->wrr_credit > 0 && level < q->prio_levels && test_bit(level, nonempty))
+        return level;
+
+    level = level + 1 < q->prio_levels ?
+            find_next_bit(nonempty, q->prio_levels, level + 1) : q->prio_levels;
+    if (level >= q->prio_levels)
+        level = find_first_bit(nonempty, q->prio_levels);
+    q->wrr_level = level;
+    q->wrr_credit = demo_level_weight(q, level);
+    return level;
+}
+
+static inline u32 demo_wrr_pick(struct demo_queue *q)
+{
+    return demo_wrr_turn(q, q->msgs.nonempty);
+}
+
+// Reserve up to want dequeues from non-empty shard q on its queue's
+// round-robin turn (see demo_wrr_shard), so receivers on other shards
+// cannot spend the same credit; demo_charge_level() hands back what is
+// not taken
+// Returns: the level whose turn it is, with *take set; or, if q does not
+// hold that level or the turn is used up (a race with another receiver),
+// q's top level with *take set to 0: out of turn, see demo_pick_level()
+// Must be called with q->lock held; takes the home queue's lock inside it.
+static inline u32 demo_wrr_take(struct demo_queue *q, int want, int *take)
+{
+    struct demo_queue *h = q->home;
+    u32 level;
+
+    spin_lock(&h->lock);
+    level = h->wrr_level;
+    if (h->wrr_credit > 0 && level < q->prio_levels && test_bit(level, q->msgs.nonempty)) {
+        *take = min(want, h->wrr_credit);
+        h->wrr_credit -= *take;
+    } else {
+        level = demo_top_level(q);
+        *take = 0;
+    }
+    spin_unlock(&h->lock);
+    return level;
+}
+
+// Choose the level to dequeue from and how many messages to take in a row
+// Parameters:
+//   want - messages the caller would like (1 for a single receive)
+//   now  - ktime_get_ns() for aging
+//   take - set to how many of them may come from the returned level; 0
+//          for a shard that is out of its round-robin turn, which should
+//          serve one message only if it has served none yet
+//   pick - set to what the level was chosen by
+// Nothing is charged here: pass the number actually detached to
+// demo_charge_level() afterwards.
+// Returns: the level, or prio_levels if every list is empty
+// Must be called with q->lock held.
+static inline u32 demo_pick_level(struct demo_queue *q, int want, u64 now, int *take,
+                                  enum demo_pick *pick)
+{
+    u32 level;
+
+    *take = want;
+    *pick = PICK_TOP;
+    if (bitmap_empty(q->msgs.nonempty, q->prio_levels))
+        return q->prio_levels;
+
+    if (READ_ONCE(age_deadline_ms)) {
+        level = demo_aged_level(q, now);
+        if (level < q->prio_levels) {
+            if (level != demo_top_level(q))
+                *pick = PICK_AGED;
+            *take = 1;
+            return level;
+        }
+    }
+
+    if (READ_ONCE(dequeue_policy) != POLICY_WRR)
+        return demo_top_level(q);
+
+    // A shard takes turns with the other shards
+    if (q->home != q) {
+        level = demo_wrr_take(q, want, take);
+        if (*take)
+            *pick = PICK_WRR_SHARD;
+        return level;
+    }
+
+    level = demo_wrr_pick(q);
+    *take = min(want, q->wrr_credit);
+    *pick = PICK_WRR;
+    return level;
+}
+
+// Charge the n messages detached from a level demo_pick_level() chose, of
+// the take it allowed: an overdue message counts as aged if it went, the
+// round-robin turn loses n messages of credit
+// Must be called with q->lock held; takes the home queue's lock for a shard.
+static inline void demo_charge_level(struct demo_queue *q, u32 level, enum demo_pick pick,
+                                     int take, int n)
+{
+    struct demo_queue *h = q->home;
+
+    switch (pick) {
+    case PICK_TOP:
+        break;
+    case PICK_AGED:
+        if (n)
+            q->aged++;
+        break;
+    case PICK_WRR:
+        q->wrr_credit -= n;
+        break;
+    case PICK_WRR_SHARD:
+        // Hand back the unused reservation, unless the turn has moved on
+        if (n >= take)
+            break;
+        spin_lock(&h->lock);
+        if (h->wrr_level == level)
+            h->wrr_credit += take - n;
+        spin_unlock(&h->lock);
+        break;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Latency Histograms
+// ---------------------------------------------------------------------------
+//
+// Every queue keeps per-CPU log-linear histograms of
+//   - residence time, admission to dequeue, per high/normal class
+//   - the cost of linking one message (all send paths but the batch splice)
+//   - the cost of one demo_queue_receive() that returned a message
+// A bucket is at most 1/LL_SUB of its lower bound wide, so percentiles are
+// within 12.5% at any scale. Recording is one this_cpu_inc(): no lock, no
+// shared cache line, safe from any context. Readers sum the CPUs.
+//
+// The per-level log2 histograms (lat_hist) are older and coarser; they
+// still back the latency_p99_us_* keys of /proc/safe_lkm_stats.
+
+static inline u32 demo_ll_bucket(u64 ns)
+{
+    int shift;
+
+    if (ns < LL_SUB)
+        return ns;
+    shift = fls64(ns) - 1;
+    if (shift >= LL_MAX_SHIFT)
+        return LL_BUCKETS - 1;
+    return (shift - LL_SUB_BITS + 1) * LL_SUB + ((ns >> (shift - LL_SUB_BITS)) & (LL_SUB - 1));
+}
+
+// Smallest value that falls in bucket b; b == LL_BUCKETS gives the upper
+// bound of the last bucket
+static inline u64 demo_ll_bucket_lo(u32 b)
+{
+    if (b < LL_SUB)
+        return b;
+    return (u64)(LL_SUB + b % LL_SUB) << (b / LL_SUB - 1);
+}
+
+static inline void demo_lat_add(struct demo_queue *q, enum demo_lat_kind kind, u64 ns)
+{
+    this_cpu_inc(q->lat->hist[kind][demo_ll_bucket(ns)]);
+}
+
+// Sum one histogram over all CPUs into hist[LL_BUCKETS]
+// Returns: the number of samples
+static inline u64 demo_lat_read(struct demo_queue *q, enum demo_lat_kind kind, u64 *hist)
+{
+    u64 total = 0;
+    int cpu, b;
+
+    memset(hist, 0, LL_BUCKETS * sizeof(*hist));
+    for_each_possible_cpu(cpu) {
+        const u64 *src = per_cpu_ptr(q->lat, cpu)->hist[kind];
+
+        for (b = 0; b < LL_BUCKETS; b++)
+            hist[b] += READ_ONCE(src[b]);
+    }
+    for (b = 0; b < LL_BUCKETS; b++)
+        total += hist[b];
+    return total;
+}
+
+// Upper bound (exclusive) of the bucket holding the permille-th sample
+// permille is in 1/1000ths: 500 = median, 999 = p99.9, 1000 = max.
+static inline u64 demo_ll_percentile(const u64 *hist, u64 total, u32 permille)
+{
+    u64 seen = 0;
+    u32 b;
+
+    if (!total)
+        return 0;
+    for (b = 0; b < LL_BUCKETS - 1; b++) {
+        seen += hist[b];
+        if (seen * 1000 >= total * permille)
+            break;
+    }
+    return demo_ll_bucket_lo(b + 1);
+}
+
+// Record how long a message waited in the queue
+// Must be called with q->lock held.
+static inline void demo_lat_record(struct demo_queue *q, u32 level, u64 now,
+                                   const struct demo_msg *m)
+{
+    u64 waited = now > m->enq_ns ? now - m->enq_ns : 0;
+
+    q->lat_hist[level][min(fls64(waited), LAT_BUCKETS - 1)]++;
+    demo_lat_add(q, LAT_RESIDENCE + demo_level_class(q, level), waited);
+}
+
+// 99th percentile of a histogram, as the upper bound of its bucket in us
+static inline u64 demo_lat_p99_us(const u64 *hist)
+{
+    u64 total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+        total += hist[b];
+    if (!total)
+        return 0;
+
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen * 100 >= total * 99)
+            break;
+    }
+    return b ? div_u64(1ULL << b, NSEC_PER_USEC) : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Receiver Wake-up
+// ---------------------------------------------------------------------------
+//
+// Blocking receivers and poll()ers sleep on their queue's readq (a sharded
+// queue's, whichever shard they will receive from). Every path that makes
+// a message receivable calls demo_wake_readers() afterwards; with no
+// sleepers that costs one memory barrier and no lock.
+
+static inline void demo_wake_readers(struct demo_queue *q)
+{
+    // Pairs with the barrier in prepare_to_wait() on the sleeper side
+    if (wq_has_sleeper(&q->home->readq))
+        wake_up_interruptible(&q->home->readq);
+}
+
+// Messages on the lists, stages and ring of every shard, read without
+// any locks
+static inline long demo_queue_depth(struct demo_queue *q)
+{
+    struct demo_queue *s;
+    long n = 0;
+    int i;
+
+    demo_for_each_shard(q, s, i)
+        n += READ_ONCE(s->msgs.count) + demo_staged_count(s) +
+             (s->ring_size ? safe_lkm_ring_count(&s->ring) : 0);
+    return n;
+}
+
+// Lockless wait condition: could a receive find something right now, or
+// has the queue been destroyed? It can race with other receivers, so
+// waiters must retry the real dequeue and go back to sleep if someone else
+// got there first.
+static inline bool demo_msg_available(struct demo_queue *q)
+{
+    return demo_queue_depth(q) > 0 || READ_ONCE(q->dead);
+}
+
+// ---------------------------------------------------------------------------
+// Capacity and Backpressure
+// ---------------------------------------------------------------------------
+//
+// A send reserves room before its message is linked (demo_admit) and the
+// room is given back when the message leaves the queue (demo_account_del).
+// Reservations are atomic counters, so the total and per-class bounds hold
+// exactly without the queue lock, even for staged and ring messages; at
+// worst two racing senders both fail where one could have succeeded. The
+// counters are the home queue's, so a sharded queue holds its whole
+// capacity across its shards.
+// Memory held by a queue is therefore bounded by its capacity times
+// msg_max_size, plus one unadmitted message per sender.
+//
+// What a send that finds no room gets is the queue's overflow policy
+// (SAFE_LKM_OVERFLOW_*, see safe_lkm_uapi.h). Blocked senders sleep on
+// writeq (of the sharded queue, with shards); every dequeue
+// path calls demo_wake_writers() after dropping the lock, which costs one
+// memory barrier when nobody is waiting.
+
+static inline void demo_wake_writers(struct demo_queue *q)
+{
+    // Pairs with the barrier in prepare_to_wait() on the sleeper side
+    if (wq_has_sleeper(&q->home->writeq))
+        wake_up_interruptible(&q->home->writeq);
+}
+
+// The total capacity a class is held to
+// REJECT_NORMAL lets high priority sends past it, bounded by their own
+// class capacity only.
+static inline u32 demo_total_capacity(struct demo_queue *q, enum demo_class class)
+{
+    if (class == CLASS_HIGH && q->overflow == SAFE_LKM_OVERFLOW_REJECT_NORMAL)
+        return 0;
+    return q->capacity;
+}
+
+// Is the class itself at its capacity, whatever the total?
+static inline bool demo_class_full(struct demo_queue *q, enum demo_class class)
+{
+    u32 cap = q->class_capacity[class];
+
+    return cap && atomic_read(&q->home->class_admitted[class]) >= cap;
+}
+
+// Lockless check: would a send of this class find room right now?
+static inline bool demo_has_room(struct demo_queue *q, enum demo_class class)
+{
+    u32 cap = demo_total_capacity(q, class);
+
+    return (!cap || atomic_read(&q->home->admitted) < cap) &&
+           !demo_class_full(q, class);
+}
+
+// Reserve room for one message of a class
+// Returns: true if the room is now held by the caller
+static inline bool demo_reserve(struct demo_queue *q, enum demo_class class)
+{
+    u32 cap = demo_total_capacity(q, class);
+    u32 class_cap = q->class_capacity[class];
+    int total, in_class;
+
+    total = atomic_inc_return(&q->home->admitted);
+    in_class = atomic_inc_return(&q->home->class_admitted[class]);
+    if ((!cap || total <= cap) && (!class_cap || in_class <= class_cap))
+        return true;
+
+    atomic_dec(&q->home->admitted);
+    atomic_dec(&q->home->class_admitted[class]);
+    return false;
+}
+
+// Give back room reserved for a message that was never linked
+static inline void demo_unreserve(struct demo_queue *q, enum demo_class class)
+{
+    atomic_dec(&q->home->admitted);
+    atomic_dec(&q->home->class_admitted[class]);
+    demo_wake_writers(q);
+}
+
+// The oldest queued normal priority message, NULL if there is none
+// Level heads are oldest within their level, so this compares one message
+// per non-empty normal level.
+// Must be called with q->lock held.
+static inline struct demo_msg *demo_oldest_normal(struct demo_queue *q)
+{
+    struct demo_msg *m, *oldest = NULL;
+    u32 level = q->high_levels;
+
+    demo_drain_stages(q);
+    if (!q->msgs.depth[demo_ring_level(q)])
+        demo_ring_refill(q, 1);
+    for_each_set_bit_from(level, q->msgs.nonempty, q->prio_levels) {
+        m = list_first_entry(demo_level_list(q, level), struct demo_msg, list);
+        if (!oldest || m->enq_ns < oldest->enq_ns)
+            oldest = m;
+    }
+    return oldest;
+}
+
+// Unlink the oldest queued normal priority message to make room
+// Room is shared by the shards of a queue, so with shards that is the
+// oldest of any shard, each looked at under its lock.
+// Returns: the message, now owned by the caller, or NULL if there is none
+static inline struct demo_msg *demo_drop_oldest(struct demo_queue *q)
+{
+    struct demo_queue *home = q->home, *s;
+    struct demo_msg *victim;
+    u64 oldest = U64_MAX;
+    int i;
+
+    if (home->shards) {
+        demo_for_each_shard(home, s, i) {
+            spin_lock(&s->lock);
+            victim = demo_oldest_normal(s);
+            if (victim && victim->enq_ns < oldest) {
+                q = s;
+                oldest = victim->enq_ns;
+            }
+            spin_unlock(&s->lock);
+        }
+    }
+
+    spin_lock(&q->lock);
+    victim = demo_oldest_normal(q);
+    if (victim) {
+        demo_cursor_skip(q, victim);
+        list_del(&victim->list);
+        demo_index_del(q, victim);
+        demo_account_del(q, victim->level, 1, victim->len);
+    }
+    spin_unlock(&q->lock);
+    return victim;
+}
+
+static inline void demo_enqueue_batch(struct demo_queue *q, struct demo_batch *b);
+
+// Stamp a message that was given room: its residence time and its
+// sequence number (see "IPC Functions - Browse") start here
+static inline void demo_stamp_msg(struct demo_queue *q, struct demo_msg *m, u64 now)
+{
+    m->enq_ns = now;
+    m->seq = atomic64_inc_return(&q->home->seq);
+    if (m->expires_ns && !READ_ONCE(q->has_ttl))
+        WRITE_ONCE(q->has_ttl, true);
+}
+
+// Reserve room for m as the queue's overflow policy says
+// On success m is stamped (demo_stamp_msg): residence time starts at admission.
+// Parameters:
+//   q        - the queue
+//   m        - the message about to be linked
+//   nonblock - never sleep, even under SAFE_LKM_OVERFLOW_BLOCK
+//   pending  - messages admitted but not linked yet, or NULL; they are
+//              queued before sleeping so receivers can make room
+// Returns: 0, -EAGAIN if there is no room, -ENODEV if the queue was
+//          destroyed, -ERESTARTSYS if a signal ended the wait
+static inline int demo_admit(struct demo_queue *q, struct demo_msg *m,
+                             bool nonblock, struct demo_batch *pending)
+{
+    enum demo_class class = demo_level_class(q, m->level);
+    struct demo_msg *victim;
+    bool waited = false;
+    int ret;
+
+    for (;;) {
+        if (READ_ONCE(q->dead))
+            return -ENODEV;
+        if (demo_reserve(q, class)) {
+            // Time spent waiting for room is the sender's, not the queue's
+            demo_stamp_msg(q, m, ktime_get_ns());
+            return 0;
+        }
+
+        switch (q->overflow) {
+        case SAFE_LKM_OVERFLOW_BLOCK:
+            if (nonblock)
+                break;
+            if (pending && !bitmap_empty(pending->used, SAFE_LKM_PRIO_MAX))
+                demo_enqueue_batch(q, pending);
+            if (!waited) {
+                atomic64_inc(&q->blocked);
+                waited = true;
+            }
+            ret = wait_event_interruptible(q->home->writeq, demo_has_room(q, class) ||
+                                                      READ_ONCE(q->dead));
+            if (ret)
+                return ret;
+            continue;
+        case SAFE_LKM_OVERFLOW_DROP_OLDEST:
+            // Dropping normal messages cannot make room in a full high class
+            if (demo_class_full(q, class))
+                break;
+            victim = demo_drop_oldest(q);
+            if (!victim)
+                break;
+            atomic64_inc(&q->dropped);
+            trace_msg_drop(victim->pid, victim->type, victim->len);
+            demo_free_msg(victim);
+            continue;
+        }
+
+        atomic64_inc(&q->full);
+        return -EAGAIN;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// IPC Functions - Send Message
+// ---------------------------------------------------------------------------
+
+// Link an admitted message into the priority queue
+// The tracepoint fires first: once linked, a consumer may free m at any time.
+// Returns: 0 on success, -EAGAIN if the normal priority ring is full (the
+// message is then still owned by the caller and its room given back)
+static inline int demo_link_msg(struct demo_queue *q, struct demo_msg *m)
+{
+    int pid = m->pid, type = m->type;
+    u32 len = m->len, level = m->level;
+    u64 start = ktime_get_ns();
+
+    if (demo_use_ring(q, m)) {
+        if (!demo_ring_push(q, m)) {
+            demo_unreserve(q, demo_level_class(q, level));
+            return -EAGAIN;
+        }
+        trace_msg_enqueue(pid, type, len);
+        goto out;
+    }
+
+    trace_msg_enqueue(pid, type, len);
+
+    if (demo_stage(q, m, NULL))
+        goto out;
+
+    spin_lock(&q->lock);
+    list_add_tail(&m->list, demo_level_list(q, level));
+    demo_index_add(q, m);
+    demo_account_add(q, level, 1, len);
+    spin_unlock(&q->lock);
+out:
+    demo_wake_readers(q);
+    demo_lat_add(q, LAT_ENQUEUE, ktime_get_ns() - start);
+    return 0;
+}
+
+// Send from interrupt or other atomic context, where q->lock must not be
+// taken and nothing may sleep: the message is reserved room without any
+// overflow policy (a full queue fails, nothing is dropped) and goes onto
+// the ring or this CPU's stage, never onto the lists directly. Receivers
+// pick it up at their next drain.
+// Returns: 0, -EAGAIN if there is no room or the ring is full, -ENODEV if
+//          the queue was destroyed; on error m is still the caller's
+static inline int demo_enqueue_atomic(struct demo_queue *q, struct demo_msg *m)
+{
+    enum demo_class class = demo_level_class(q, m->level);
+    int pid = m->pid, type = m->type;
+    u32 len = m->len;
+    u64 start = ktime_get_ns();
+
+    if (READ_ONCE(q->dead))
+        return -ENODEV;
+    if (!demo_reserve(q, class)) {
+        atomic64_inc(&q->full);
+        return -EAGAIN;
+    }
+    demo_stamp_msg(q, m, start);
+
+    if (demo_use_ring(q, m)) {
+        if (!demo_ring_push(q, m)) {
+            demo_unreserve(q, class);
+            return -EAGAIN;
+        }
+        trace_msg_enqueue(pid, type, len);
+    } else {
+        trace_msg_enqueue(pid, type, len);
+        __demo_stage(q, m, NULL);
+    }
+    demo_wake_readers(q);
+    demo_lat_add(q, LAT_ENQUEUE, ktime_get_ns() - start);
+    return 0;
+}
+
+// Admit and link one message, see demo_admit() and demo_link_msg()
+// Returns: 0, or an error with the message still owned by the caller
+static inline int demo_enqueue_msg(struct demo_queue *q, struct demo_msg *m,
+                                   bool nonblock)
+{
+    int ret;
+
+    ret = demo_admit(q, m, nonblock, NULL);
+    if (!ret)
+        ret = demo_link_msg(q, m);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// Message Expiry
+// ---------------------------------------------------------------------------
+//
+// A message may carry a deadline (expires_ns, from the sender's TTL). An
+// expired message is never delivered; it is discarded
+//   - by the receive paths: before a level is picked, expired level heads
+//     are unlinked, and a batch receive also drops expired messages inside
+//     the run it cuts, which it walks anyway
+//   - by a sweeper (demo_queue_expire(), run periodically by the module),
+//     so stale messages stop holding memory and capacity on a queue that
+//     nobody reads; it takes the lock once per EXPIRE_BATCH messages
+// Neither looks past a live head, so the cost is one check per non-empty
+// level plus one per discarded message, never a list scan. Within a level
+// messages are FIFO and senders with one TTL expire in order; a message
+// queued behind a longer-lived one is discarded when it reaches the head.
+// Queues that never saw a message with a deadline skip all of this.
+
+#define EXPIRE_BATCH 64
+
+static inline bool demo_msg_expired(const struct demo_msg *m, u64 now)
+{
+    return m->expires_ns && now >= m->expires_ns;
+}
+
+// Move one expired message from the queue onto dead
+// Must be called with q->lock held.
+static inline void demo_expire_msg(struct demo_queue *q, struct demo_msg *m,
+                                   struct list_head *dead)
+{
+    demo_cursor_skip(q, m);
+    list_move_tail(&m->list, dead);
+    demo_index_del(q, m);
+    demo_account_del(q, m->level, 1, m->len);
+}
+
+// Move up to max expired level heads onto dead
+// Must be called with q->lock held. Returns the number moved.
+static inline int demo_trim_expired(struct demo_queue *q, u64 now, int max,
+                                    struct list_head *dead)
+{
+    struct demo_msg *m;
+    int n = 0;
+    u32 level;
+
+    if (!READ_ONCE(q->has_ttl))
+        return 0;
+
+    for_each_set_bit(level, q->msgs.nonempty, q->prio_levels) {
+        while (n < max && q->msgs.depth[level]) {
+            m = list_first_entry(demo_level_list(q, level), struct demo_msg, list);
+            if (!demo_msg_expired(m, now))
+                break;
+            demo_expire_msg(q, m, dead);
+            n++;
+        }
+    }
+    return n;
+}
+
+// Trim expired heads until every level head is live, refilling the ring's
+// level as the receive paths do
+// Must be called with q->lock held. Returns the number moved onto dead.
+static inline int demo_trim_heads(struct demo_queue *q, u64 now, struct list_head *dead)
+{
+    int n, total = 0;
+
+    do {
+        if (!q->msgs.depth[demo_ring_level(q)])
+            demo_ring_refill(q, 1);
+        n = demo_trim_expired(q, now, INT_MAX, dead);
+        total += n;
+    } while (n);
+    return total;
+}
+
+// Free the messages collected by demo_trim_expired(), without the lock
+static inline void demo_free_expired(struct demo_queue *q, struct list_head *dead)
+{
+    struct demo_msg *m, *tmp;
+    int n = 0;
+
+    list_for_each_entry_safe(m, tmp, dead, list) {
+        trace_msg_expire(m->pid, m->type, m->len);
+        demo_free_msg(m);
+        n++;
+    }
+    INIT_LIST_HEAD(dead);
+    if (n) {
+        atomic64_add(n, &q->expired);
+        demo_wake_writers(q);
+    }
+}
+
+// Sweep one shard: discard every expired message at a level head
+// Returns: the number discarded
+static inline int __demo_queue_expire(struct demo_queue *q)
+{
+    LIST_HEAD(dead);
+    int n, total = 0;
+
+    if (!READ_ONCE(q->has_ttl))
+        return 0;
+
+    do {
+        spin_lock(&q->lock);
+        demo_drain_stages(q);
+        demo_ring_refill(q, EXPIRE_BATCH);
+        n = demo_trim_expired(q, ktime_get_ns(), EXPIRE_BATCH, &dead);
+        spin_unlock(&q->lock);
+
+        demo_free_expired(q, &dead);
+        total += n;
+    } while (n == EXPIRE_BATCH);
+    return total;
+}
+
+// Sweep a queue, every shard of it, see __demo_queue_expire()
+static inline int demo_queue_expire(struct demo_queue *q)
+{
+    struct demo_queue *s;
+    int i, total = 0;
+
+    demo_for_each_shard(q, s, i)
+        total += __demo_queue_expire(s);
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// IPC Functions - Receive Message
+// ---------------------------------------------------------------------------
+
+// Receive a message from a queue
+// Priority: the highest non-empty level first, FIFO within a level, unless
+// a fair dequeue policy or aging is enabled (see "Dequeue Policy")
+// Parameters:
+//   q   - the queue
+//   out - Set to the dequeued message; the caller owns it and releases it
+//         with demo_free_msg() once the payload has been consumed
+// Returns: 0 on success, -ENOMSG if queue is empty
+static inline int demo_queue_receive(struct demo_queue *q, struct demo_msg **out)
+{
+    struct demo_msg *m = NULL;
+    int ret = -ENOMSG;
+    u64 now = ktime_get_ns();
+    LIST_HEAD(dead);
+    enum demo_pick pick;
+    int take;
+    u32 level;
+
+    spin_lock(&q->lock);
+    demo_drain_stages(q);
+    if (!q->msgs.depth[demo_ring_level(q)])
+        demo_ring_refill(q, 1);
+    demo_trim_heads(q, now, &dead);
+    level = demo_pick_level(q, 1, now, &take, &pick);
+    if (level < q->prio_levels) {
+        m = list_first_entry(demo_level_list(q, level), struct demo_msg, list);
+        demo_charge_level(q, level, pick, take, 1);
+    }
+    
+    if (m) {
+        demo_cursor_skip(q, m);
+        list_del(&m->list);
+        demo_index_del(q, m);
+        demo_account_del(q, level, 1, m->len);
+        demo_lat_record(q, level, now, m);
+        *out = m;
+        ret = 0;
+    }
+    spin_unlock(&q->lock);
+    demo_free_expired(q, &dead);
+
+    // m now belongs to the caller, so it is safe to trace after unlocking
+    if (m) {
+        trace_msg_dequeue(m->pid, m->type, m->len);
+        demo_wake_writers(q);
+        demo_lat_add(q, LAT_DEQUEUE, ktime_get_ns() - now);
+    } else {
+        trace_queue_empty(task_tgid_vnr(current));
+    }
+    
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// IPC Functions - Selective Receive
+// ---------------------------------------------------------------------------
+//
+// Receive the oldest queued message from a given sender pid and/or of a
+// given type, whatever its priority (the msgrcv() model). The index
+// buckets (see "Selective Receive Indexes") make this a walk of one bucket
+// instead of every level list: with a type filter the type bucket is
+// walked, otherwise the pid bucket. Expired messages met on the way are
+// discarded as the plain receive path would.
+
+// What a selective receive accepts
+struct demo_match {
+    u32 flags;                  // SAFE_LKM_MATCH_*
+    int pid;
+    int type;
+};
+
+static inline bool demo_match_msg(const struct demo_match *f, const struct demo_msg *m)
+{
+    if ((f->flags & SAFE_LKM_MATCH_PID) && m->pid != f->pid)
+        return false;
+    if ((f->flags & SAFE_LKM_MATCH_TYPE) && m->type != f->type)
+        return false;
+    return true;
+}
+
+// Index every queued message, oldest admission first
+// The level lists are each in admission order, so they are merged by
+// enq_ns rather than appended one level after another.
+// Must be called with q->lock held, stages drained and the ring empty.
+static inline void demo_index_build(struct demo_queue *q)
+{
+    struct list_head *pos[SAFE_LKM_PRIO_MAX];
+    struct demo_msg *m, *oldest;
+    u32 level, pick;
+    int i;
+
+    for (i = 0; i < INDEX_BUCKETS; i++) {
+        INIT_LIST_HEAD(&q->by_pid[i]);
+        INIT_LIST_HEAD(&q->by_type[i]);
+    }
+    for (level = 0; level < q->prio_levels; level++)
+        pos[level] = demo_level_list(q, level)->next;
+
+    q->indexed = true;
+    for (;;) {
+        oldest = NULL;
+        pick = 0;
+        for_each_set_bit(level, q->msgs.nonempty, q->prio_levels) {
+            if (pos[level] == demo_level_list(q, level))
+                continue;
+            m = list_entry(pos[level], struct demo_msg, list);
+            if (!oldest || m->enq_ns < oldest->enq_ns) {
+                oldest = m;
+                pick = level;
+            }
+        }
+        if (!oldest)
+            break;
+        demo_index_add(q, oldest);
+        pos[pick] = pos[pick]->next;
+    }
+}
+
+// Bring every queued message onto the level lists and the indexes
+// Must be called with q->lock held.
+static inline void demo_index_prepare(struct demo_queue *q)
+{
+    demo_drain_stages(q);
+    demo_ring_refill(q, INT_MAX);
+    if (!q->indexed)
+        demo_index_build(q);
+}
+
+// Find the oldest live message that f accepts
+// Expired messages walked past are moved onto dead, or skipped if dead
+// is NULL.
+// Must be called with q->lock held, after demo_index_prepare().
+static inline struct demo_msg *demo_index_find(struct demo_queue *q,
+                                               const struct demo_match *f,
+                                               u64 now, struct list_head *dead)
+{
+    struct demo_msg *m, *tmp;
+
+    if (f->flags & SAFE_LKM_MATCH_TYPE) {
+        list_for_each_entry_safe(m, tmp, demo_type_bucket(q, f->type), by_type) {
+            if (m->type != f->type)
+                continue;
+            if (demo_msg_expired(m, now)) {
+                if (dead)
+                    demo_expire_msg(q, m, dead);
+                continue;
+            }
+            if (demo_match_msg(f, m))
+                return m;
+        }
+    } else {
+        list_for_each_entry_safe(m, tmp, demo_pid_bucket(q, f->pid), by_pid) {
+            if (m->pid != f->pid)
+                continue;
+            if (demo_msg_expired(m, now)) {
+                if (dead)
+                    demo_expire_msg(q, m, dead);
+                continue;
+            }
+            if (demo_match_msg(f, m))
+                return m;
+        }
+    }
+    return NULL;
+}
+
+// Receive the oldest message that f accepts
+// Parameters:
+//   q   - the queue
+//   f   - the filter; at least one of SAFE_LKM_MATCH_PID/TYPE is set
+//   out - Set to the dequeued message, owned by the caller as with
+//         demo_queue_receive()
+// Returns: 0 on success, -ENOMSG if no queued message matches
+static inline int demo_queue_receive_match(struct demo_queue *q,
+                                           const struct demo_match *f,
+                                           struct demo_msg **out)
+{
+    struct demo_msg *m;
+    u64 now = ktime_get_ns();
+    LIST_HEAD(dead);
+
+    spin_lock(&q->lock);
+    demo_index_prepare(q);
+    m = demo_index_find(q, f, now, &dead);
+    if (m) {
+        demo_cursor_skip(q, m);
+        list_del(&m->list);
+        demo_index_del(q, m);
+        demo_account_del(q, m->level, 1, m->len);
+        demo_lat_record(q, m->level, now, m);
+        *out = m;
+    }
+    spin_unlock(&q->lock);
+    demo_free_expired(q, &dead);
+
+    if (!m)
+        return -ENOMSG;
+    trace_msg_dequeue(m->pid, m->type, m->len);
+    demo_wake_writers(q);
+    demo_lat_add(q, LAT_DEQUEUE, ktime_get_ns() - now);
+    return 0;
+}
+
+// Would demo_queue_receive_match() find a message on any shard right now?
+static inline bool demo_queue_has_match(struct demo_queue *q, const struct demo_match *f)
+{
+    struct demo_queue *s;
+    bool found = false;
+    int i;
+
+    demo_for_each_shard(q, s, i) {
+        spin_lock(&s->lock);
+        demo_index_prepare(s);
+        found = demo_index_find(s, f, ktime_get_ns(), NULL) != NULL;
+        spin_unlock(&s->lock);
+        if (found)
+            break;
+    }
+    return found;
+}
+
+// ---------------------------------------------------------------------------
+// IPC Functions - Reprioritize
+// ---------------------------------------------------------------------------
+//
+// Move every queued message from a sender and/or of a type to another
+// priority level, e.g. when the sender is escalated. The matching messages
+// are found through the selective receive indexes, so the cost is one
+// bucket walk, not a walk of the level lists. They keep their enq_ns, so
+// their residence time still counts from the original send, and are
+// merged into their new level by it, as if they had been sent there:
+// every level stays oldest first, which aging (demo_aged_level) and
+// SAFE_LKM_OVERFLOW_DROP_OLDEST (demo_drop_oldest) rely on. A bucket is
+// in admission order, so the merge only moves forward through the level;
+// moved messages newer than everything there go straight to the back.
+// Their type is left as sent: only the level they are served at changes.
+
+// Account for a message moving from one level to another
+// Its room moves with it, to the other class if the class changes, whatever
+// that class's capacity (as for requeued messages). So does its enqueue:
+// it counts as enqueued at the level it is dequeued from, so per level
+// (and per class) enqueued - dequeued stays equal to the depth.
+// Must be called with q->lock held.
+static inline void demo_account_move(struct demo_queue *q, u32 from, u32 to)
+{
+    enum demo_class old = demo_level_class(q, from), new = demo_level_class(q, to);
+
+    if (old != new) {
+        atomic_dec(&q->home->class_admitted[old]);
+        atomic_inc(&q->home->class_admitted[new]);
+    }
+    q->msgs.enqueued[from]--;
+    q->msgs.enqueued[to]++;
+    if (!--q->msgs.depth[from])
+        __clear_bit(from, q->msgs.nonempty);
+    q->msgs.depth[to]++;
+    __set_bit(to, q->msgs.nonempty);
+}
+
+// Move m to level, merging it in by enq_ns
+// pos is the entry the previous message of this move went after, or the
+// level's list head; the return value is the one for the next message.
+// Must be called with q->lock held.
+static inline struct list_head *demo_move_msg(struct demo_queue *q, struct demo_msg *m,
+                                              u32 level, struct list_head *pos)
+{
+    struct list_head *head = demo_level_list(q, level);
+    struct demo_msg *next;
+
+    demo_cursor_skip(q, m);
+    list_del(&m->list);
+    demo_account_move(q, m->level, level);
+    m->level = level;
+
+    if (list_empty(head) ||
+        list_last_entry(head, struct demo_msg, list)->enq_ns <= m->enq_ns) {
+        list_add_tail(&m->list, head);
+        return &m->list;
+    }
+    // Out of admission order (a requeued message): start over
+    if (pos != head && list_entry(pos, struct demo_msg, list)->enq_ns > m->enq_ns)
+        pos = head;
+    while (pos->next != head) {
+        next = list_entry(pos->next, struct demo_msg, list);
+        if (next->enq_ns > m->enq_ns)
+            break;
+        pos = pos->next;
+    }
+    list_add(&m->list, pos);
+    return &m->list;
+}
+
+// Move every message on one shard that f accepts, see demo_queue_reprio()
+static inline int __demo_queue_reprio(struct demo_queue *q, const struct demo_match *f,
+                                      u32 level)
+{
+    struct list_head *pos = demo_level_list(q, level);
+    struct demo_msg *m, *tmp;
+    u64 now = ktime_get_ns();
+    LIST_HEAD(dead);
+    int n = 0;
+
+    spin_lock(&q->lock);
+    demo_index_prepare(q);
+    if (f->flags & SAFE_LKM_MATCH_TYPE) {
+        list_for_each_entry_safe(m, tmp, demo_type_bucket(q, f->type), by_type) {
+            if (!demo_match_msg(f, m) || m->level == level)
+                continue;
+            if (demo_msg_expired(m, now)) {
+                demo_expire_msg(q, m, &dead);
+                continue;
+            }
+            pos = demo_move_msg(q, m, level, pos);
+            n++;
+        }
+    } else {
+        list_for_each_entry_safe(m, tmp, demo_pid_bucket(q, f->pid), by_pid) {
+            if (!demo_match_msg(f, m) || m->level == level)
+                continue;
+            if (demo_msg_expired(m, now)) {
+                demo_expire_msg(q, m, &dead);
+                continue;
+            }
+            pos = demo_move_msg(q, m, level, pos);
+            n++;
+        }
+    }
+    q->reprioritized += n;
+    spin_unlock(&q->lock);
+    demo_free_expired(q, &dead);
+
+    // A message may have moved out of a full class
+    if (n)
+        demo_wake_writers(q);
+    return n;
+}
+
+// Move every queued message that f accepts to the level of type prio
+// Parameters:
+//   q    - the queue
+//   f    - the filter; at least one of SAFE_LKM_MATCH_PID/TYPE is set
+//   prio - the new priority, on the same scale as a message type
+// Returns: number of messages moved; those already at that level, and
+//          expired ones (which are discarded), do not count
+static inline int demo_queue_reprio(struct demo_queue *q, const struct demo_match *f,
+                                    int prio)
+{
+    u32 level = demo_type_level(q, prio);
+    struct demo_queue *s;
+    int i, n = 0;
+
+    demo_for_each_shard(q, s, i)
+        n += __demo_queue_reprio(s, f, level);
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// IPC Functions - Browse
+// ---------------------------------------------------------------------------
+//
+// Every admitted message takes the next sequence number of its queue
+// (demo_stamp_msg; one counter for all the shards of a queue) and keeps it
+// until received, across requeues and reprioritization. A browse pass
+// (demo_cursor_start, then demo_queue_peek until it returns 0) copies out
+// a record per queued message without dequeuing anything: shard by shard,
+// level by level, each level front to back. The lock is dropped after
+// every PEEK_CHUNK messages looked at, whatever the depth, so a pass over
+// a million messages holds up senders and receivers no longer than a
+// batch receive does. A level ends at the first message sent after the
+// pass began, so a pass ends however fast senders are. Stages are drained
+// and the ring refilled as the pass reaches them, as a receive would.
+//
+// A pass is not a snapshot: a message received while it runs is reported
+// only if the cursor got there first, one requeued behind the cursor or
+// drained from a stage behind a newer message is missed, and one moved to
+// a level the cursor has yet to reach (demo_queue_reprio) is reported
+// twice. Sequence numbers tell the copies apart.
+
+#define PEEK_CHUNK 64
+
+static inline void demo_cursor_init(struct demo_cursor *c)
+{
+    INIT_LIST_HEAD(&c->node);
+    c->q = NULL;
+}
+
+// End c's pass, taking it off the shard it is walking
+static inline void demo_cursor_stop(struct demo_cursor *c)
+{
+    struct demo_queue *s;
+
+    if (!c->q)
+        return;
+    if (c->shard < c->q->nr_shards) {
+        s = c->q->shards ? c->q->shards[c->shard] : c->q;
+        spin_lock(&s->lock);
+        list_del_init(&c->node);
+        spin_unlock(&s->lock);
+    }
+    c->q = NULL;
+}
+
+// Begin a pass over q with c, reporting messages numbered min_seq and up
+// The caller keeps q alive until the pass is stopped.
+static inline void demo_cursor_start(struct demo_cursor *c, struct demo_queue *q,
+                                     u64 min_seq)
+{
+    demo_cursor_stop(c);
+    c->q = q;
+    c->shard = 0;
+    c->level = 0;
+    c->next = NULL;
+    c->min_seq = min_seq;
+    c->end_seq = atomic64_read(&q->home->seq);
+}
+
+static inline void demo_peek_rec(struct safe_lkm_peek_rec *rec,
+                                 const struct demo_msg *m, u64 now)
+{
+    rec->seq = m->seq;
+    rec->age_ns = now > m->enq_ns ? now - m->enq_ns : 0;
+    rec->pid = m->pid;
+    rec->type = m->type;
+    rec->len = m->len;
+    rec->level = m->level;
+    memset(rec->data, 0, sizeof(rec->data));
+    memcpy(rec->data, m->data, min_t(u32, m->len, SAFE_LKM_PEEK_DATA));
+}
+
+// Look at up to PEEK_CHUNK messages of shard s from where c stopped,
+// filling a record for each one the pass reports (at most max)
+// Must be called with s->lock held and c on s->cursors.
+// Returns: number of records filled
+static inline int demo_cursor_walk(struct demo_queue *s, struct demo_cursor *c,
+                                   struct safe_lkm_peek_rec *recs, int max)
+{
+    u64 now = ktime_get_ns();
+    int budget = PEEK_CHUNK, n = 0;
+    struct list_head *head;
+    struct demo_msg *m;
+    bool last;
+
+    demo_drain_stages(s);
+    while (n < max && budget > 0 && c->level < s->prio_levels) {
+        head = demo_level_list(s, c->level);
+        if (!c->next && list_empty(head) && c->level == demo_ring_level(s))
+            demo_ring_refill(s, budget);
+        if (!c->next && list_empty(head)) {
+            c->level++;
+            continue;
+        }
+
+        m = c->next ? c->next : list_first_entry(head, struct demo_msg, list);
+        budget--;
+        if (m->seq > c->end_seq) {
+            c->next = NULL;
+            c->level++;
+            continue;
+        }
+        if (m->seq >= c->min_seq && !demo_msg_expired(m, now))
+            demo_peek_rec(&recs[n++], m, now);
+
+        last = list_is_last(&m->list, head);
+        if (last && c->level == demo_ring_level(s)) {
+            demo_ring_refill(s, budget);
+            last = list_is_last(&m->list, head);
+        }
+        if (last) {
+            c->next = NULL;
+            c->level++;
+        } else {
+            c->next = list_entry(m->list.next, struct demo_msg, list);
+        }
+    }
+    return n;
+}
+
+// Copy out the next records of c's pass, taking each shard's lock once
+// per PEEK_CHUNK messages looked at; may sleep
+// Returns: number of records filled (at most max), 0 once the pass is over
+static inline int demo_queue_peek(struct demo_cursor *c, struct safe_lkm_peek_rec *recs,
+                                  int max)
+{
+    struct demo_queue *q = c->q, *s;
+    int n = 0;
+
+    if (!q)
+        return 0;
+    while (n < max && c->shard < q->nr_shards) {
+        s = q->shards ? q->shards[c->shard] : q;
+        spin_lock(&s->lock);
+        if (list_empty(&c->node))
+            list_add(&c->node, &s->cursors);
+        n += demo_cursor_walk(s, c, recs + n, max - n);
+        if (c->level >= s->prio_levels) {
+            list_del_init(&c->node);
+            c->shard++;
+            c->level = 0;
+            c->next = NULL;
+        }
+        spin_unlock(&s->lock);
+        // Passes skipping many messages (min_seq) may loop here a while
+        cond_resched();
+    }
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// IPC Functions - Batched Send/Receive
+// ---------------------------------------------------------------------------
+
+// Splice pre-built runs of messages onto the queue under one lock hold
+// The batch is empty (and re-initialized) on return.
+static inline void demo_enqueue_batch(struct demo_queue *q, struct demo_batch *b)
+{
+    u32 level;
+
+    // Batches stage too, to keep per-CPU FIFO order with single sends
+    if (!demo_stage(q, NULL, b)) {
+        spin_lock(&q->lock);
+        for_each_set_bit(level, b->used, SAFE_LKM_PRIO_MAX) {
+            demo_index_run(q, &b->lists[level]);
+            list_splice_tail_init(&b->lists[level], demo_level_list(q, level));
+            demo_account_add(q, level, b->n[level], b->bytes[level]);
+        }
+        spin_unlock(&q->lock);
+        demo_batch_init(b);
+    }
+
+    demo_wake_readers(q);
+}
+
+// Byte budget of a user buffer filled with packed records (DRAIN, EXPORT),
+// each a header of hdr bytes and the payload, padded to align
+struct demo_room {
+    u64 bytes;                // Left; set to 0 once a message did not fit
+    u32 hdr;                  // Record header size
+    u32 align;                // Record alignment, a power of two
+    bool export;              // EXPORT: moved out, not dequeued
+};
+
+static inline u64 demo_room_reclen(const struct demo_room *room, u32 len)
+{
+    return ((u64)room->hdr + len + room->align - 1) & ~((u64)room->align - 1);
+}
+
+// Cut up to max messages off the front of one level onto the tail of the
+// batch's run for that level; expired messages met on the way go to dead
+// With room, each message also costs its packed record size and the cut
+// stops at the first one that does not fit, setting room->bytes to 0.
+// Exported messages (room->export) are not dequeued: they record no
+// latency and count in q->exported instead of msgs.dequeued.
+// Must be called with q->lock held. Returns the number detached.
+static inline int demo_cut_msgs(struct demo_queue *q, u32 level,
+                                struct demo_batch *b, int max, struct demo_room *room,
+                                u64 now, struct list_head *dead)
+{
+    struct list_head *queue = demo_level_list(q, level);
+    bool expiry = READ_ONCE(q->has_ttl);
+    bool export = room && room->export;
+    struct list_head *pos, *next, *last = queue;
+    struct demo_msg *m;
+    LIST_HEAD(run);
+    u64 bytes = 0;
+    int n = 0;
+
+    if (max <= 0) return 0;
+
+    list_for_each_safe(pos, next, queue) {
+        m = list_entry(pos, struct demo_msg, list);
+        if (expiry && demo_msg_expired(m, now)) {
+            demo_expire_msg(q, m, dead);
+            continue;
+        }
+        if (room) {
+            if (demo_room_reclen(room, m->len) > room->bytes) {
+                room->bytes = 0;
+                break;
+            }
+            room->bytes -= demo_room_reclen(room, m->len);
+        }
+        bytes += m->len;
+        demo_cursor_skip(q, m);
+        demo_index_del(q, m);
+        if (!export)
+            demo_lat_record(q, level, now, m);
+        last = pos;
+        if (++n == max) break;
+    }
+    if (n == 0) return 0;
+
+    // last is the last entry to take; expired ones before it are gone
+    list_cut_position(&run, queue, last);
+    list_splice_tail(&run, demo_batch_list(b, level));
+
+    b->n[level] += n;
+    b->bytes[level] += bytes;
+    if (export) {
+        demo_account_out(q, level, n, bytes);
+        q->exported += n;
+    } else {
+        demo_account_del(q, level, n, bytes);
+    }
+    return n;
+}
+
+// Detach up to max messages in delivery order under one lock hold
+// Parameters:
+//   q    - the queue
+//   b    - a freshly initialized batch to detach onto
+//   max  - at most this many messages
+//   room - NULL, or a byte budget for the messages' packed records, see
+//          demo_cut_msgs(); room->bytes is 0 if a message did not fit
+// An export (room->export) takes the levels strictly in order and leaves
+// the WRR turn and aging alone, as it is not a delivery.
+// Returns: number of messages detached
+static inline int demo_detach_run(struct demo_queue *q, struct demo_batch *b,
+                                  int max, struct demo_room *room)
+{
+    u64 now = ktime_get_ns();
+    LIST_HEAD(dead);
+    enum demo_pick pick = PICK_TOP;
+    int n = 0, cut, take;
+    u32 level;
+
+    spin_lock(&q->lock);
+    demo_drain_stages(q);
+    demo_ring_refill(q, max - q->msgs.depth[demo_ring_level(q)]);
+    demo_trim_heads(q, now, &dead);
+    while (n < max) {
+        if (room && room->export) {
+            level = demo_top_level(q);
+            take = max - n;
+        } else {
+            level = demo_pick_level(q, max - n, now, &take, &pick);
+        }
+        if (level >= q->prio_levels)
+            break;
+        if (!take) {
+            // Out of turn (a shard under round-robin): one, if nothing yet
+            if (n)
+                break;
+            take = 1;
+        }
+        cut = demo_cut_msgs(q, level, b, take, room, now, &dead);
+        demo_charge_level(q, level, pick, take, cut);
+        n += cut;
+        if (room && !room->bytes)
+            break;
+    }
+    spin_unlock(&q->lock);
+    demo_free_expired(q, &dead);
+
+    if (n)
+        demo_wake_writers(q);
+    return n;
+}
+
+// Detach up to max messages in delivery order, see demo_detach_run()
+static inline int demo_detach_batch(struct demo_queue *q, struct demo_batch *b, int max)
+{
+    return demo_detach_run(q, b, max, NULL);
+}
+
+// Undo the dequeue accounting for messages that were never delivered
+// export says they were detached by an export (see demo_cut_msgs()).
+// Must be called with q->lock held.
+static inline void demo_account_requeue(struct demo_queue *q, u32 level, int n, u64 bytes,
+                                        bool export)
+{
+    // They take their room back whatever the capacity
+    atomic_add(n, &q->home->admitted);
+    atomic_add(n, &q->home->class_admitted[demo_level_class(q, level)]);
+    demo_account_add(q, level, n, bytes);
+    q->msgs.enqueued[level] -= n;
+    if (export)
+        q->exported -= n;
+    else
+        q->msgs.dequeued[level] -= n;
+}
+
+// Put one received but undelivered message back at the front of its list
+static inline void demo_requeue_msg(struct demo_queue *q, struct demo_msg *m)
+{
+
+    spin_lock(&q->lock);
+    list_add(&m->list, demo_level_list(q, m->level));
+    demo_index_add_front(q, m);
+    demo_account_requeue(q, m->level, 1, m->len, false);
+    spin_unlock(&q->lock);
+
+    demo_wake_readers(q);
+}
+
+// Put detached but undelivered messages back at the front of their lists
+// export says they were detached by an export (see demo_cut_msgs()).
+static inline void demo_requeue_front(struct demo_queue *q, struct demo_batch *b, bool export)
+{
+    u32 level;
+
+    spin_lock(&q->lock);
+    for_each_set_bit(level, b->used, SAFE_LKM_PRIO_MAX) {
+        demo_index_run_front(q, &b->lists[level]);
+        list_splice_init(&b->lists[level], demo_level_list(q, level));
+        demo_account_requeue(q, level, b->n[level], b->bytes[level], export);
+    }
+    spin_unlock(&q->lock);
+    demo_batch_init(b);
+
+    demo_wake_readers(q);
+}
+
+// Check that q may take a bulk import (SAFE_LKM_IOC_IMPORT)
+// Imported messages keep their send times, so they must not land behind
+// newer ones: every level has to stay oldest first (see demo_aged_level
+// and demo_drop_oldest). So q must be empty, or hold nothing sent since
+// the last import (home->import_seq is still the last sequence number
+// given out), which lets one export go back in over several calls. This
+// is a check, not a lock: a send racing with the import still lands among
+// its records, so the queue has to be quiet meanwhile.
+// The indexes are dropped, for the next selective receive to rebuild in
+// one merge (demo_index_build), so linking records costs no bucket walk.
+// Returns: 0, or -EBUSY if something else is queued
+static inline int demo_queue_import_begin(struct demo_queue *q)
+{
+    struct demo_queue *s;
+    int i;
+
+    if (demo_queue_depth(q) &&
+        atomic64_read(&q->home->seq) != READ_ONCE(q->home->import_seq))
+        return -EBUSY;
+    demo_for_each_shard(q, s, i) {
+        spin_lock(&s->lock);
+        s->indexed = false;
+        spin_unlock(&s->lock);
+    }
+    return 0;
+}
+
+// Add one shard's counters to snap
+// Latency percentiles are the worst shard's, see "NUMA Shards".
+static inline void __demo_snapshot(struct demo_queue *q, struct demo_snapshot *snap)
+{
+    u64 hist[LAT_BUCKETS];
+    enum demo_class class;
+    u32 level;
+    int b;
+
+    spin_lock(&q->lock);
+    demo_ring_snapshot(q, snap);
+    snap->count += q->msgs.count;
+    // The depth now may be a peak no link or unlink has seen yet
+    snap->peak += max(q->msgs.peak, demo_peak_depth(q));
+    snap->bytes += q->msgs.bytes;
+    snap->aged += q->aged;
+    snap->reprioritized += q->reprioritized;
+    snap->exported += q->exported;
+    for (level = 0; level < q->prio_levels; level++) {
+        class = demo_level_class(q, level);
+        snap->level_depth[level] += q->msgs.depth[level];
+        snap->depth[class] += q->msgs.depth[level];
+        snap->enqueued[class] += q->msgs.enqueued[level];
+        snap->dequeued[class] += q->msgs.dequeued[level];
+        snap->level_p99_us[level] = max(snap->level_p99_us[level],
+                                        demo_lat_p99_us(q->lat_hist[level]));
+    }
+    for (class = 0; class < NR_CLASSES; class++) {
+        memset(hist, 0, sizeof(hist));
+        for (level = 0; level < q->prio_levels; level++) {
+            if (demo_level_class(q, level) != class)
+                continue;
+            for (b = 0; b < LAT_BUCKETS; b++)
+                hist[b] += q->lat_hist[level][b];
+        }
+        snap->p99_us[class] = max(snap->p99_us[class], demo_lat_p99_us(hist));
+    }
+    spin_unlock(&q->lock);
+
+    snap->staged += demo_staged_count(q);
+    snap->ring_full += atomic64_read(&q->ring_full);
+    snap->full += atomic64_read(&q->full);
+    snap->dropped += atomic64_read(&q->dropped);
+    snap->blocked += atomic64_read(&q->blocked);
+    snap->expired += atomic64_read(&q->expired);
+}
+
+// Copy the counters out so formatting happens without the lock
+// Walks the prio_levels counters and latency histograms, not the lists,
+// of every shard in turn.
+static inline void demo_snapshot(struct demo_queue *q, struct demo_snapshot *snap)
+{
+    struct demo_queue *s;
+    int i;
+
+    memset(snap, 0, sizeof(*snap));
+    demo_for_each_shard(q, s, i)
+        __demo_snapshot(s, snap);
+    snap->seq = atomic64_read(&q->home->seq);
+}
+
+// ---------------------------------------------------------------------------
+// NUMA Shards
+// ---------------------------------------------------------------------------
+//
+// With numa_shards=1 on a machine with more than one online NUMA node, a
+// queue keeps its messages in one shard per node instead of in itself.
+// A shard is a demo_queue of its own (lock, lists, stages, ring, indexes
+// and counters) allocated on its node, and the queue in front of them
+// only keeps what clients see: the registry entry, the attributes and the
+// wait queues. So:
+//   - a sender links its message into its own node's shard
+//     (demo_local_shard), allocated on that node, and never touches
+//     another node's lock or lists
+//   - a receiver takes from its own node's shard unless another shard's
+//     highest non-empty level ranks above it (demo_pick_shard), so
+//     priority order holds across shards while same-node messages are
+//     preferred at equal priority; requeues go back to the shard the
+//     messages came from
+//   - a selective receive takes the oldest match across every shard
+//     (demo_match_shard), looking at each one under its lock
+// Priority is compared without the shard locks (each shard's non-empty
+// bitmap), so a receive racing with a send to another node may serve the
+// older, lower priority message first, as with per-CPU staging. FIFO
+// order between messages of one level holds within a shard, not across
+// shards. Fair dequeue and aging work across the shards, at a price:
+//   - with age_deadline_ms set, a receiver looks at every shard's level
+//     heads under its lock and goes to the one whose overdue message is
+//     oldest (demo_aged_shard)
+//   - with dequeue_policy=1 the round-robin turn is the queue's, kept
+//     under the front queue's lock over the levels non-empty in any
+//     shard, and a receiver goes to a shard holding the level whose turn
+//     it is (demo_wrr_shard)
+// Capacities are the queue's: room is reserved in the front queue's
+// admission counters, which every shard shares (one atomic per send, on a
+// line the nodes share), so the queue fills up at the capacity it reports
+// and DROP_OLDEST drops the oldest normal message of any shard. Reported
+// counters are summed over the shards; peak depth
+// is the sum of the shards' peaks and latency percentiles are the worst
+// shard's. Without numa_shards, or on a single node, a queue is its own
+// only shard and none of this costs anything.
+
+// The shard a sender on this CPU links into
+static inline struct demo_queue *demo_local_shard(struct demo_queue *q)
+{
+    if (!q->shards)
+        return q;
+    return q->node_shard[numa_node_id()];
+}
+
+// Move a shard's staged messages, whose levels are only known once
+// drained, onto its lists, so its non-empty bitmap is complete
+static inline void demo_shard_settle(struct demo_queue *s)
+{
+    if (!cpumask_empty(&s->staged_cpus)) {
+        spin_lock(&s->lock);
+        demo_drain_stages(s);
+        spin_unlock(&s->lock);
+    }
+}
+
+// Whether a shard holds messages at level, read without the shard lock
+static inline bool demo_shard_has(struct demo_queue *s, u32 level)
+{
+    if (test_bit(level, s->msgs.nonempty))
+        return true;
+    return level == demo_ring_level(s) && s->ring_size && safe_lkm_ring_count(&s->ring);
+}
+
+// Highest priority level a shard holds, prio_levels if it is empty
+// Read without the shard lock, after demo_shard_settle().
+static inline u32 demo_shard_top(struct demo_queue *s)
+{
+    u32 level;
+
+    demo_shard_settle(s);
+    level = find_first_bit(s->msgs.nonempty, s->prio_levels);
+    if (level == s->prio_levels && s->ring_size && safe_lkm_ring_count(&s->ring))
+        level = demo_ring_level(s);
+    return level;
+}
+
+// The shard whose oldest message past age_deadline_ms is the oldest of
+// all, NULL if no shard has one; each shard is looked at under its lock
+static inline struct demo_queue *demo_aged_shard(struct demo_queue *q)
+{
+    struct demo_queue *best = NULL, *s;
+    u64 now = ktime_get_ns(), oldest = U64_MAX;
+    struct demo_msg *head;
+    u32 level;
+    int i;
+
+    demo_for_each_shard(q, s, i) {
+        spin_lock(&s->lock);
+        demo_drain_stages(s);
+        level = demo_aged_level(s, now);
+        if (level < s->prio_levels) {
+            head = list_first_entry(demo_level_list(s, level), struct demo_msg, list);
+            if (head->enq_ns < oldest) {
+                best = s;
+                oldest = head->enq_ns;
+            }
+        }
+        spin_unlock(&s->lock);
+    }
+    return best;
+}
+
+// The shard holding the level whose round-robin turn it is, local if it
+// holds it; the turn moves on here and demo_wrr_take() uses it up
+static inline struct demo_queue *demo_wrr_shard(struct demo_queue *q,
+                                                struct demo_queue *local)
+{
+    DECLARE_BITMAP(nonempty, SAFE_LKM_PRIO_MAX);
+    struct demo_queue *s;
+    u32 level;
+    int i;
+
+    bitmap_zero(nonempty, SAFE_LKM_PRIO_MAX);
+    demo_for_each_shard(q, s, i) {
+        demo_shard_settle(s);
+        bitmap_or(nonempty, nonempty, s->msgs.nonempty, SAFE_LKM_PRIO_MAX);
+        if (demo_shard_has(s, demo_ring_level(s)))
+            __set_bit(demo_ring_level(s), nonempty);
+    }
+    if (bitmap_empty(nonempty, q->prio_levels))
+        return local;
+
+    spin_lock(&q->lock);
+    level = demo_wrr_turn(q, nonempty);
+    spin_unlock(&q->lock);
+
+    if (demo_shard_has(local, level))
+        return local;
+    demo_for_each_shard(q, s, i) {
+        if (demo_shard_has(s, level))
+            return s;
+    }
+    return local;
+}
+
+// The shard a receiver on this CPU should dequeue from: its own node's,
+// unless another shard has a higher priority level non-empty, or holds
+// the oldest overdue message (age_deadline_ms) or the level whose
+// round-robin turn it is (dequeue_policy=1)
+// Cost under strict priority: nothing beyond the local shard while it
+// holds top level messages, otherwise one read of every other shard's
+// non-empty bitmap. Aging takes every shard's lock, and round-robin the
+// front queue's.
+static inline struct demo_queue *demo_pick_shard(struct demo_queue *q)
+{
+    struct demo_queue *local, *best, *s;
+    u32 top, level;
+    int i;
+
+    if (!q->shards)
+        return q;
+    best = local = demo_local_shard(q);
+    if (READ_ONCE(age_deadline_ms)) {
+        s = demo_aged_shard(q);
+        if (s)
+            return s;
+    }
+    if (READ_ONCE(dequeue_policy) == POLICY_WRR)
+        return demo_wrr_shard(q, local);
+
+    top = demo_shard_top(local);
+    if (top == 0)
+        return local;
+    demo_for_each_shard(q, s, i) {
+        if (s == local)
+            continue;
+        level = demo_shard_top(s);
+        if (level < top) {
+            best = s;
+            top = level;
+        }
+    }
+    return best;
+}
+
+// The shard holding the oldest message that f accepts, or the local one
+// if none does; each shard is looked at under its lock
+static inline struct demo_queue *demo_match_shard(struct demo_queue *q,
+                                                  const struct demo_match *f)
+{
+    struct demo_queue *best, *s;
+    u64 now = ktime_get_ns(), oldest = U64_MAX;
+    struct demo_msg *m;
+    int i;
+
+    if (!q->shards)
+        return q;
+    best = demo_local_shard(q);
+    demo_for_each_shard(q, s, i) {
+        spin_lock(&s->lock);
+        demo_index_prepare(s);
+        m = demo_index_find(s, f, now, NULL);
+        if (m && m->enq_ns < oldest) {
+            best = s;
+            oldest = m->enq_ns;
+        }
+        spin_unlock(&s->lock);
+    }
+    return best;
+}
+
+// ---------------------------------------------------------------------------
+// Queue Lifetime
+// ---------------------------------------------------------------------------
+
+// Free every message in one shard, stages and ring included
+// The messages are unlinked under the lock and freed after it.
+// Returns: number of messages freed
+static inline int __demo_queue_flush(struct demo_queue *q)
+{
+    struct demo_msg *m, *tmp;
+    LIST_HEAD(dead);
+    int count = 0;
+    u32 level;
+
+    spin_lock(&q->lock);
+    demo_drain_stages(q);
+    demo_ring_refill(q, INT_MAX);
+    for_each_set_bit(level, q->msgs.nonempty, q->prio_levels) {
+        list_splice_tail_init(demo_level_list(q, level), &dead);
+        demo_account_del(q, level, q->msgs.depth[level], 0);
+    }
+    q->msgs.bytes = 0;
+    q->indexed = false;         // Rebuilt by the next selective receive
+    demo_cursor_rewind(q);
+    spin_unlock(&q->lock);
+
+    list_for_each_entry_safe(m, tmp, &dead, list) {
+        demo_free_msg(m);
+        count++;
+    }
+    demo_wake_writers(q);
+    return count;
+}
+
+// Free every message in a queue, every shard of it
+// Returns: number of messages freed
+static inline int demo_queue_flush(struct demo_queue *q)
+{
+    struct demo_queue *s;
+    int i, count = 0;
+
+    demo_for_each_shard(q, s, i)
+        count += __demo_queue_flush(s);
+    return count;
+}
+
+// Set up a zeroed queue, or one shard of the queue home, from attr
+// A shard uses home's admission counters (see "Capacity and
+// Backpressure") and latency histograms (they are per-CPU already).
+// Returns: 0, or -ENOMEM with the queue partly set up (demo_queue_exit)
+static inline int demo_queue_init(struct demo_queue *q, struct demo_queue *home,
+                                  const struct safe_lkm_queue_attr *attr, int node)
+{
+    u32 levels = attr->prio_levels;
+    int level, ret;
+
+    spin_lock_init(&q->lock);
+    for (level = 0; level < SAFE_LKM_PRIO_MAX; level++)
+        INIT_LIST_HEAD(&q->msgs.levels[level]);
+    init_waitqueue_head(&q->readq);
+    init_waitqueue_head(&q->writeq);
+    INIT_LIST_HEAD(&q->cursors);
+    kref_init(&q->ref);
+    strscpy(q->name, attr->name, sizeof(q->name));
+    q->prio_levels = levels;
+    // Types >= HIGH_PRIO_THRESHOLD report as high; the top level always does
+    q->high_levels = max_t(int, 1, (int)levels - HIGH_PRIO_THRESHOLD);
+    q->capacity = attr->capacity;
+    q->class_capacity[CLASS_HIGH] = attr->capacity_high;
+    q->class_capacity[CLASS_NORMAL] = attr->capacity_normal;
+    q->overflow = attr->overflow;
+    q->ring_size = attr->ring_size;
+    q->node = node;
+    q->nr_shards = 1;
+    q->home = home;
+
+    ret = demo_ring_init(q);
+    if (!ret)
+        ret = demo_stages_init(q);
+    if (!ret && home == q) {
+        q->lat = alloc_percpu(struct demo_lat_stats);
+        if (!q->lat)
+            ret = -ENOMEM;
+    } else if (!ret) {
+        q->lat = home->lat;
+    }
+    return ret;
+}
+
+// Give q one shard per online node, see "NUMA Shards"
+// Returns: 0, or -ENOMEM with the shards made so far in q->shards
+static inline int demo_shards_init(struct demo_queue *q,
+                                   const struct safe_lkm_queue_attr *attr)
+{
+    u32 nodes = num_online_nodes();
+    struct demo_queue *s;
+    int nid, ret;
+
+    q->shards = kcalloc(nodes + nr_node_ids, sizeof(*q->shards), GFP_KERNEL);
+    if (!q->shards)
+        return -ENOMEM;
+    q->node_shard = q->shards + nodes;
+    q->nr_shards = 0;
+
+    for_each_online_node(nid) {
+        if (q->nr_shards == nodes)
+            break;              // A node came online meanwhile
+        s = kvzalloc_node(sizeof(*s), GFP_KERNEL, nid);
+        if (!s)
+            return -ENOMEM;
+        q->shards[q->nr_shards++] = s;
+        ret = demo_queue_init(s, q, attr, nid);
+        if (ret)
+            return ret;
+        q->node_shard[nid] = s;
+    }
+    // Nodes that come online later send to the first shard
+    for (nid = 0; nid < nr_node_ids; nid++)
+        if (!q->node_shard[nid])
+            q->node_shard[nid] = q->shards[0];
+    return 0;
+}
+
+// Free what demo_queue_init() and demo_shards_init() set up; safe on a
+// partly set up queue
+static inline void demo_queue_exit(struct demo_queue *q)
+{
+    u32 i;
+
+    if (q->shards) {
+        for (i = 0; i < q->nr_shards; i++) {
+            demo_queue_exit(q->shards[i]);
+            kvfree(q->shards[i]);
+        }
+        kfree(q->shards);
+    }
+    if (q->home == q)
+        free_percpu(q->lat);
+    free_percpu(q->stages);
+    demo_ring_exit(q);
+}
+
+// Allocate and initialize a queue, not yet registered
+// attr gives the name, priority levels (2..SAFE_LKM_PRIO_MAX), capacities,
+// overflow policy and ring size; id is ignored. With numa_shards set and
+// more than one online node, the queue is sharded (see "NUMA Shards").
+// Returns: the queue with one reference, or an ERR_PTR
+static inline struct demo_queue *demo_queue_alloc(const struct safe_lkm_queue_attr *attr)
+{
+    struct demo_queue *q;
+    int ret;
+
+    if (attr->prio_levels < 2 || attr->prio_levels > SAFE_LKM_PRIO_MAX)
+        return ERR_PTR(-EINVAL);
+    if (attr->overflow > SAFE_LKM_OVERFLOW_REJECT_NORMAL)
+        return ERR_PTR(-EINVAL);
+    // Any user may ask (QUEUE_CREATE): bound the memory a ring pins
+    if (attr->ring_size > SAFE_LKM_RING_MAX)
+        return ERR_PTR(-EINVAL);
+
+    // Large enough (the latency histograms) to get whole pages to itself
+    q = kvzalloc(sizeof(*q), GFP_KERNEL);
+    if (!q)
+        return ERR_PTR(-ENOMEM);
+
+    ret = demo_queue_init(q, q, attr, NUMA_NO_NODE);
+    if (!ret && READ_ONCE(numa_shards) && num_online_nodes() > 1)
+        ret = demo_shards_init(q, attr);
+    if (ret) {
+        demo_queue_exit(q);
+        kvfree(q);
+        return ERR_PTR(ret);
+    }
+    return q;
+}
+
+// Free a queue and every message still in it
+static inline void demo_queue_free(struct demo_queue *q)
+{
+    demo_queue_flush(q);
+    demo_queue_exit(q);
+    kvfree(q);
+}
+
+#endif // SAFE_LKM_QUEUE_H
@@ -0,0 +1,153 @@
+// ============================================================================
+// Safe Kernel Module - Lock-Free MPSC Ring
+// Assignment 2 — OS Fall 2025 (Option B: IPC Mechanism)
+// ============================================================================
+//
+// Bounded multi-producer/single-consumer ring of pointers. Each slot carries
+// a sequence number that says whose turn it is, so producers only contend on
+// one compare-and-swap of the tail index and the consumer never writes a
+// shared index at all (D. Vyukov's bounded queue, restricted to a single
+// consumer).
+//
+// The same header builds in the kernel (safe_lkm.c, normal_ring_size=N) and
+// in user space (bench_ring.c), so the ring can be benchmarked and fuzzed
+// without loading the module.
+//
+// RULES:
+//   - size must be a power of two
+//   - any number of threads may call safe_lkm_ring_push() concurrently
+//   - only one thread at a time may call safe_lkm_ring_pop()
+//   - in the kernel, push with preemption disabled: a producer that is
+//     preempted between claiming and publishing its slot holds up the
+//     consumer until it runs again
+//
+// ============================================================================
+
+#ifndef SAFE_LKM_RING_H
+#define SAFE_LKM_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/cache.h>
+#include <linux/atomic.h>
+
+#define RING_ALIGNED                ____cacheline_aligned_in_smp
+#define ring_load_relaxed(p)        READ_ONCE(*(p))
+#define ring_load_acquire(p)        smp_load_acquire(p)
+#define ring_store_release(p, v)    smp_store_release(p, v)
+#define ring_cas(p, old, new)       try_cmpxchg(p, old, new)
+#else
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RING_ALIGNED                __attribute__((aligned(64)))
+#define ring_load_relaxed(p)        __atomic_load_n(p, __ATOMIC_RELAXED)
+#define ring_load_acquire(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ring_store_release(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ring_cas(p, old, new)       __atomic_compare_exchange_n(p, old, new, false, \
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#endif
+
+// One slot: sequence number and the item it carries, stored inline
+struct safe_lkm_ring_slot {
+    unsigned long seq;        // == pos: free for the producer claiming pos
+                              // == pos + 1: holds the item for pos
+    void *item;
+};
+
+// Producer and consumer indices live on separate cache lines so producers
+// hammering the tail never invalidate the consumer's head and vice versa
+struct safe_lkm_ring {
+    unsigned long tail RING_ALIGNED;   // Next position to claim (producers)
+    unsigned long head RING_ALIGNED;   // Next position to read (consumer)
+    struct safe_lkm_ring_slot *slots RING_ALIGNED;
+    unsigned long mask;                // size - 1
+};
+
+#define SAFE_LKM_RING_SLOTS_BYTES(size) ((size) * sizeof(struct safe_lkm_ring_slot))
+
+// Initialize a ring over caller-provided slot storage
+// Parameters:
+//   r     - ring to initialize
+//   slots - SAFE_LKM_RING_SLOTS_BYTES(size) bytes of storage
+//   size  - number of slots, a power of two
+static inline void safe_lkm_ring_init(struct safe_lkm_ring *r,
+                                      struct safe_lkm_ring_slot *slots,
+                                      unsigned long size)
+{
+    unsigned long i;
+
+    for (i = 0; i < size; i++) {
+        slots[i].seq = i;
+        slots[i].item = NULL;
+    }
+    r->slots = slots;
+    r->mask = size - 1;
+    r->head = 0;
+    r->tail = 0;
+}
+
+// Add an item at the tail
+// Returns: true on success, false if the ring is full
+static inline bool safe_lkm_ring_push(struct safe_lkm_ring *r, void *item)
+{
+    struct safe_lkm_ring_slot *slot;
+    unsigned long pos = ring_load_relaxed(&r->tail);
+    unsigned long seq;
+    long diff;
+
+    for (;;) {
+        slot = &r->slots[pos & r->mask];
+        seq = ring_load_acquire(&slot->seq);
+        diff = (long)(seq - pos);
+
+        if (diff == 0) {
+            // Slot is free for pos; try to claim it (pos is reloaded on failure)
+            if (ring_cas(&r->tail, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            // The consumer has not freed this slot since the last lap
+            return false;
+        } else {
+            // Another producer claimed pos first
+            pos = ring_load_relaxed(&r->tail);
+        }
+    }
+
+    slot->item = item;
+    ring_store_release(&slot->seq, pos + 1);
+    return true;
+}
+
+// Remove the item at the head (single consumer only)
+// Returns: the item, or NULL if the ring is empty or the oldest claimed
+// slot has not been published yet
+static inline void *safe_lkm_ring_pop(struct safe_lkm_ring *r)
+{
+    unsigned long pos = r->head;
+    struct safe_lkm_ring_slot *slot = &r->slots[pos & r->mask];
+    void *item;
+
+    if (ring_load_acquire(&slot->seq) != pos + 1)
+        return NULL;
+
+    item = slot->item;
+    // Hand the slot to the producer one lap ahead
+    ring_store_release(&slot->seq, pos + r->mask + 1);
+    ring_store_release(&r->head, pos + 1);
+    return item;
+}
+
+// Number of claimed positions not yet consumed (a snapshot, may be stale)
+static inline unsigned long safe_lkm_ring_count(const struct safe_lkm_ring *r)
+{
+    return ring_load_relaxed(&r->tail) - ring_load_acquire(&r->head);
+}
+
+// Total items ever claimed by producers
+static inline unsigned long safe_lkm_ring_pushed(const struct safe_lkm_ring *r)
+{
+    return ring_load_relaxed(&r->tail);
+}
+
+#endif // SAFE_LKM_RING_H
@@ -0,0 +1,489 @@
+// ============================================================================
+// Safe Kernel Module - User-Space Kernel API Shim
+// Assignment 2 — OS Fall 2025 (Option B: IPC Mechanism)
+// ============================================================================
+//
+// Just enough of the kernel API for safe_lkm_queue.h to build in user space
+// (bench_queue.c): lists, bitmaps, atomics, locks, wait queues, per-CPU
+// data and allocation, with kernel semantics on top of libc, pthreads and
+// GCC atomics. Only what the queue core uses is here.
+//
+// MAPPING:
+//   spinlock_t       a pthread mutex: a preempted user-space spinlock
+//                    holder would stall every waiter, while the kernel
+//                    never preempts one
+//   wait queues      mutex + condition variable; waits are never
+//                    interrupted by signals
+//   per-CPU data     SHIM_NR_CPUS copies; each thread is given a CPU index
+//                    round-robin on first use and keeps it, like a thread
+//                    pinned to its own CPU
+//   NUMA nodes       shim_nr_nodes fake nodes (1 unless the program sets
+//                    it), CPU c on node c % shim_nr_nodes; node-local
+//                    allocation is plain allocation
+//   tracepoints      empty functions
+//
+// ============================================================================
+
+#ifndef SAFE_LKM_SHIM_H
+#define SAFE_LKM_SHIM_H
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef long long s64;
+
+// ---------------------------------------------------------------------------
+// Compiler and Arithmetic Helpers
+// ---------------------------------------------------------------------------
+
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+#define __percpu
+
+#define READ_ONCE(x)        (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)    (*(volatile __typeof__(x) *)&(x) = (v))
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(a, b)           ((a) < (b) ? (a) : (b))
+#define max(a, b)           ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)      min((t)(a), (t)(b))
+#define max_t(t, a, b)      max((t)(a), (t)(b))
+#define clamp(v, lo, hi)    min(max(v, lo), hi)
+
+#define DIV_ROUND_UP(n, d)  (((n) + (d) - 1) / (d))
+#define U64_MAX             UINT64_MAX
+
+#define NSEC_PER_USEC       1000ULL
+#define NSEC_PER_MSEC       1000000ULL
+#define ERESTARTSYS         512
+
+static inline u64 div_u64(u64 n, u32 d) { return n / d; }
+static inline bool is_power_of_2(unsigned long n) { return n && !(n & (n - 1)); }
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void strscpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strnlen(src, size - 1);
+
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+// ---------------------------------------------------------------------------
+// Allocation and Error Pointers
+// ---------------------------------------------------------------------------
+
+#define GFP_KERNEL 0
+
+// Everything comes back zeroed and cache line aligned, which covers the
+// alignment kvzalloc()/kmalloc() give the structures that ask for it
+static inline void *shim_zalloc(size_t size)
+{
+    void *p = aligned_alloc(64, (size + 63) & ~(size_t)63);
+
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+#define kmalloc(size, gfp)              shim_zalloc(size)
+#define kvzalloc(size, gfp)             shim_zalloc(size)
+#define kvmalloc_array(n, size, gfp)    shim_zalloc((n) * (size))
+#define kcalloc(n, size, gfp)           shim_zalloc((n) * (size))
+#define kvzalloc_node(size, gfp, node)  shim_zalloc(size)
+#define kvmalloc_node(size, gfp, node)  shim_zalloc(size)
+#define array_size(n, size)             ((size_t)(n) * (size))
+#define kfree(p)                        free(p)
+#define kvfree(p)                       free(p)
+
+#define ERR_PTR(err)        ((void *)(long)(err))
+#define PTR_ERR(p)          ((long)(p))
+#define IS_ERR(p)           ((unsigned long)(p) >= (unsigned long)-4095)
+
+// ---------------------------------------------------------------------------
+// Atomics
+// ---------------------------------------------------------------------------
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long long counter; } atomic64_t;
+
+#define atomic_read(v)          __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_add(i, v)        ((void)__atomic_add_fetch(&(v)->counter, i, __ATOMIC_SEQ_CST))
+#define atomic_sub(i, v)        ((void)__atomic_sub_fetch(&(v)->counter, i, __ATOMIC_SEQ_CST))
+#define atomic_inc(v)           atomic_add(1, v)
+#define atomic_dec(v)           atomic_sub(1, v)
+#define atomic_inc_return(v)    __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic64_read(v)        __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic64_inc(v)         ((void)__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic64_add(i, v)      ((void)__atomic_add_fetch(&(v)->counter, i, __ATOMIC_RELAXED))
+#define atomic64_inc_return(v)  __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+
+struct kref { atomic_t refcount; };
+static inline void kref_init(struct kref *k) { k->refcount.counter = 1; }
+
+// ---------------------------------------------------------------------------
+// Doubly Linked Lists (same semantics as <linux/list.h>)
+// ---------------------------------------------------------------------------
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD(name) struct list_head name = { &(name), &(name) }
+
+static inline void INIT_LIST_HEAD(struct list_head *h)
+{
+    h->next = h;
+    h->prev = h;
+}
+
+static inline void __list_add(struct list_head *n, struct list_head *prev,
+                              struct list_head *next)
+{
+    next->prev = n;
+    n->next = next;
+    n->prev = prev;
+    prev->next = n;
+}
+
+static inline void list_add(struct list_head *n, struct list_head *h)
+{
+    __list_add(n, h, h->next);
+}
+
+static inline void list_add_tail(struct list_head *n, struct list_head *h)
+{
+    __list_add(n, h->prev, h);
+}
+
+static inline void list_del(struct list_head *e)
+{
+    e->next->prev = e->prev;
+    e->prev->next = e->next;
+    e->next = e->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *e)
+{
+    e->next->prev = e->prev;
+    e->prev->next = e->next;
+    INIT_LIST_HEAD(e);
+}
+
+static inline void list_move_tail(struct list_head *e, struct list_head *h)
+{
+    list_del(e);
+    list_add_tail(e, h);
+}
+
+static inline int list_empty(const struct list_head *h)
+{
+    return h->next == h;
+}
+
+static inline int list_is_last(const struct list_head *e, const struct list_head *h)
+{
+    return e->next == h;
+}
+
+static inline void __list_splice(const struct list_head *list,
+                                 struct list_head *prev, struct list_head *next)
+{
+    struct list_head *first = list->next, *last = list->prev;
+
+    first->prev = prev;
+    prev->next = first;
+    last->next = next;
+    next->prev = last;
+}
+
+static inline void list_splice_tail(const struct list_head *list, struct list_head *h)
+{
+    if (!list_empty(list))
+        __list_splice(list, h->prev, h);
+}
+
+static inline void list_splice_init(struct list_head *list, struct list_head *h)
+{
+    if (!list_empty(list)) {
+        __list_splice(list, h, h->next);
+        INIT_LIST_HEAD(list);
+    }
+}
+
+static inline void list_splice_tail_init(struct list_head *list, struct list_head *h)
+{
+    if (!list_empty(list)) {
+        __list_splice(list, h->prev, h);
+        INIT_LIST_HEAD(list);
+    }
+}
+
+// Move head's entries up to and including entry onto list (which is empty)
+static inline void list_cut_position(struct list_head *list, struct list_head *head,
+                                     struct list_head *entry)
+{
+    struct list_head *first = head->next;
+
+    if (list_empty(head) || entry == head)
+        return;
+    list->next = first;
+    first->prev = list;
+    list->prev = entry;
+    head->next = entry->next;
+    entry->next->prev = head;
+    entry->next = list;
+}
+
+#define list_entry(ptr, type, member)   container_of(ptr, type, member)
+#define list_first_entry(h, type, member) list_entry((h)->next, type, member)
+#define list_last_entry(h, type, member) list_entry((h)->prev, type, member)
+#define list_for_each(pos, h) \
+    for ((pos) = (h)->next; (pos) != (h); (pos) = (pos)->next)
+#define list_for_each_safe(pos, n, h) \
+    for ((pos) = (h)->next, (n) = (pos)->next; (pos) != (h); (pos) = (n), (n) = (pos)->next)
+#define list_for_each_entry(pos, h, member)                                        \
+    for ((pos) = list_entry((h)->next, __typeof__(*(pos)), member);                \
+         &(pos)->member != (h);                                                    \
+         (pos) = list_entry((pos)->member.next, __typeof__(*(pos)), member))
+#define list_for_each_entry_reverse(pos, h, member)                                \
+    for ((pos) = list_entry((h)->prev, __typeof__(*(pos)), member);                \
+         &(pos)->member != (h);                                                    \
+         (pos) = list_entry((pos)->member.prev, __typeof__(*(pos)), member))
+#define list_for_each_entry_safe(pos, n, h, member)                                \
+    for ((pos) = list_entry((h)->next, __typeof__(*(pos)), member),                \
+         (n) = list_entry((pos)->member.next, __typeof__(*(pos)), member);         \
+         &(pos)->member != (h);                                                    \
+         (pos) = (n), (n) = list_entry((n)->member.next, __typeof__(*(n)), member))
+
+// ---------------------------------------------------------------------------
+// Bitmaps
+// ---------------------------------------------------------------------------
+
+#define BITS_PER_LONG           (8 * sizeof(long))
+#define BITS_TO_LONGS(n)        (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DECLARE_BITMAP(name, n) unsigned long name[BITS_TO_LONGS(n)]
+
+static inline void __set_bit(unsigned long nr, unsigned long *map)
+{
+    map[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void __clear_bit(unsigned long nr, unsigned long *map)
+{
+    map[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+static inline bool test_bit(unsigned long nr, const unsigned long *map)
+{
+    return (map[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline bool __test_and_set_bit(unsigned long nr, unsigned long *map)
+{
+    bool old = test_bit(nr, map);
+
+    __set_bit(nr, map);
+    return old;
+}
+
+static inline unsigned long find_next_bit(const unsigned long *map, unsigned long size,
+                                          unsigned long start)
+{
+    unsigned long word;
+
+    while (start < size) {
+        word = map[start / BITS_PER_LONG] >> (start % BITS_PER_LONG);
+        if (word) {
+            start += __builtin_ctzl(word);
+            return min(start, size);
+        }
+        start = (start / BITS_PER_LONG + 1) * BITS_PER_LONG;
+    }
+    return size;
+}
+
+static inline void bitmap_or(unsigned long *dst, const unsigned long *a,
+                             const unsigned long *b, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < BITS_TO_LONGS(n); i++)
+        dst[i] = a[i] | b[i];
+}
+
+#define find_first_bit(map, size)   find_next_bit(map, size, 0)
+#define bitmap_zero(map, n)         memset(map, 0, BITS_TO_LONGS(n) * sizeof(long))
+#define bitmap_empty(map, n)        (find_first_bit(map, n) >= (n))
+#define for_each_set_bit(b, map, n) \
+    for ((b) = find_first_bit(map, n); (b) < (n); (b) = find_next_bit(map, n, (b) + 1))
+#define for_each_set_bit_from(b, map, n) \
+    for ((b) = find_next_bit(map, n, b); (b) < (n); (b) = find_next_bit(map, n, (b) + 1))
+
+// ---------------------------------------------------------------------------
+// Locks and Wait Queues
+// ---------------------------------------------------------------------------
+
+typedef pthread_mutex_t spinlock_t;
+
+#define spin_lock_init(l)               pthread_mutex_init(l, NULL)
+#define spin_lock(l)                    pthread_mutex_lock(l)
+#define spin_unlock(l)                  pthread_mutex_unlock(l)
+#define spin_lock_irqsave(l, flags)     do { (flags) = 0; pthread_mutex_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags) do { (void)(flags); pthread_mutex_unlock(l); } while (0)
+
+// The scheduler preempts user-space threads anyway
+#define cond_resched()                  do { } while (0)
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sleepers;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+    wq->sleepers = 0;
+}
+
+// The waker changes the condition, then looks for sleepers; a sleeper
+// registers, then checks the condition. The full barriers on both sides
+// make sure one of them sees the other.
+static inline bool wq_has_sleeper(wait_queue_head_t *wq)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&wq->sleepers, __ATOMIC_RELAXED) > 0;
+}
+
+static inline void wake_up_interruptible(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->lock);
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+#define wake_up_interruptible_all(wq)   wake_up_interruptible(wq)
+
+#define wait_event_interruptible(wq, condition) ({                          \
+    pthread_mutex_lock(&(wq).lock);                                         \
+    __atomic_add_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST);                \
+    while (!(condition))                                                    \
+        pthread_cond_wait(&(wq).cond, &(wq).lock);                          \
+    __atomic_sub_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST);                \
+    pthread_mutex_unlock(&(wq).lock);                                       \
+    0;                                                                      \
+})
+
+// ---------------------------------------------------------------------------
+// Per-CPU Data
+// ---------------------------------------------------------------------------
+
+#ifndef SHIM_NR_CPUS
+#define SHIM_NR_CPUS 64
+#endif
+
+struct cpumask {
+    unsigned long bits[BITS_TO_LONGS(SHIM_NR_CPUS)];
+};
+
+// CPU index of the calling thread, handed out round-robin on first use
+static inline int shim_this_cpu(void)
+{
+    static int next;
+    static __thread int cpu = -1;
+
+    if (cpu < 0)
+        cpu = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % SHIM_NR_CPUS;
+    return cpu;
+}
+
+#define get_cpu()                       shim_this_cpu()
+#define put_cpu()                       do { } while (0)
+#define preempt_disable()               do { } while (0)
+#define preempt_enable()                do { } while (0)
+#define for_each_possible_cpu(cpu)      for ((cpu) = 0; (cpu) < SHIM_NR_CPUS; (cpu)++)
+
+// Like the kernel, copies are a fixed unit apart, so per_cpu_ptr() and the
+// this_cpu ops work on a field of a per-CPU struct as well as on the struct.
+// calloc() leaves the untouched units of large allocations unbacked.
+#define SHIM_PCPU_UNIT                  (32 * 1024)
+
+#define alloc_percpu(type) ({                                               \
+    _Static_assert(sizeof(type) <= SHIM_PCPU_UNIT, "per-CPU type too large"); \
+    (type *)calloc(SHIM_NR_CPUS, SHIM_PCPU_UNIT);                           \
+})
+#define free_percpu(p)                  free(p)
+#define per_cpu_ptr(p, cpu) \
+    ((__typeof__(p))((char *)(p) + (size_t)(cpu) * SHIM_PCPU_UNIT))
+#define this_cpu_add(var, v) \
+    ((void)__atomic_add_fetch(per_cpu_ptr(&(var), shim_this_cpu()), v, __ATOMIC_RELAXED))
+#define this_cpu_inc(var)               this_cpu_add(var, 1)
+
+static inline bool cpumask_empty(const struct cpumask *m)
+{
+    return bitmap_empty(m->bits, SHIM_NR_CPUS);
+}
+
+static inline void cpumask_set_cpu(int cpu, struct cpumask *m)
+{
+    __atomic_fetch_or(&m->bits[cpu / BITS_PER_LONG], 1UL << (cpu % BITS_PER_LONG),
+                      __ATOMIC_SEQ_CST);
+}
+
+static inline bool cpumask_test_and_clear_cpu(int cpu, struct cpumask *m)
+{
+    unsigned long bit = 1UL << (cpu % BITS_PER_LONG);
+
+    return __atomic_fetch_and(&m->bits[cpu / BITS_PER_LONG], ~bit, __ATOMIC_SEQ_CST) & bit;
+}
+
+#define for_each_cpu(cpu, m) \
+    for_each_set_bit(cpu, (m)->bits, SHIM_NR_CPUS)
+
+// ---------------------------------------------------------------------------
+// NUMA Nodes
+// ---------------------------------------------------------------------------
+
+static int shim_nr_nodes = 1;
+
+#define NUMA_NO_NODE                    (-1)
+#define nr_node_ids                     shim_nr_nodes
+#define num_online_nodes()              shim_nr_nodes
+#define numa_node_id()                  (shim_this_cpu() % shim_nr_nodes)
+#define for_each_online_node(nid)       for ((nid) = 0; (nid) < shim_nr_nodes; (nid)++)
+
+// ---------------------------------------------------------------------------
+// Tracepoints and Tasks
+// ---------------------------------------------------------------------------
+
+static inline void trace_msg_enqueue(int pid, int type, u32 len) { }
+static inline void trace_msg_dequeue(int pid, int type, u32 len) { }
+static inline void trace_msg_drop(int pid, int type, u32 len) { }
+static inline void trace_msg_expire(int pid, int type, u32 len) { }
+static inline void trace_queue_empty(int reader) { }
+
+#define current                 NULL
+#define task_tgid_vnr(task)     0
+
+#endif // SAFE_LKM_SHIM_H
@@ -0,0 +1,267 @@
+// Queue Snapshot Tool for Safe Kernel Module
+// Assignment 2 - OS Fall 2025
+//
+// Saves a queue's backlog to a file and loads it back, so the module can
+// be reloaded (or upgraded) without losing queued messages:
+//
+//   $ ./safe_lkm_snap save backlog.snap          # queue now empty
+//   $ sudo rmmod safe_lkm && sudo insmod safe_lkm.ko
+//   $ ./safe_lkm_snap load backlog.snap          # queued as before
+//
+// save moves the messages out with SAFE_LKM_IOC_EXPORT, many per call;
+// load hands them back to SAFE_LKM_IOC_IMPORT a chunk at a time, which
+// needs a queue holding nothing else. Priority level, FIFO order, pid,
+// type, send time and deadline are kept (see "Export/Import" in
+// safe_lkm_uapi.h). Stop producers first and keep them stopped until load
+// is done: messages sent after save are not in the file, ones sent before
+// load make it fail, and ones sent during it land among the records.
+//
+// The file is a struct snap_hdr followed by export records exactly as
+// EXPORT packs them, until the end of the file.
+//
+// Usage: ./safe_lkm_snap save|load FILE [QUEUE]
+//   QUEUE names a queue made with SAFE_LKM_IOC_QUEUE_CREATE (default: the
+//   default queue); on load it must exist already.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "safe_lkm_user.h"
+
+#define SNAP_MAGIC "SLKMSNAP"
+#define SNAP_VERSION 1
+// Bytes moved per EXPORT: room for the largest record msg_max_size allows,
+// or EXPORT would fail with EMSGSIZE on it every time
+#define SNAP_BUF (2u * SAFE_LKM_MSG_LIMIT)
+
+_Static_assert(SNAP_BUF >= SAFE_LKM_EXPORT_RECLEN(SAFE_LKM_MSG_LIMIT),
+               "SNAP_BUF must hold the largest export record");
+
+struct snap_hdr {
+    char magic[8];                    // SNAP_MAGIC, not NUL-terminated
+    uint32_t version;                 // SNAP_VERSION
+    uint32_t align;                   // SAFE_LKM_EXPORT_ALIGN
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Open the device, on the named queue if there is one
+static int open_queue(const char *name, int flags) {
+    struct safe_lkm_queue_attr attr;
+    int fd = open(SAFE_LKM_DEV_PATH, flags);
+
+    if (fd < 0 || !name) return fd;
+
+    memset(&attr, 0, sizeof(attr));
+    strncpy(attr.name, name, sizeof(attr.name) - 1);
+    if (ioctl(fd, SAFE_LKM_IOC_QUEUE_LOOKUP, &attr) < 0 ||
+        ioctl(fd, SAFE_LKM_IOC_QUEUE_ATTACH, &attr.id) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Bytes at the start of buf[0..len) taken up by whole records
+static size_t whole_records(const char *buf, size_t len, size_t *count) {
+    const struct safe_lkm_export_rec *r;
+    size_t off = 0, rec;
+
+    *count = 0;
+    while (len - off >= sizeof(*r)) {
+        r = (const struct safe_lkm_export_rec *)(buf + off);
+        rec = SAFE_LKM_EXPORT_RECLEN((size_t)r->hdr.len);
+        if (rec > len - off) break;
+        off += rec;
+        (*count)++;
+    }
+    return off;
+}
+
+// IMPORT the whole records at the start of buf[0..len), in calls of at
+// most SNAP_BUF bytes; *count goes up by the messages queued
+// Returns: bytes queued, short of len if the queue refused a record
+// (errno says why)
+static size_t import_records(int fd, const char *buf, size_t len, unsigned long *count) {
+    size_t off = 0, whole, records;
+    uint32_t used;
+    int n;
+
+    while (off < len) {
+        whole = whole_records(buf + off, len - off < SNAP_BUF ? len - off : SNAP_BUF,
+                              &records);
+        if (!whole) break;
+        n = safe_lkm_import(fd, buf + off, whole, &used);
+        if (n < 0) break;
+        *count += n;
+        off += used;
+        if (used != whole) break;
+    }
+    return off;
+}
+
+static void import_error(void) {
+    perror(errno == EBUSY ? "SAFE_LKM_IOC_IMPORT: queue holds other messages"
+                          : "SAFE_LKM_IOC_IMPORT");
+}
+
+// The backlog is exported into memory before anything is written, so a
+// failed write can put all of it back (IMPORT needs an otherwise empty
+// queue).
+static int save(int fd, FILE *fp, const char *path) {
+    struct snap_hdr hdr = { .version = SNAP_VERSION, .align = SAFE_LKM_EXPORT_ALIGN };
+    size_t cap = SNAP_BUF, have = 0;
+    unsigned long total = 0, back = 0;
+    char *buf = malloc(cap);
+    uint32_t got;
+    int n = 0;
+
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    if (!buf) {
+        perror(path);
+        return -1;
+    }
+
+    for (;;) {
+        if (cap - have < SNAP_BUF) {
+            char *bigger = realloc(buf, cap * 2);
+            if (!bigger) {
+                // Leave the rest queued
+                fprintf(stderr, "%s: out of memory, saving the first %lu messages\n",
+                        path, total);
+                break;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+        n = safe_lkm_export(fd, buf + have, SNAP_BUF, 0, &got);
+        if (n <= 0) break;
+        total += n;
+        have += got;
+    }
+    if (n < 0) {
+        perror("SAFE_LKM_IOC_EXPORT");
+        if (!have) {
+            free(buf);
+            return -1;
+        }
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        (have && fwrite(buf, 1, have, fp) != have) || fflush(fp) != 0) {
+        // Not lost: everything exported goes back to the queue
+        perror(path);
+        if (import_records(fd, buf, have, &back) != have) {
+            import_error();
+            fprintf(stderr, "%lu messages could not be put back\n", total - back);
+        }
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    printf("Saved %lu messages (%lu bytes) to %s\n", total,
+           (unsigned long)(sizeof(hdr) + have), path);
+    return n < 0 ? -1 : 0;
+}
+
+// The file goes in SNAP_BUF bytes of whole records at a time; IMPORT lets
+// each call go on from the last while nothing else is sent to the queue
+static int load(int fd, FILE *fp, const char *path) {
+    struct snap_hdr hdr;
+    size_t have = 0, whole, records;
+    unsigned long total = 0;
+    char *buf = malloc(SNAP_BUF);
+    int eof = 0, ok = 0;
+
+    if (!buf || fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != SNAP_VERSION || hdr.align != SAFE_LKM_EXPORT_ALIGN) {
+        fprintf(stderr, "%s: not a safe_lkm snapshot\n", path);
+        free(buf);
+        return -1;
+    }
+
+    for (;;) {
+        if (!eof) {
+            have += fread(buf + have, 1, SNAP_BUF - have, fp);
+            eof = have < SNAP_BUF;
+            if (ferror(fp)) {
+                perror(path);
+                break;
+            }
+        }
+        if (!have) {
+            ok = eof;
+            break;
+        }
+        // SNAP_BUF holds any valid record, so none here means a bad file
+        whole = whole_records(buf, have, &records);
+        if (!whole) {
+            fprintf(stderr, "%s: truncated or corrupt record\n", path);
+            break;
+        }
+        if (import_records(fd, buf, whole, &total) != whole) {
+            import_error();
+            break;
+        }
+        memmove(buf, buf + whole, have - whole);
+        have -= whole;
+    }
+    free(buf);
+
+    if (!ok) {
+        fprintf(stderr, "Loaded %lu messages from %s, then stopped\n", total, path);
+        return -1;
+    }
+    printf("Loaded %lu messages from %s\n", total, path);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int saving = argc > 2 && strcmp(argv[1], "save") == 0;
+    int loading = argc > 2 && strcmp(argv[1], "load") == 0;
+    const char *path = argc > 2 ? argv[2] : NULL;
+    FILE *fp;
+    int fd, ret;
+
+    if ((!saving && !loading) || argc > 4) {
+        fprintf(stderr, "Usage: %s save|load FILE [QUEUE]\n", argv[0]);
+        return 2;
+    }
+
+    fd = open_queue(argc > 3 ? argv[3] : NULL, O_RDWR);
+    if (fd < 0) {
+        perror(argc > 3 ? argv[3] : SAFE_LKM_DEV_PATH);
+        return 1;
+    }
+    fp = fopen(path, saving ? "wb" : "rb");
+    if (!fp) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+
+    double start = now_ms();
+    ret = saving ? save(fd, fp, path) : load(fd, fp, path);
+    if (ret == 0)
+        printf("Took %.1f ms\n", now_ms() - start);
+
+    if (fclose(fp) != 0 && saving && ret == 0) {
+        perror(path);
+        ret = -1;
+    }
+    close(fd);
+    return ret ? 1 : 0;
+}
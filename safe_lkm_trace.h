@@ -0,0 +1,107 @@
+// ============================================================================
+// Safe Kernel Module - Tracepoints
+// Assignment 2 — OS Fall 2025 (Option B: IPC Mechanism)
+// ============================================================================
+//
+// Per-message events for ftrace/perf. A disabled tracepoint is a patched-out
+// branch, so the send/receive paths pay nothing unless someone is tracing.
+//
+// ENABLE:
+//   $ echo 1 > /sys/kernel/tracing/events/safe_lkm/enable
+//   $ cat /sys/kernel/tracing/trace_pipe
+//   or: perf record -e 'safe_lkm:*' -a
+//
+// ============================================================================
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM safe_lkm
+
+#if !defined(_SAFE_LKM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SAFE_LKM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Shared layout for messages entering and leaving the queue
+DECLARE_EVENT_CLASS(safe_lkm_msg_class,
+    TP_PROTO(int pid, int type, u32 len),
+    TP_ARGS(pid, type, len),
+
+    TP_STRUCT__entry(
+        __field(int, pid)
+        __field(int, type)
+        __field(u32, len)
+    ),
+
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->type = type;
+        __entry->len = len;
+    ),
+
+    TP_printk("pid=%d type=%d len=%u", __entry->pid, __entry->type, __entry->len)
+);
+
+DEFINE_EVENT(safe_lkm_msg_class, msg_enqueue,
+    TP_PROTO(int pid, int type, u32 len),
+    TP_ARGS(pid, type, len)
+);
+
+DEFINE_EVENT(safe_lkm_msg_class, msg_dequeue,
+    TP_PROTO(int pid, int type, u32 len),
+    TP_ARGS(pid, type, len)
+);
+
+// A queued message was discarded to make room (SAFE_LKM_OVERFLOW_DROP_OLDEST)
+DEFINE_EVENT(safe_lkm_msg_class, msg_drop,
+    TP_PROTO(int pid, int type, u32 len),
+    TP_ARGS(pid, type, len)
+);
+
+// A queued message passed its deadline and was discarded undelivered
+DEFINE_EVENT(safe_lkm_msg_class, msg_expire,
+    TP_PROTO(int pid, int type, u32 len),
+    TP_ARGS(pid, type, len)
+);
+
+// A receive found nothing to deliver
+TRACE_EVENT(queue_empty,
+    TP_PROTO(int reader),
+    TP_ARGS(reader),
+
+    TP_STRUCT__entry(
+        __field(int, reader)
+    ),
+
+    TP_fast_assign(
+        __entry->reader = reader;
+    ),
+
+    TP_printk("reader=%d", __entry->reader)
+);
+
+// A send could not allocate its node or payload buffer
+TRACE_EVENT(alloc_fail,
+    TP_PROTO(int pid, u32 len),
+    TP_ARGS(pid, len),
+
+    TP_STRUCT__entry(
+        __field(int, pid)
+        __field(u32, len)
+    ),
+
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->len = len;
+    ),
+
+    TP_printk("pid=%d len=%u", __entry->pid, __entry->len)
+);
+
+#endif // _SAFE_LKM_TRACE_H
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE safe_lkm_trace
+#include <trace/define_trace.h>
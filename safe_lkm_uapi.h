@@ -0,0 +1,426 @@
+// ============================================================================
+// Safe Kernel Module - User/Kernel Binary Interface
+// Assignment 2 — OS Fall 2025 (Option B: IPC Mechanism)
+// ============================================================================
+//
+// Shared between safe_lkm.c and user-space programs that talk to the
+// /dev/safe_lkm character device. Everything here is fixed-size and
+// native-endian so no text formatting or parsing is needed per message.
+//
+// ============================================================================
+
+#ifndef SAFE_LKM_UAPI_H
+#define SAFE_LKM_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define SAFE_LKM_DEV_NAME "safe_lkm"
+#define SAFE_LKM_DEV_PATH "/dev/" SAFE_LKM_DEV_NAME
+
+// Machine-readable counters, one "key=value" per line
+#define SAFE_LKM_STATS_PATH "/proc/safe_lkm_stats"
+
+// Payload size limits (bytes). The module accepts payloads up to its
+// msg_max_size parameter, which defaults to SAFE_LKM_MSG_DEFAULT_MAX and
+// can be raised at load time up to SAFE_LKM_MSG_LIMIT. The active value is
+// readable from /sys/module/safe_lkm/parameters/msg_max_size.
+#define SAFE_LKM_MSG_DEFAULT_MAX (64 * 1024)
+#define SAFE_LKM_MSG_LIMIT       (16 * 1024 * 1024)
+
+// Priority levels. By default the module has two: type >= 5 is received
+// before type < 5. Loaded with prio_levels=N (2 < N <= SAFE_LKM_PRIO_MAX),
+// every type 0..N-1 is its own level, a higher type is received first and
+// types outside the range are clamped. FIFO order holds within a level.
+#define SAFE_LKM_PRIO_MAX 64
+
+// ---------------------------------------------------------------------------
+// Message Header
+// ---------------------------------------------------------------------------
+//
+// write(): one safe_lkm_hdr immediately followed by hdr.len payload bytes.
+//          The write must contain exactly one message.
+// read():  returns one safe_lkm_hdr followed by the payload of the next
+//          dequeued message. If the buffer is shorter than the message the
+//          payload is truncated (like a datagram socket); hdr.len always
+//          reports the full payload length.
+//          An empty queue blocks the reader until a message arrives or the
+//          receive timeout expires (-EAGAIN). With O_NONBLOCK it returns
+//          -EAGAIN immediately.
+// poll():  EPOLLIN when a message is ready to be received. EPOLLOUT only
+//          when a send at any priority would find room under the queue's
+//          capacity limits without dropping anything (always, with no
+//          limits set), and once the queue is destroyed.
+
+struct safe_lkm_hdr {
+    __s32 pid;                // Sender process ID
+    __s32 type;               // Message priority/type (>= 5 is high priority)
+    __u32 len;                // Payload length in bytes
+};
+
+// ---------------------------------------------------------------------------
+// Batched Send/Receive (ioctl)
+// ---------------------------------------------------------------------------
+//
+// Both ioctls take a struct safe_lkm_batch pointing at an array of message
+// descriptors and move up to SAFE_LKM_BATCH_MAX of them per call, taking the
+// queue lock once per batch.
+//
+// Return value: number of descriptors processed. A short count means the
+// batch stopped early (bad descriptor, allocation failure, queue drained);
+// an error is only returned when nothing was processed. RECV_BATCH blocks
+// like read() until at least one message is available.
+
+#define SAFE_LKM_BATCH_MAX 4096
+
+struct safe_lkm_desc {
+    __s32 pid;                // Sender process ID (filled in on receive)
+    __s32 type;               // Message priority/type (filled in on receive)
+    __u32 len;                // Send: payload length
+                              // Receive: in = buffer size, out = payload length
+    __u32 flags;              // 0 or SAFE_LKM_DESC_SHM
+    __u64 buf;                // User pointer to the payload buffer, or
+                              // with SAFE_LKM_DESC_SHM a slot offset
+};
+
+struct safe_lkm_batch {
+    __u64 descs;              // User pointer to struct safe_lkm_desc[count]
+    __u32 count;              // Number of descriptors
+    __u32 pad;                // Reserved, must be 0
+};
+
+#define SAFE_LKM_IOC_MAGIC      'q'
+#define SAFE_LKM_IOC_SEND_BATCH _IOW(SAFE_LKM_IOC_MAGIC, 1, struct safe_lkm_batch)
+#define SAFE_LKM_IOC_RECV_BATCH _IOW(SAFE_LKM_IOC_MAGIC, 2, struct safe_lkm_batch)
+
+// ---------------------------------------------------------------------------
+// Receive Timeout (ioctl)
+// ---------------------------------------------------------------------------
+//
+// Per open file: how long read() and RECV_BATCH wait for a message, in
+// milliseconds. SAFE_LKM_RCVTIMEO_FOREVER (the default) waits until a
+// message or a signal arrives; 0 never waits, like O_NONBLOCK.
+
+#define SAFE_LKM_RCVTIMEO_FOREVER (-1)
+
+#define SAFE_LKM_IOC_SET_RCVTIMEO _IOW(SAFE_LKM_IOC_MAGIC, 3, __s32)
+
+// ---------------------------------------------------------------------------
+// Shared-Memory Payload Slots (mmap + ioctl)
+// ---------------------------------------------------------------------------
+//
+// Only available when the module is loaded with shm_slots=N; otherwise the
+// ioctls and mmap() fail with ENODEV. The device maps a region of
+// SHM_INFO.slots fixed-size slots at offset 0 (see safe_lkm_user.h).
+//
+//   SHM_ALLOC   reserve up to count free slots, their offsets are written
+//               to offsets[]; returns the number reserved (ENOBUFS if none)
+//   SHM_FREE    return count slots owned by the caller; returns the number
+//               returned, stopping at the first slot the caller does not own
+//
+// Send: fill a reserved slot and pass SAFE_LKM_DESC_SHM with buf = offset;
+// the slot belongs to the queue until the message is received. If the
+// descriptor is not sent (short SEND_BATCH count) the slot stays reserved.
+// Receive: a descriptor flagged SAFE_LKM_DESC_SHM accepts a slot-resident
+// payload in place (buf = offset, flag kept) and the caller must SHM_FREE
+// it; other payloads are copied to buf and the flag is cleared.
+//
+// Every client maps the same region: slots give no isolation between
+// processes that can open the device.
+
+#define SAFE_LKM_DESC_SHM       0x1
+
+struct safe_lkm_shm_info {
+    __u64 size;               // Bytes to mmap()
+    __u32 slot_size;          // Bytes per slot
+    __u32 slots;              // Number of slots
+};
+
+struct safe_lkm_shm_req {
+    __u64 offsets;            // User pointer to __u64[count]
+    __u32 count;              // At most SAFE_LKM_BATCH_MAX
+    __u32 pad;                // Reserved, must be 0
+};
+
+#define SAFE_LKM_IOC_SHM_INFO   _IOR(SAFE_LKM_IOC_MAGIC, 4, struct safe_lkm_shm_info)
+#define SAFE_LKM_IOC_SHM_ALLOC  _IOWR(SAFE_LKM_IOC_MAGIC, 5, struct safe_lkm_shm_req)
+#define SAFE_LKM_IOC_SHM_FREE   _IOW(SAFE_LKM_IOC_MAGIC, 6, struct safe_lkm_shm_req)
+
+// ---------------------------------------------------------------------------
+// Named Queues (ioctl)
+// ---------------------------------------------------------------------------
+//
+// Besides the default queue (id 0, the one /proc/safe_lkm uses), queues can
+// be created and destroyed at runtime, each with its own lock, counters,
+// priority levels and capacity. A new descriptor starts on the default
+// queue; QUEUE_ATTACH moves it to another queue once, and from then on
+// read(), write(), poll() and the batch ioctls on it use that queue.
+//
+//   QUEUE_CREATE   create a queue from attr (the name must be unique);
+//                  returns the new id, also stored in attr.id
+//   QUEUE_LOOKUP   find a queue by attr.name and fill in the rest of attr
+//   QUEUE_DESTROY  destroy a queue by id: its messages are freed, sends
+//                  fail with ENODEV and blocked receivers wake with ENODEV
+//   QUEUE_ATTACH   attach this descriptor to a queue by id (EBUSY if it is
+//                  already attached)
+//
+// What a send beyond a queue's capacity gets is set by its overflow policy,
+// see below. /proc/safe_lkm_queues lists every queue. The number of queues
+// is limited by the max_queues module parameter, and each queue's ring by
+// SAFE_LKM_RING_MAX (EINVAL above it); any client that can open the device
+// may create or destroy them.
+
+#define SAFE_LKM_QUEUE_NAME_MAX 32
+#define SAFE_LKM_QUEUE_DEFAULT  0
+#define SAFE_LKM_RING_MAX       (1u << 16)   // Most ring_size slots
+
+struct safe_lkm_queue_attr {
+    char name[SAFE_LKM_QUEUE_NAME_MAX];  // NUL-terminated
+    __u32 id;                 // Out: queue id
+    __u32 prio_levels;        // 0 = the prio_levels module parameter
+    __u32 capacity;           // Most messages queued at once, 0 = unlimited
+    __u32 ring_size;          // Lock-free ring slots for the lowest level
+                              // (power of two, at most SAFE_LKM_RING_MAX),
+                              // 0 = none
+    __u32 capacity_high;      // Most high priority messages, 0 = unlimited
+    __u32 capacity_normal;    // Most normal priority messages, 0 = unlimited
+    __u32 overflow;           // SAFE_LKM_OVERFLOW_*
+    __u32 pad;                // Reserved, must be 0
+};
+
+#define SAFE_LKM_IOC_QUEUE_CREATE  _IOWR(SAFE_LKM_IOC_MAGIC, 7, struct safe_lkm_queue_attr)
+#define SAFE_LKM_IOC_QUEUE_LOOKUP  _IOWR(SAFE_LKM_IOC_MAGIC, 8, struct safe_lkm_queue_attr)
+#define SAFE_LKM_IOC_QUEUE_DESTROY _IOW(SAFE_LKM_IOC_MAGIC, 9, __u32)
+#define SAFE_LKM_IOC_QUEUE_ATTACH  _IOW(SAFE_LKM_IOC_MAGIC, 10, __u32)
+
+// ---------------------------------------------------------------------------
+// Capacity and Overflow Policy
+// ---------------------------------------------------------------------------
+//
+// A queue can bound the number of messages it holds in total (capacity) and
+// per priority class (capacity_high, capacity_normal; high is type >= 5).
+// Room is reserved when a send is admitted and given back when the message
+// is received, so the bounds are exact and the memory a stalled consumer
+// can pin is known in advance. The overflow policy decides what a send
+// that finds no room gets:
+//
+//   FAIL           EAGAIN (the default)
+//   BLOCK          sleep until a receive makes room; EAGAIN with
+//                  O_NONBLOCK, EINTR/restart on a signal. poll() reports
+//                  EPOLLOUT once there is room at every priority.
+//   DROP_OLDEST    discard the oldest queued normal priority message and
+//                  take its place; EAGAIN if there is none to discard or
+//                  the message's own class is at its capacity
+//   REJECT_NORMAL  capacity only applies to normal priority sends; high
+//                  priority ones are admitted up to capacity_high
+//
+// Sends from /proc/safe_lkm never block: under BLOCK they fail like FAIL.
+
+#define SAFE_LKM_OVERFLOW_FAIL          0
+#define SAFE_LKM_OVERFLOW_BLOCK         1
+#define SAFE_LKM_OVERFLOW_DROP_OLDEST   2
+#define SAFE_LKM_OVERFLOW_REJECT_NORMAL 3
+
+// ---------------------------------------------------------------------------
+// Message Time-To-Live (ioctl)
+// ---------------------------------------------------------------------------
+//
+// Per open file: messages sent with write() or SEND_BATCH after this call
+// expire the given number of milliseconds after they were sent; 0 (the
+// default) sends messages that never expire. An expired message is never
+// delivered: receives skip it and a background sweeper (expire_sweep_ms)
+// frees it, along with the room it held. The expired counter in
+// /proc/safe_lkm_stats and /proc/safe_lkm_queues counts them.
+
+#define SAFE_LKM_IOC_SET_TTL _IOW(SAFE_LKM_IOC_MAGIC, 11, __s32)
+
+// ---------------------------------------------------------------------------
+// Selective Receive (ioctl)
+// ---------------------------------------------------------------------------
+//
+// Receive the oldest queued message sent by a given pid and/or of a given
+// type, whatever its priority (like msgrcv() with a positive msgtyp). At
+// least one of SAFE_LKM_MATCH_PID/TYPE must be set; with both, a message
+// must match both. desc is a receive descriptor as for RECV_BATCH and is
+// filled in the same way. Blocks like read() until a matching message is
+// queued, honouring O_NONBLOCK and SET_RCVTIMEO (EAGAIN when nothing
+// matches). Returns 0 on success.
+//
+// The first selective receive on a queue builds a pid and a type index over
+// its messages, which every later send and receive keeps up to date.
+
+#define SAFE_LKM_MATCH_PID      0x1
+#define SAFE_LKM_MATCH_TYPE     0x2
+
+struct safe_lkm_match {
+    struct safe_lkm_desc desc; // Receive descriptor
+    __u32 match;              // SAFE_LKM_MATCH_* flags
+    __s32 pid;                // Sender to match with SAFE_LKM_MATCH_PID
+    __s32 type;               // Type to match with SAFE_LKM_MATCH_TYPE
+    __u32 pad;                // Reserved, must be 0
+};
+
+#define SAFE_LKM_IOC_RECV_MATCH _IOWR(SAFE_LKM_IOC_MAGIC, 12, struct safe_lkm_match)
+
+// ---------------------------------------------------------------------------
+// Packed Drain (ioctl)
+// ---------------------------------------------------------------------------
+//
+// Receive as many messages as fit in one user buffer, in delivery order,
+// for consumers catching up on a backlog. The buffer is filled with
+// records, each a struct safe_lkm_hdr followed by the payload, padded to
+// SAFE_LKM_DRAIN_ALIGN; the next record starts SAFE_LKM_DRAIN_RECLEN(len)
+// bytes after the current one. Messages are never truncated: the drain
+// stops before the first one that does not fit, and fails with EMSGSIZE
+// if that is the very first.
+//
+// max bounds the number of messages (0 = as many as fit). On return count
+// and bytes say how many messages and bytes of buf were filled. The queue
+// lock is taken once per SAFE_LKM_BATCH_MAX messages, and records are
+// staged in the kernel so a drain copies to user space in large chunks.
+// Blocks like read() until at least one message is available.
+//
+// Return value: number of messages drained (also in count). An error is
+// only returned when nothing was drained.
+
+#define SAFE_LKM_DRAIN_ALIGN    4
+#define SAFE_LKM_DRAIN_RECLEN(len) \
+    ((sizeof(struct safe_lkm_hdr) + (len) + SAFE_LKM_DRAIN_ALIGN - 1) & \
+     ~(SAFE_LKM_DRAIN_ALIGN - 1))
+
+struct safe_lkm_drain {
+    __u64 buf;                // User pointer to the record buffer
+    __u32 len;                // Buffer size in bytes
+    __u32 max;                // At most this many messages, 0 = no limit
+    __u32 count;              // Out: messages drained
+    __u32 bytes;              // Out: bytes of buf filled
+};
+
+#define SAFE_LKM_IOC_DRAIN _IOWR(SAFE_LKM_IOC_MAGIC, 13, struct safe_lkm_drain)
+
+// ---------------------------------------------------------------------------
+// Reprioritize (ioctl)
+// ---------------------------------------------------------------------------
+//
+// Move every message queued by a given pid and/or of a given type to the
+// priority level a message of type prio would get, e.g. to let an
+// escalated sender's backlog overtake other traffic. match and pid/type
+// select the messages as for RECV_MATCH. The moved messages keep their
+// type and send time, and take their place in the new level by send time,
+// as if they had been sent there. The cost is proportional to the
+// messages of that pid (or type), plus the messages of the new level sent
+// before the newest one moved, not to the queue depth. The A command of
+// /proc/safe_lkm does the same for a pid on the default queue when given
+// a message type ("A <pid> <prio> <type>").
+//
+// Return value: number of messages moved (already at that level: not
+// counted).
+
+struct safe_lkm_reprio {
+    __u32 match;              // SAFE_LKM_MATCH_* flags
+    __s32 pid;                // Sender to match with SAFE_LKM_MATCH_PID
+    __s32 type;               // Type to match with SAFE_LKM_MATCH_TYPE
+    __s32 prio;               // New priority, on the message type scale
+};
+
+#define SAFE_LKM_IOC_REPRIO _IOW(SAFE_LKM_IOC_MAGIC, 14, struct safe_lkm_reprio)
+
+// ---------------------------------------------------------------------------
+// Browse Cursor (ioctl)
+// ---------------------------------------------------------------------------
+//
+// Look at queued messages without receiving them. Every message gets a
+// sequence number when it is sent, increasing with each send to its queue
+// (1 for the first), which the records below report.
+//
+// Each descriptor has one browse cursor. PEEK with SAFE_LKM_PEEK_START
+// begins a pass over the queue at its front; every PEEK, the first one
+// included, then fills up to count records at recs and moves the cursor
+// past them. A pass visits messages in delivery order, one priority level
+// after another, and reports those with a sequence number of at least seq
+// (0 = all of them) that were queued before the pass began. A monitor that
+// starts each pass at the highest sequence number it has seen plus one
+// therefore only sees what is new. Messages received, moved by REPRIO or
+// put back while a pass runs may be missed or reported twice; seq tells
+// them apart. Records carry the first SAFE_LKM_PEEK_DATA payload bytes.
+//
+// The queue lock is never held for more than a few dozen messages, so a
+// pass over a large backlog does not hold up senders or receivers.
+// /proc/safe_lkm_messages lists the default queue the same way.
+//
+// Return value: number of records filled, 0 once the pass is over (or
+// before the first START).
+
+#define SAFE_LKM_PEEK_START     0x1
+#define SAFE_LKM_PEEK_DATA      32
+
+struct safe_lkm_peek_rec {
+    __u64 seq;                // Sequence number
+    __u64 age_ns;             // Time queued so far
+    __s32 pid;                // Sender process ID
+    __s32 type;               // Message priority/type
+    __u32 len;                // Payload length in bytes
+    __u32 level;              // Priority level it is queued at, 0 = first
+    __u8 data[SAFE_LKM_PEEK_DATA]; // The first bytes of the payload
+};
+
+struct safe_lkm_peek {
+    __u64 seq;                // With START: lowest sequence number to report
+    __u64 recs;               // User pointer to struct safe_lkm_peek_rec[count]
+    __u32 count;              // At most SAFE_LKM_BATCH_MAX
+    __u32 flags;              // 0 or SAFE_LKM_PEEK_START
+};
+
+#define SAFE_LKM_IOC_PEEK _IOW(SAFE_LKM_IOC_MAGIC, 15, struct safe_lkm_peek)
+
+// ---------------------------------------------------------------------------
+// Export/Import (ioctl)
+// ---------------------------------------------------------------------------
+//
+// Move a backlog out of the module and back in, e.g. across a reload
+// (safe_lkm_snap saves and loads it to a file). EXPORT works like DRAIN
+// but fills buf with export records, each a struct safe_lkm_export_rec
+// followed by the payload, padded to SAFE_LKM_EXPORT_ALIGN; the next
+// record starts SAFE_LKM_EXPORT_RECLEN(len) bytes after the current one.
+// The records keep the priority level, send time and deadline, and come
+// level by level, oldest first, so importing them into an empty queue
+// restores it as it was. Exported messages leave the queue but are not
+// dequeued: they count in the exported stat, not in dequeued or the
+// latency histograms, and the round-robin and aging state is unchanged.
+// EXPORT never blocks and returns 0 once the queue is empty.
+//
+// IMPORT queues the records in buf (len bytes, up to max records if max
+// is not 0) in order; count and bytes say how many records and bytes were
+// consumed. Records keep their send times, and queuing them behind newer
+// messages would break the oldest-first order aging and
+// SAFE_LKM_OVERFLOW_DROP_OLDEST rely on, so IMPORT fails with EBUSY unless
+// the queue is empty or holds only what earlier IMPORTs queued, with nothing
+// sent since; an export may go back in over several calls, in order, each
+// going on from buf + bytes of the last. That check does not hold off
+// senders: IMPORT is only safe on a quiesced queue, with producers
+// stopped until it is done. Admission works as for SEND_BATCH. A record
+// keeps its level if the queue has that many levels and is placed by its
+// type otherwise. Times are CLOCK_REALTIME, so time spent while the module
+// was unloaded counts towards age and deadlines. Messages get new sequence
+// numbers.
+//
+// Return value: number of records exported or imported (also in count).
+// An error is only returned when nothing was moved; IMPORT fails with
+// EINVAL on a malformed record.
+
+#define SAFE_LKM_EXPORT_ALIGN   8
+#define SAFE_LKM_EXPORT_RECLEN(len) \
+    ((sizeof(struct safe_lkm_export_rec) + (len) + SAFE_LKM_EXPORT_ALIGN - 1) & \
+     ~(SAFE_LKM_EXPORT_ALIGN - 1))
+
+struct safe_lkm_export_rec {
+    struct safe_lkm_hdr hdr;  // pid, type and payload length
+    __u32 level;              // Priority level it was queued at, 0 = first
+    __u64 time_ns;            // When it was sent (CLOCK_REALTIME)
+    __u64 expires_ns;         // When it expires (CLOCK_REALTIME), 0 = never
+};
+
+#define SAFE_LKM_IOC_EXPORT _IOWR(SAFE_LKM_IOC_MAGIC, 16, struct safe_lkm_drain)
+#define SAFE_LKM_IOC_IMPORT _IOWR(SAFE_LKM_IOC_MAGIC, 17, struct safe_lkm_drain)
+
+#endif // SAFE_LKM_UAPI_H
@@ -0,0 +1,157 @@
+// User-Space Helper Library for Safe Kernel Module
+// Assignment 2 - OS Fall 2025
+//
+// See safe_lkm_user.h for the interface.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "safe_lkm_user.h"
+
+int safe_lkm_shm_open(struct safe_lkm_shm *shm, int flags) {
+    struct safe_lkm_shm_info info;
+    int err;
+
+    memset(shm, 0, sizeof(*shm));
+    shm->fd = open(SAFE_LKM_DEV_PATH, flags);
+    if (shm->fd < 0) return -1;
+
+    if (ioctl(shm->fd, SAFE_LKM_IOC_SHM_INFO, &info) < 0) goto fail;
+
+    shm->base = mmap(NULL, info.size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (shm->base == MAP_FAILED) goto fail;
+
+    shm->size = info.size;
+    shm->slot_size = info.slot_size;
+    shm->slots = info.slots;
+    return 0;
+
+fail:
+    err = errno;
+    close(shm->fd);
+    shm->fd = -1;
+    shm->base = NULL;
+    errno = err;
+    return -1;
+}
+
+void safe_lkm_shm_close(struct safe_lkm_shm *shm) {
+    if (shm->base) munmap(shm->base, shm->size);
+    if (shm->fd >= 0) close(shm->fd);
+    shm->base = NULL;
+    shm->fd = -1;
+}
+
+static int shm_req(int fd, unsigned long cmd, const uint64_t *offs, uint32_t count) {
+    struct safe_lkm_shm_req req = {
+        .offsets = (__u64)(unsigned long)offs,
+        .count = count,
+    };
+    return ioctl(fd, cmd, &req);
+}
+
+int safe_lkm_shm_alloc(struct safe_lkm_shm *shm, uint64_t *offs, uint32_t count) {
+    return shm_req(shm->fd, SAFE_LKM_IOC_SHM_ALLOC, offs, count);
+}
+
+int safe_lkm_shm_free(struct safe_lkm_shm *shm, const uint64_t *offs, uint32_t count) {
+    return shm_req(shm->fd, SAFE_LKM_IOC_SHM_FREE, offs, count);
+}
+
+void safe_lkm_shm_desc(struct safe_lkm_desc *d, int pid, int type,
+                       uint64_t off, uint32_t len) {
+    d->pid = pid;
+    d->type = type;
+    d->len = len;
+    d->flags = SAFE_LKM_DESC_SHM;
+    d->buf = off;
+}
+
+static int batch_req(int fd, unsigned long cmd, struct safe_lkm_desc *descs, uint32_t count) {
+    struct safe_lkm_batch req = {
+        .descs = (__u64)(unsigned long)descs,
+        .count = count,
+    };
+    return ioctl(fd, cmd, &req);
+}
+
+int safe_lkm_send_batch(int fd, struct safe_lkm_desc *descs, uint32_t count) {
+    return batch_req(fd, SAFE_LKM_IOC_SEND_BATCH, descs, count);
+}
+
+int safe_lkm_recv_batch(int fd, struct safe_lkm_desc *descs, uint32_t count) {
+    return batch_req(fd, SAFE_LKM_IOC_RECV_BATCH, descs, count);
+}
+
+int safe_lkm_recv_match(int fd, struct safe_lkm_desc *d, uint32_t match,
+                        int pid, int type) {
+    struct safe_lkm_match req = {
+        .desc = *d,
+        .match = match,
+        .pid = pid,
+        .type = type,
+    };
+    if (ioctl(fd, SAFE_LKM_IOC_RECV_MATCH, &req) < 0) return -1;
+    *d = req.desc;
+    return 0;
+}
+
+int safe_lkm_drain(int fd, void *buf, uint32_t len, uint32_t max, uint32_t *bytes) {
+    struct safe_lkm_drain req = {
+        .buf = (__u64)(unsigned long)buf,
+        .len = len,
+        .max = max,
+    };
+    int ret = ioctl(fd, SAFE_LKM_IOC_DRAIN, &req);
+    if (ret < 0) return -1;
+    *bytes = req.bytes;
+    return ret;
+}
+
+int safe_lkm_reprio(int fd, uint32_t match, int pid, int type, int prio) {
+    struct safe_lkm_reprio req = {
+        .match = match,
+        .pid = pid,
+        .type = type,
+        .prio = prio,
+    };
+    return ioctl(fd, SAFE_LKM_IOC_REPRIO, &req);
+}
+
+int safe_lkm_peek(int fd, uint64_t seq, struct safe_lkm_peek_rec *recs, uint32_t count,
+                  uint32_t flags) {
+    struct safe_lkm_peek req = {
+        .seq = seq,
+        .recs = (__u64)(unsigned long)recs,
+        .count = count,
+        .flags = flags,
+    };
+    return ioctl(fd, SAFE_LKM_IOC_PEEK, &req);
+}
+
+int safe_lkm_export(int fd, void *buf, uint32_t len, uint32_t max, uint32_t *bytes) {
+    struct safe_lkm_drain req = {
+        .buf = (__u64)(unsigned long)buf,
+        .len = len,
+        .max = max,
+    };
+    int ret = ioctl(fd, SAFE_LKM_IOC_EXPORT, &req);
+    if (ret < 0) return -1;
+    *bytes = req.bytes;
+    return ret;
+}
+
+int safe_lkm_import(int fd, const void *buf, uint32_t len, uint32_t *bytes) {
+    struct safe_lkm_drain req = {
+        .buf = (__u64)(unsigned long)buf,
+        .len = len,
+    };
+    int ret = ioctl(fd, SAFE_LKM_IOC_IMPORT, &req);
+    if (ret < 0) return -1;
+    *bytes = req.bytes;
+    return ret;
+}
@@ -0,0 +1,117 @@
+// ============================================================================
+// Safe Kernel Module - User-Space Helper Library
+// Assignment 2 — OS Fall 2025 (Option B: IPC Mechanism)
+// ============================================================================
+//
+// Thin wrappers around /dev/safe_lkm for the batched and shared-memory
+// interfaces described in safe_lkm_uapi.h.
+//
+// Zero-copy send/receive with the shared-memory slots (shm_slots=N):
+//
+//   struct safe_lkm_shm shm;
+//   safe_lkm_shm_open(&shm, O_RDWR);
+//   safe_lkm_shm_alloc(&shm, &off, 1);            // reserve a slot
+//   memcpy(safe_lkm_shm_ptr(&shm, off), data, len);
+//   safe_lkm_shm_desc(&d, pid, type, off, len);
+//   safe_lkm_send_batch(shm.fd, &d, 1);           // slot now queued
+//   ...
+//   safe_lkm_shm_desc(&d, 0, 0, 0, 0);            // accept in place
+//   safe_lkm_recv_batch(shm.fd, &d, 1);
+//   use(safe_lkm_shm_ptr(&shm, d.buf), d.len);    // if d.flags still SHM
+//   safe_lkm_shm_free(&shm, &d.buf, 1);           // slot back to the pool
+//
+// All functions return -1 and set errno on failure, like the system calls
+// they wrap.
+//
+// ============================================================================
+
+#ifndef SAFE_LKM_USER_H
+#define SAFE_LKM_USER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "safe_lkm_uapi.h"
+
+struct safe_lkm_shm {
+    int fd;                   // Open /dev/safe_lkm
+    void *base;               // Start of the mapped region
+    size_t size;              // Mapped bytes
+    uint32_t slot_size;       // Bytes per slot
+    uint32_t slots;           // Number of slots
+};
+
+// Open the device and map its slot region
+// Parameters:
+//   shm   - filled in on success
+//   flags - open(2) flags, must allow read and write (O_RDWR)
+// Returns: 0, or -1 (errno ENODEV if the module has no slots)
+int safe_lkm_shm_open(struct safe_lkm_shm *shm, int flags);
+
+// Unmap the region and close the device; reserved slots are not returned
+void safe_lkm_shm_close(struct safe_lkm_shm *shm);
+
+// Address of the slot at a region offset
+static inline void *safe_lkm_shm_ptr(const struct safe_lkm_shm *shm, uint64_t off)
+{
+    return (char *)shm->base + off;
+}
+
+// Reserve up to count slots
+// Returns: number reserved (offsets in offs[]), or -1 (ENOBUFS if none free)
+int safe_lkm_shm_alloc(struct safe_lkm_shm *shm, uint64_t *offs, uint32_t count);
+
+// Return count reserved or received slots
+// Returns: number returned, or -1
+int safe_lkm_shm_free(struct safe_lkm_shm *shm, const uint64_t *offs, uint32_t count);
+
+// Fill in a descriptor for a slot-resident payload (send), or one that
+// accepts payloads in place (receive, off and len ignored by the module)
+void safe_lkm_shm_desc(struct safe_lkm_desc *d, int pid, int type,
+                       uint64_t off, uint32_t len);
+
+// SEND_BATCH / RECV_BATCH over an array of descriptors
+// Returns: number of descriptors processed, or -1
+int safe_lkm_send_batch(int fd, struct safe_lkm_desc *descs, uint32_t count);
+int safe_lkm_recv_batch(int fd, struct safe_lkm_desc *descs, uint32_t count);
+
+// RECV_MATCH: receive the oldest message matching pid and/or type into d
+// (match is SAFE_LKM_MATCH_PID, SAFE_LKM_MATCH_TYPE or both)
+// Returns: 0, or -1 (EAGAIN if nothing matches and fd is non-blocking)
+int safe_lkm_recv_match(int fd, struct safe_lkm_desc *d, uint32_t match,
+                        int pid, int type);
+
+// DRAIN: receive up to max messages (0 = no limit) into buf as packed
+// records; *bytes is set to the bytes filled. Walk them with
+//   for (off = 0; off < bytes; off += SAFE_LKM_DRAIN_RECLEN(h->len))
+//       h = (struct safe_lkm_hdr *)(buf + off), payload at h + 1
+// Returns: number of messages, or -1 (EMSGSIZE if the next one does not fit)
+int safe_lkm_drain(int fd, void *buf, uint32_t len, uint32_t max, uint32_t *bytes);
+
+// REPRIO: move the messages queued by pid and/or of type (match as for
+// safe_lkm_recv_match) to the level of type prio
+// Returns: number of messages moved, or -1
+int safe_lkm_reprio(int fd, uint32_t match, int pid, int type, int prio);
+
+// PEEK: fill up to count records of queued messages without receiving
+// them; flags SAFE_LKM_PEEK_START begins a pass at the front, reporting
+// sequence numbers of seq and up (seq is ignored otherwise)
+// Returns: number of records, 0 once the pass is over, or -1
+int safe_lkm_peek(int fd, uint64_t seq, struct safe_lkm_peek_rec *recs, uint32_t count,
+                  uint32_t flags);
+
+// EXPORT: dequeue up to max messages (0 = no limit) into buf as export
+// records; *bytes is set to the bytes filled. Walk them with
+//   for (off = 0; off < bytes; off += SAFE_LKM_EXPORT_RECLEN(r->hdr.len))
+//       r = (struct safe_lkm_export_rec *)(buf + off), payload at r + 1
+// Returns: number of messages, 0 once the queue is empty, or -1
+int safe_lkm_export(int fd, void *buf, uint32_t len, uint32_t max, uint32_t *bytes);
+
+// IMPORT: queue the export records in buf, in order, on a quiesced queue
+// that is empty or holds only earlier imports; *bytes is set to the bytes
+// consumed, all of len unless admission stopped early
+// Returns: number of messages queued, or -1 (EBUSY if something else was
+// queued)
+int safe_lkm_import(int fd, const void *buf, uint32_t len, uint32_t *bytes);
+
+#endif // SAFE_LKM_USER_H
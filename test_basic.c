@@ -1,10 +1,19 @@
 // Basic IPC Test Suite - Option B
 // Assignment 2 - OS Fall 2025
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+
+#include "safe_lkm_uapi.h"
 
 #define PROC_FILE "/proc/safe_lkm"
 #define GREEN "\033[0;32m"
@@ -117,6 +126,1055 @@ int test_read_status() {
     return 0;
 }
 
+int test_binary_device() {
+    printf("\n%s=== Test 7: Binary Device Round Trip ===%s\n", YELLOW, RESET);
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        perror("Failed to open " SAFE_LKM_DEV_PATH);
+        test_result("Open binary device", 0);
+        return 0;
+    }
+
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[256];
+    } out, in;
+
+    // Drain whatever earlier tests left behind
+    while (read(fd, &in, sizeof(in)) > 0)
+        ;
+
+    const char *text = "BinaryHello";
+    out.hdr.pid = getpid();
+    out.hdr.type = 7;
+    out.hdr.len = strlen(text);
+    memcpy(out.payload, text, out.hdr.len);
+
+    ssize_t n = write(fd, &out, sizeof(out.hdr) + out.hdr.len);
+    int sent = (n == (ssize_t)(sizeof(out.hdr) + out.hdr.len));
+    test_result("Send message through " SAFE_LKM_DEV_PATH, sent);
+
+    n = read(fd, &in, sizeof(in));
+    int received = (n == (ssize_t)(sizeof(in.hdr) + out.hdr.len) &&
+                    in.hdr.pid == out.hdr.pid &&
+                    in.hdr.type == out.hdr.type &&
+                    in.hdr.len == out.hdr.len &&
+                    memcmp(in.payload, text, in.hdr.len) == 0);
+    test_result("Receive the same message back", received);
+
+    n = read(fd, &in, sizeof(in));
+    int empty = (n < 0 && errno == EAGAIN);
+    test_result("Empty queue reports EAGAIN", empty);
+
+    // Binary payload well past the old 256-byte text limit, with NUL bytes
+    static char big_out[sizeof(struct safe_lkm_hdr) + 10000];
+    static char big_in[sizeof(big_out)];
+    struct safe_lkm_hdr *big_hdr = (struct safe_lkm_hdr *)big_out;
+    big_hdr->pid = getpid();
+    big_hdr->type = 2;
+    big_hdr->len = sizeof(big_out) - sizeof(*big_hdr);
+    for (size_t i = sizeof(*big_hdr); i < sizeof(big_out); i++)
+        big_out[i] = (char)(i * 7);
+
+    int large = (write(fd, big_out, sizeof(big_out)) == (ssize_t)sizeof(big_out) &&
+                 read(fd, big_in, sizeof(big_in)) == (ssize_t)sizeof(big_in) &&
+                 memcmp(big_in, big_out, sizeof(big_out)) == 0);
+    test_result("Round trip a 10000-byte binary payload", large);
+
+    close(fd);
+    return sent && received && empty && large;
+}
+
+// Look up one counter in the stats file, -1 if missing
+long long read_stat(const char *key) {
+    FILE *fp = fopen(SAFE_LKM_STATS_PATH, "r");
+    if (!fp) return -1;
+
+    char line[128];
+    long long value = -1;
+    size_t klen = strlen(key);
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, klen) == 0 && line[klen] == '=') {
+            value = atoll(line + klen + 1);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+int test_stats_file() {
+    printf("\n%s=== Test 8: Stats File ===%s\n", YELLOW, RESET);
+    long long enq = read_stat("enqueued");
+    long long depth = read_stat("depth_normal");
+    int present = (enq >= 0 && depth >= 0 && read_stat("peak_depth") >= 0 &&
+                   read_stat("bytes_queued") >= 0 && read_stat("alloc_failures") >= 0);
+    test_result("Stats file exposes key=value counters", present);
+
+    write_proc("S 6001 1 StatsProbe");
+    int counted = (read_stat("enqueued") == enq + 1 &&
+                   read_stat("depth_normal") == depth + 1);
+    test_result("Counters follow an enqueue", counted);
+    return present && counted;
+}
+
+int test_blocking_receive() {
+    printf("\n%s=== Test 9: Blocking Receive, Timeout and Poll ===%s\n", YELLOW, RESET);
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        perror("Failed to open " SAFE_LKM_DEV_PATH);
+        test_result("Open binary device", 0);
+        return 0;
+    }
+
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[64];
+    } msg;
+
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int idle = (poll(&pfd, 1, 0) == 0);
+    test_result("Empty queue does not poll readable", idle);
+
+    // Switch to blocking mode with a 100 ms receive timeout
+    __s32 timeout_ms = 100;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int timed_out = (ioctl(fd, SAFE_LKM_IOC_SET_RCVTIMEO, &timeout_ms) == 0 &&
+                     read(fd, &msg, sizeof(msg)) < 0 && errno == EAGAIN);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double waited_ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("  Blocked %.1f ms before timing out\n", waited_ms);
+    test_result("Blocking read times out with EAGAIN", timed_out && waited_ms >= 90);
+
+    msg.hdr.pid = getpid();
+    msg.hdr.type = 1;
+    msg.hdr.len = 4;
+    memcpy(msg.payload, "Poll", 4);
+    write(fd, &msg, sizeof(msg.hdr) + msg.hdr.len);
+    int readable = (poll(&pfd, 1, 1000) == 1 && (pfd.revents & POLLIN));
+    test_result("Queued message polls readable", readable);
+
+    int got = (read(fd, &msg, sizeof(msg)) == (ssize_t)(sizeof(msg.hdr) + 4) &&
+               memcmp(msg.payload, "Poll", 4) == 0);
+    test_result("Blocking read returns the queued message", got);
+
+    close(fd);
+    return idle && timed_out && readable && got;
+}
+
+// Level a type lands on, 0 = received first (mirrors the module)
+static int type_level(int type, int levels) {
+    if (levels == 2) return type >= 5 ? 0 : 1;
+    if (type < 0) type = 0;
+    if (type > levels - 1) type = levels - 1;
+    return levels - 1 - type;
+}
+
+int test_priority_levels() {
+    printf("\n%s=== Test 10: Priority Levels ===%s\n", YELLOW, RESET);
+    long long levels = read_stat("prio_levels");
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    if (fd < 0 || levels < 2) {
+        test_result("Read prio_levels and open device", 0);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    printf("  Module has %lld priority levels\n", levels);
+
+    struct {
+        struct safe_lkm_hdr hdr;
+        int seq;
+    } msg;
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    // Interleave types so each level receives its messages out of band
+    const int types[] = { 0, 9, 3, 40, 1, 6, 2, -1 };
+    const int ntypes = sizeof(types) / sizeof(types[0]);
+    int sent = 0;
+    for (int round = 0; round < 3; round++) {
+        for (int t = 0; t < ntypes; t++) {
+            msg.hdr.pid = getpid();
+            msg.hdr.type = types[t];
+            msg.hdr.len = sizeof(msg.seq);
+            msg.seq = sent;
+            if (write(fd, &msg, sizeof(msg)) == sizeof(msg)) sent++;
+        }
+    }
+
+    int last_level = -1, last_seq = -1, received = 0, ordered = 1;
+    while (read(fd, &msg, sizeof(msg)) == sizeof(msg)) {
+        int level = type_level(msg.hdr.type, (int)levels);
+        if (level < last_level || (level == last_level && msg.seq < last_seq))
+            ordered = 0;
+        last_level = level;
+        last_seq = msg.seq;
+        received++;
+    }
+    close(fd);
+
+    test_result("Every message comes back", sent == 3 * ntypes && received == sent);
+    test_result("Higher levels first, FIFO within a level", ordered);
+    return received == sent && sent == 3 * ntypes && ordered;
+}
+
+int test_fair_dequeue() {
+    printf("\n%s=== Test 11: Weighted Fair Dequeue ===%s\n", YELLOW, RESET);
+    const char *param = "/sys/module/safe_lkm/parameters/dequeue_policy";
+    int present = (read_stat("latency_p99_us_high") >= 0 &&
+                   read_stat("latency_p99_us_normal") >= 0);
+    test_result("Stats file reports per-class p99 latency", present);
+
+    FILE *fp = fopen(param, "w");
+    if (!fp) {
+        printf("  %sSkipping: cannot write %s (needs root)%s\n", YELLOW, param, RESET);
+        return present;
+    }
+    fprintf(fp, "1");
+    fclose(fp);
+
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[8];
+    } msg;
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    while (fd >= 0 && read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    // A backlog of high priority traffic queued ahead of normal traffic
+    for (int i = 0; i < 40 && fd >= 0; i++) {
+        msg.hdr.pid = getpid();
+        msg.hdr.type = i < 30 ? 9 : 0;
+        msg.hdr.len = 1;
+        write(fd, &msg, sizeof(msg.hdr) + 1);
+    }
+
+    int normal_early = 0;
+    for (int i = 0; i < 20 && fd >= 0; i++) {
+        if (read(fd, &msg, sizeof(msg)) > 0 && msg.hdr.type == 0)
+            normal_early++;
+    }
+    while (fd >= 0 && read(fd, &msg, sizeof(msg)) > 0)
+        ;
+    if (fd >= 0) close(fd);
+
+    fp = fopen(param, "w");
+    if (fp) {
+        fprintf(fp, "0");
+        fclose(fp);
+    }
+
+    printf("  Normal messages among the first 20 received: %d\n", normal_early);
+    test_result("Round-robin serves normal traffic behind a high backlog", normal_early > 0);
+    return present && normal_early > 0;
+}
+
+int test_named_queues() {
+    printf("\n%s=== Test 12: Named Queues ===%s\n", YELLOW, RESET);
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[16];
+    } msg;
+    struct safe_lkm_queue_attr attr = { .capacity = 2 };
+    snprintf(attr.name, sizeof(attr.name), "test_basic_%d", getpid());
+
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    int def = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    int id = fd >= 0 ? ioctl(fd, SAFE_LKM_IOC_QUEUE_CREATE, &attr) : -1;
+    int created = (id > 0 && ioctl(fd, SAFE_LKM_IOC_QUEUE_ATTACH, &(__u32){ id }) == 0);
+    test_result("Create a named queue and attach to it", created);
+    if (!created) {
+        if (fd >= 0) close(fd);
+        if (def >= 0) close(def);
+        return 0;
+    }
+
+    struct safe_lkm_queue_attr found = { 0 };
+    strcpy(found.name, attr.name);
+    int dup = ioctl(def, SAFE_LKM_IOC_QUEUE_CREATE, &attr);
+    int lookup = (ioctl(def, SAFE_LKM_IOC_QUEUE_LOOKUP, &found) == id &&
+                  found.capacity == 2 && dup < 0 && errno == EEXIST);
+    test_result("Look up by name; duplicate names rejected", lookup);
+
+    struct safe_lkm_queue_attr huge = attr;
+    huge.ring_size = SAFE_LKM_RING_MAX * 2;
+    strcpy(huge.name, "test_basic_huge_ring");
+    int bounded = ioctl(def, SAFE_LKM_IOC_QUEUE_CREATE, &huge) < 0 && errno == EINVAL;
+    test_result("A ring above SAFE_LKM_RING_MAX is rejected", bounded);
+
+    // Drain the default queue, then fill the named one up to its capacity
+    while (read(def, &msg, sizeof(msg)) > 0)
+        ;
+    msg.hdr.pid = getpid();
+    msg.hdr.type = 1;
+    msg.hdr.len = 1;
+    int sent = 0;
+    for (int i = 0; i < 3; i++)
+        if (write(fd, &msg, sizeof(msg.hdr) + 1) > 0) sent++;
+    int full = (sent == 2 && errno == EAGAIN);
+    test_result("Capacity bounds the named queue", full);
+
+    int isolated = (read(def, &msg, sizeof(msg)) < 0 && errno == EAGAIN &&
+                    read(fd, &msg, sizeof(msg)) > 0);
+    test_result("Messages stay on their own queue", isolated);
+
+    int destroyed = (ioctl(def, SAFE_LKM_IOC_QUEUE_DESTROY, &(__u32){ id }) == 0 &&
+                     read(fd, &msg, sizeof(msg)) < 0 && errno == ENODEV &&
+                     ioctl(def, SAFE_LKM_IOC_QUEUE_LOOKUP, &found) < 0 && errno == ENOENT);
+    test_result("Destroyed queue reports ENODEV to attached users", destroyed);
+
+    close(fd);
+    close(def);
+    return created && lookup && bounded && full && isolated && destroyed;
+}
+
+// Create a named queue with a capacity and overflow policy; returns an
+// fd attached to it, or -1
+static int open_bounded_queue(const char *tag, __u32 overflow, __u32 *id) {
+    struct safe_lkm_queue_attr attr = { .capacity = 4, .capacity_high = 6,
+                                        .overflow = overflow };
+    snprintf(attr.name, sizeof(attr.name), "test_%s_%d", tag, getpid());
+
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    int ret = fd >= 0 ? ioctl(fd, SAFE_LKM_IOC_QUEUE_CREATE, &attr) : -1;
+    if (ret <= 0 || ioctl(fd, SAFE_LKM_IOC_QUEUE_ATTACH, &(__u32){ ret }) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    *id = ret;
+    return fd;
+}
+
+// Send one small message; returns 0 or -errno
+static int send_typed(int fd, int type, int seq) {
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[1];
+    } msg = { .hdr = { .pid = getpid(), .type = type, .len = 1 },
+              .payload = { (char)seq } };
+    return write(fd, &msg, sizeof(msg)) < 0 ? -errno : 0;
+}
+
+int test_overflow_policies() {
+    printf("\n%s=== Test 13: Capacity and Overflow Policies ===%s\n", YELLOW, RESET);
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[8];
+    } msg;
+    __u32 id;
+
+    // DROP_OLDEST: a fifth normal message evicts the first one
+    int fd = open_bounded_queue("drop", SAFE_LKM_OVERFLOW_DROP_OLDEST, &id);
+    int drop = fd >= 0;
+    for (int i = 0; i < 5 && drop; i++)
+        drop = send_typed(fd, 1, i) == 0;
+    drop = drop && read(fd, &msg, sizeof(msg)) > 0 && msg.payload[0] == 1;
+    if (fd >= 0) {
+        ioctl(fd, SAFE_LKM_IOC_QUEUE_DESTROY, &id);
+        close(fd);
+    }
+    test_result("DROP_OLDEST evicts the oldest normal message", drop);
+
+    // REJECT_NORMAL: normal traffic stops at 4, high continues up to 6
+    fd = open_bounded_queue("reject", SAFE_LKM_OVERFLOW_REJECT_NORMAL, &id);
+    int reject = fd >= 0;
+    for (int i = 0; i < 4 && reject; i++)
+        reject = send_typed(fd, 1, i) == 0;
+    reject = reject && send_typed(fd, 1, 4) == -EAGAIN;
+    for (int i = 0; i < 6 && reject; i++)
+        reject = send_typed(fd, 9, i) == 0;
+    reject = reject && send_typed(fd, 9, 6) == -EAGAIN;
+    if (fd >= 0) {
+        ioctl(fd, SAFE_LKM_IOC_QUEUE_DESTROY, &id);
+        close(fd);
+    }
+    test_result("REJECT_NORMAL admits high priority past capacity", reject);
+
+    // BLOCK: a full queue is not writable, and becomes so after a receive
+    fd = open_bounded_queue("block", SAFE_LKM_OVERFLOW_BLOCK, &id);
+    int block = fd >= 0;
+    for (int i = 0; i < 4 && block; i++)
+        block = send_typed(fd, 1, i) == 0;
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    block = block && send_typed(fd, 1, 4) == -EAGAIN &&      // O_NONBLOCK
+            poll(&pfd, 1, 0) == 0 &&
+            read(fd, &msg, sizeof(msg)) > 0 &&
+            poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+    if (fd >= 0) {
+        ioctl(fd, SAFE_LKM_IOC_QUEUE_DESTROY, &id);
+        close(fd);
+    }
+    test_result("BLOCK reports POLLOUT only when there is room", block);
+
+    return drop && reject && block;
+}
+
+// Summary line of one /proc/safe_lkm_latency histogram
+// Returns: 0, or -1 if the file or the histogram is missing
+static int read_latency(const char *name, unsigned long long *count,
+                        unsigned long long *p50, unsigned long long *p99,
+                        unsigned long long *max) {
+    FILE *fp = fopen("/proc/safe_lkm_latency", "r");
+    char line[256], key[64];
+    unsigned long long p90, p999;
+    int found = -1;
+
+    if (!fp) return -1;
+    while (found < 0 && fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%63s count=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu",
+                   key, count, p50, &p90, p99, &p999, max) == 7 && strcmp(key, name) == 0)
+            found = 0;
+    }
+    fclose(fp);
+    return found;
+}
+
+int test_latency_histograms() {
+    printf("\n%s=== Test 14: Latency Histograms ===%s\n", YELLOW, RESET);
+    const char *names[] = { "residence_high", "enqueue", "dequeue" };
+    unsigned long long before[3], count, p50, p99, max;
+    int present = 1, counted = 1, ordered = 1;
+
+    for (int i = 0; i < 3; i++)
+        present &= read_latency(names[i], &before[i], &p50, &p99, &max) == 0;
+    test_result("Latency file has residence, enqueue and dequeue histograms", present);
+    if (!present) return 0;
+
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[8];
+    } msg = { .hdr = { .pid = getpid(), .type = 9, .len = 4 } };
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    memcpy(msg.payload, "slow", 4);
+    int sent = fd >= 0 && write(fd, &msg, sizeof(msg.hdr) + 4) > 0;
+    usleep(2000);
+    int got = fd >= 0 && read(fd, &msg, sizeof(msg)) > 0;
+    if (fd >= 0) close(fd);
+
+    for (int i = 0; i < 3; i++) {
+        if (read_latency(names[i], &count, &p50, &p99, &max) != 0 || count <= before[i])
+            counted = 0;
+        else if (!(p50 <= p99 && p99 <= max))
+            ordered = 0;
+    }
+    test_result("A send and a receive are recorded", sent && got && counted);
+    test_result("Percentiles are ordered p50 <= p99 <= max", ordered);
+    return present && sent && got && counted && ordered;
+}
+
+int test_message_ttl() {
+    printf("\n%s=== Test 15: Message Time-To-Live ===%s\n", YELLOW, RESET);
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[8];
+    } msg = { .hdr = { .pid = getpid(), .type = 2, .len = 5 } };
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    __s32 ttl = 50, none = 0, bad = -1;
+
+    if (fd < 0) {
+        test_result("Open device", 0);
+        return 0;
+    }
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    long long expired = read_stat("expired");
+    int set = ioctl(fd, SAFE_LKM_IOC_SET_TTL, &ttl) == 0 &&
+              ioctl(fd, SAFE_LKM_IOC_SET_TTL, &bad) < 0 && errno == EINVAL;
+    test_result("SET_TTL accepts a lifetime and rejects a negative one", set);
+
+    msg.hdr = (struct safe_lkm_hdr){ .pid = getpid(), .type = 2, .len = 5 };
+    memcpy(msg.payload, "stale", 5);
+    int sent = write(fd, &msg, sizeof(msg.hdr) + 5) > 0;
+    usleep(100000);
+    int skipped = read(fd, &msg, sizeof(msg)) < 0 && errno == EAGAIN;
+    test_result("An expired message is not delivered", sent && skipped);
+    test_result("Stats count the expired message", read_stat("expired") >= expired + 1);
+
+    ioctl(fd, SAFE_LKM_IOC_SET_TTL, &none);
+    msg.hdr = (struct safe_lkm_hdr){ .pid = getpid(), .type = 2, .len = 5 };
+    memcpy(msg.payload, "fresh", 5);
+    write(fd, &msg, sizeof(msg.hdr) + 5);
+    usleep(100000);
+    int kept = read(fd, &msg, sizeof(msg)) > 0 && memcmp(msg.payload, "fresh", 5) == 0;
+    test_result("TTL 0 messages never expire", kept);
+    close(fd);
+
+    return set && sent && skipped && kept && read_stat("expired") >= expired + 1;
+}
+
+// Selective receive of one message; returns its payload byte, or -errno
+static int recv_match(int fd, __u32 match, int pid, int type) {
+    char payload[8];
+    struct safe_lkm_match req = {
+        .desc = { .len = sizeof(payload), .buf = (__u64)(unsigned long)payload },
+        .match = match, .pid = pid, .type = type,
+    };
+    if (ioctl(fd, SAFE_LKM_IOC_RECV_MATCH, &req) < 0) return -errno;
+    return req.desc.len == 1 ? payload[0] : -EPROTO;
+}
+
+int test_selective_receive() {
+    printf("\n%s=== Test 16: Selective Receive by PID and Type ===%s\n", YELLOW, RESET);
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[8];
+    } msg;
+    // Oldest first: a (7001, normal), b (7002, high), c (7001, high), d (7002, normal)
+    struct { int pid, type; char c; } sends[] = {
+        { 7001, 1, 'a' }, { 7002, 9, 'b' }, { 7001, 9, 'c' }, { 7002, 1, 'd' },
+    };
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+
+    if (fd < 0) {
+        test_result("Open device", 0);
+        return 0;
+    }
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    int sent = 1;
+    for (int i = 0; i < 4 && sent; i++) {
+        msg.hdr = (struct safe_lkm_hdr){ .pid = sends[i].pid, .type = sends[i].type, .len = 1 };
+        msg.payload[0] = sends[i].c;
+        sent = write(fd, &msg, sizeof(msg.hdr) + 1) > 0;
+    }
+
+    int by_pid = recv_match(fd, SAFE_LKM_MATCH_PID, 7001, 0) == 'a';
+    test_result("By pid: the oldest match, even below a newer high one", sent && by_pid);
+    int by_type = recv_match(fd, SAFE_LKM_MATCH_TYPE, 0, 9) == 'b';
+    test_result("By type: the oldest message of that type", by_type);
+    int both = recv_match(fd, SAFE_LKM_MATCH_PID | SAFE_LKM_MATCH_TYPE, 7002, 1) == 'd';
+    test_result("By pid and type together", both);
+    int none = recv_match(fd, SAFE_LKM_MATCH_PID, 7003, 0) == -EAGAIN &&
+               recv_match(fd, 0, 0, 0) == -EINVAL;
+    test_result("No match gives EAGAIN, no filter EINVAL", none);
+    int rest = read(fd, &msg, sizeof(msg)) > 0 && msg.payload[0] == 'c' &&
+               read(fd, &msg, sizeof(msg)) < 0 && errno == EAGAIN;
+    test_result("Plain receive still gets what is left", rest);
+    close(fd);
+
+    return sent && by_pid && by_type && both && none && rest;
+}
+
+int test_packed_drain() {
+    printf("\n%s=== Test 17: Packed Drain ===%s\n", YELLOW, RESET);
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[16];
+    } msg;
+    static char buf[4096];
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+
+    if (fd < 0) {
+        test_result("Open device", 0);
+        return 0;
+    }
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    // 20 messages of 1..10 bytes, every fourth one high priority
+    int sent = 1;
+    for (int i = 0; i < 20 && sent; i++) {
+        msg.hdr = (struct safe_lkm_hdr){ .pid = getpid(), .type = i % 4 ? 1 : 9,
+                                         .len = 1 + i % 10 };
+        memset(msg.payload, 'a' + i, sizeof(msg.payload));
+        sent = write(fd, &msg, sizeof(msg.hdr) + msg.hdr.len) > 0;
+    }
+
+    // Room for exactly the first 8 records in delivery order: the 5 high
+    // priority messages (i = 0, 4, ..., 16), then i = 1, 2, 3
+    int order[20], n = 0;
+    for (int i = 0; i < 20; i += 4) order[n++] = i;
+    for (int i = 0; i < 20; i++) if (i % 4) order[n++] = i;
+    size_t want = 0;
+    for (int i = 0; i < 8; i++) want += SAFE_LKM_DRAIN_RECLEN(1 + order[i] % 10);
+
+    struct safe_lkm_drain req = { .buf = (__u64)(unsigned long)buf, .len = want };
+    int got = ioctl(fd, SAFE_LKM_IOC_DRAIN, &req);
+    int parsed = got == 8 && req.count == 8 && req.bytes == want;
+    for (size_t off = 0, i = 0; parsed && off < req.bytes; i++) {
+        struct safe_lkm_hdr *h = (struct safe_lkm_hdr *)(buf + off);
+        int k = order[i];
+        parsed = h->pid == getpid() && h->len == (__u32)(1 + k % 10) &&
+                 ((char *)(h + 1))[0] == 'a' + k && ((char *)(h + 1))[h->len - 1] == 'a' + k;
+        off += SAFE_LKM_DRAIN_RECLEN(h->len);
+    }
+    test_result("Records come back packed in delivery order, none cut", sent && parsed);
+
+    req = (struct safe_lkm_drain){ .buf = (__u64)(unsigned long)buf,
+                                   .len = SAFE_LKM_DRAIN_RECLEN(0) };
+    int too_small = ioctl(fd, SAFE_LKM_IOC_DRAIN, &req) < 0 && errno == EMSGSIZE;
+    test_result("A buffer too small for the next message gives EMSGSIZE", too_small);
+
+    req = (struct safe_lkm_drain){ .buf = (__u64)(unsigned long)buf, .len = sizeof(buf),
+                                   .max = 5 };
+    int capped = ioctl(fd, SAFE_LKM_IOC_DRAIN, &req) == 5;
+    req.max = 0;
+    int rest = ioctl(fd, SAFE_LKM_IOC_DRAIN, &req) == 7;
+    int empty = ioctl(fd, SAFE_LKM_IOC_DRAIN, &req) < 0 && errno == EAGAIN;
+    test_result("max caps a drain, the rest follows, then EAGAIN", capped && rest && empty);
+    close(fd);
+
+    return sent && parsed && too_small && capped && rest && empty;
+}
+
+// First line of the status file that starts with prefix, or ""
+static const char *status_line(const char *prefix) {
+    static char line[256];
+    FILE *fp = fopen(PROC_FILE, "r");
+    if (!fp) return "";
+    while (fgets(line, sizeof(line), fp)) {
+        const char *p = line + strspn(line, " ");
+        if (strncmp(p, prefix, strlen(prefix)) == 0) {
+            fclose(fp);
+            return p;
+        }
+    }
+    fclose(fp);
+    return "";
+}
+
+int test_task_registry() {
+    printf("\n%s=== Test 18: Task Registry (T/A/C/D) ===%s\n", YELLOW, RESET);
+    char cmd[64], want[96];
+    int base = 90000 + getpid() % 1000 * 4;
+    long long before = read_stat("tasks");
+
+    for (int i = 0; i < 3; i++) {
+        snprintf(cmd, sizeof(cmd), "T %d %d", base + i, 1000 + i);
+        write_proc(cmd);
+    }
+    snprintf(cmd, sizeof(cmd), "T %d %d", base, 5);   // Duplicate: ignored
+    write_proc(cmd);
+    int created = before >= 0 && read_stat("tasks") == before + 3;
+    test_result("T registers tasks once per pid", created);
+
+    // base + 2 (prio 1002) leads until base gets a higher priority
+    snprintf(cmd, sizeof(cmd), "A %d %d", base, 2000);
+    write_proc(cmd);
+    snprintf(want, sizeof(want), "Tasks: %lld (highest priority: pid %d, prio 2000)",
+             before + 3, base);
+    int raised = strncmp(status_line("Tasks:"), want, strlen(want)) == 0;
+    test_result("A reorders tasks by priority", raised);
+
+    snprintf(cmd, sizeof(cmd), "C %d 0", base + 1);
+    write_proc(cmd);
+    snprintf(cmd, sizeof(cmd), "C %d 100000", base + 1);   // No such CPU
+    write_proc(cmd);
+    int migrated = read_stat("tasks") == before + 3;
+    test_result("C moves a task and rejects an impossible CPU", migrated);
+
+    for (int i = 0; i < 3; i++) {
+        snprintf(cmd, sizeof(cmd), "D %d", base + i);
+        write_proc(cmd);
+    }
+    int deleted = read_stat("tasks") == before;
+    test_result("D removes tasks", deleted);
+
+    return created && raised && migrated && deleted;
+}
+
+// REPRIO ioctl; returns messages moved or -1
+static int reprio(int fd, unsigned int match, int pid, int type, int prio) {
+    struct safe_lkm_reprio req = { .match = match, .pid = pid, .type = type, .prio = prio };
+    return ioctl(fd, SAFE_LKM_IOC_REPRIO, &req);
+}
+
+// Send one message with a given pid and type to fd; returns 0 or -1
+static int send_from(int fd, int pid, int type, char c) {
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[1];
+    } msg = { .hdr = { .pid = pid, .type = type, .len = 1 }, .payload = { c } };
+    return write(fd, &msg, sizeof(msg)) > 0 ? 0 : -1;
+}
+
+// Moved messages stay oldest first in their new level: a message moved
+// behind newer ones is still the one DROP_OLDEST evicts and aging serves
+static int test_reprio_keeps_age(void) {
+    const char *param = "/sys/module/safe_lkm/parameters/age_deadline_ms";
+    struct safe_lkm_queue_attr attr = { .prio_levels = 10, .capacity = 4,
+                                        .overflow = SAFE_LKM_OVERFLOW_DROP_OLDEST };
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[8];
+    } msg;
+    char got[5] = "";
+    int id, ok;
+
+    snprintf(attr.name, sizeof(attr.name), "test_reprio_%d", getpid());
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    id = fd >= 0 ? ioctl(fd, SAFE_LKM_IOC_QUEUE_CREATE, &attr) : -1;
+    if (id <= 0 || ioctl(fd, SAFE_LKM_IOC_QUEUE_ATTACH, &(__u32){ id }) != 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+
+    // a (type 1) is oldest; moved to type 3's level it lands ahead of b, c, d
+    ok = send_from(fd, 7111, 1, 'a') == 0;
+    usleep(2000);
+    ok = ok && send_from(fd, 7112, 3, 'b') == 0 && send_from(fd, 7112, 3, 'c') == 0 &&
+         send_from(fd, 7112, 3, 'd') == 0 && reprio(fd, SAFE_LKM_MATCH_PID, 7111, 0, 3) == 1 &&
+         send_from(fd, 7112, 3, 'e') == 0;
+    for (int i = 0; i < 4 && read(fd, &msg, sizeof(msg)) > 0; i++)
+        got[i] = msg.payload[0];
+    int dropped = ok && strcmp(got, "bcde") == 0;
+    test_result("DROP_OLDEST evicts a moved message by its send time", dropped);
+
+    // An overdue message moved behind fresh ones is served first
+    unsigned int saved = 0;
+    FILE *fp = fopen(param, "r");
+    if (fp) {
+        if (fscanf(fp, "%u", &saved) != 1) saved = 0;
+        fclose(fp);
+    }
+    fp = fopen(param, "w");
+    if (!fp) {
+        printf("  %sSkipping aging check: cannot write %s (needs root)%s\n", YELLOW, param,
+               RESET);
+        ioctl(fd, SAFE_LKM_IOC_QUEUE_DESTROY, &id);
+        close(fd);
+        return dropped;
+    }
+    fprintf(fp, "20");
+    fclose(fp);
+
+    ok = send_from(fd, 7111, 1, 'x') == 0;
+    usleep(50000);
+    ok = ok && send_from(fd, 7112, 3, 'y') == 0 && send_from(fd, 7113, 9, 'h') == 0 &&
+         reprio(fd, SAFE_LKM_MATCH_PID, 7111, 0, 3) == 1;
+    int aged = ok && read(fd, &msg, sizeof(msg)) > 0 && msg.payload[0] == 'x';
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    fp = fopen(param, "w");
+    if (fp) {
+        fprintf(fp, "%u", saved);
+        fclose(fp);
+    }
+    ioctl(fd, SAFE_LKM_IOC_QUEUE_DESTROY, &id);
+    close(fd);
+    test_result("Aging serves an overdue moved message first", aged);
+    return dropped && aged;
+}
+
+int test_reprioritize() {
+    printf("\n%s=== Test 19: Reprioritize Queued Messages ===%s\n", YELLOW, RESET);
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[8];
+    } msg;
+    // a, b, c normal and d high; then e, f normal; then g (type 2), h (type 3)
+    struct { int pid, type; char c; } sends[] = {
+        { 7101, 1, 'a' }, { 7102, 1, 'b' }, { 7101, 1, 'c' }, { 7102, 9, 'd' },
+        { 7103, 1, 'e' }, { 7104, 1, 'f' }, { 7105, 2, 'g' }, { 7105, 3, 'h' },
+    };
+    long long before = read_stat("reprioritized");
+    char got[9] = "";
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+
+    if (fd < 0) {
+        test_result("Open device", 0);
+        return 0;
+    }
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    int sent = 1;
+    for (int i = 0; i < 4 && sent; i++) {
+        msg.hdr = (struct safe_lkm_hdr){ .pid = sends[i].pid, .type = sends[i].type, .len = 1 };
+        msg.payload[0] = sends[i].c;
+        sent = write(fd, &msg, sizeof(msg.hdr) + 1) > 0;
+    }
+    int moved = reprio(fd, SAFE_LKM_MATCH_PID, 7101, 0, 9) == 2;
+    for (int i = 0; i < 4 && read(fd, &msg, sizeof(msg)) > 0; i++)
+        got[i] = msg.payload[0];
+    // The moved messages are merged into the high level by send time
+    int by_pid = sent && moved && strcmp(got, "acdb") == 0;
+    test_result("REPRIO by pid moves its backlog ahead, oldest first", by_pid);
+
+    for (int i = 4; i < 6 && sent; i++) {
+        msg.hdr = (struct safe_lkm_hdr){ .pid = sends[i].pid, .type = sends[i].type, .len = 1 };
+        msg.payload[0] = sends[i].c;
+        sent = write(fd, &msg, sizeof(msg.hdr) + 1) > 0;
+    }
+    // Without a message type, A only touches the task registry
+    long long moved_so_far = read_stat("reprioritized");
+    write_proc("A 7104 50");
+    int registry_only = read_stat("reprioritized") == moved_so_far;
+    write_proc("A 7104 50 9");
+    int by_cmd = sent && registry_only &&
+                 read(fd, &msg, sizeof(msg)) > 0 && msg.payload[0] == 'f' &&
+                 msg.hdr.type == 1 && read(fd, &msg, sizeof(msg)) > 0 &&
+                 msg.payload[0] == 'e';
+    test_result("A with a type moves the sender's messages, type unchanged", by_cmd);
+
+    for (int i = 6; i < 8 && sent; i++) {
+        msg.hdr = (struct safe_lkm_hdr){ .pid = sends[i].pid, .type = sends[i].type, .len = 1 };
+        msg.payload[0] = sends[i].c;
+        sent = write(fd, &msg, sizeof(msg.hdr) + 1) > 0;
+    }
+    int by_type = sent && reprio(fd, SAFE_LKM_MATCH_TYPE, 0, 3, 9) == 1 &&
+                  reprio(fd, SAFE_LKM_MATCH_TYPE, 0, 3, 9) == 0 &&
+                  read(fd, &msg, sizeof(msg)) > 0 && msg.payload[0] == 'h' &&
+                  read(fd, &msg, sizeof(msg)) > 0 && msg.payload[0] == 'g';
+    test_result("REPRIO by type, a second time moves nothing", by_type);
+
+    int errs = reprio(fd, 0, 7101, 0, 9) < 0 && errno == EINVAL;
+    test_result("No filter gives EINVAL", errs);
+    close(fd);
+
+    int counted = before >= 0 && read_stat("reprioritized") == before + 4;
+    test_result("Stats count the moved messages", counted);
+    counted = counted &&
+              read_stat("enqueued_high") - read_stat("dequeued_high") == read_stat("depth_high") &&
+              read_stat("enqueued_normal") - read_stat("dequeued_normal") ==
+                  read_stat("depth_normal");
+    test_result("Per-class counters still add up to the depths", counted);
+
+    int keeps_age = test_reprio_keeps_age();
+
+    return by_pid && by_cmd && by_type && errs && counted && keeps_age;
+}
+
+// Senders on every CPU; with numa_shards=1 they land in their nodes'
+// shards, and the receiver must still see priority order across them
+int test_numa_shards() {
+    printf("\n%s=== Test 20: NUMA Shards ===%s\n", YELLOW, RESET);
+    struct {
+        struct safe_lkm_hdr hdr;
+        unsigned char payload[2];     // CPU, sequence
+    } msg;
+    long long shards = read_stat("numa_shards");
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t saved, one;
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+
+    if (fd < 0 || shards < 1 || sched_getaffinity(0, sizeof(saved), &saved) != 0) {
+        test_result("Read numa_shards and open device", 0);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    printf("  Module uses %lld shard(s)\n", shards);
+    if (ncpu > 64) ncpu = 64;
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    // Per CPU: normal 0, high 1, normal 2
+    int sent = 0;
+    for (int cpu = 0; cpu < ncpu; cpu++) {
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) != 0)
+            continue;
+        for (int seq = 0; seq < 3; seq++) {
+            msg.hdr = (struct safe_lkm_hdr){ .pid = getpid(), .type = seq == 1 ? 9 : 1,
+                                             .len = 2 };
+            msg.payload[0] = cpu;
+            msg.payload[1] = seq;
+            if (write(fd, &msg, sizeof(msg)) > 0)
+                sent++;
+        }
+    }
+    sched_setaffinity(0, sizeof(saved), &saved);
+
+    int got = 0, highs = 0, in_order = 1;
+    int last[64];
+    memset(last, -1, sizeof(last));
+    while (read(fd, &msg, sizeof(msg)) > 0) {
+        int cpu = msg.payload[0], seq = msg.payload[1];
+        if (seq == 1) {
+            highs++;
+            if (got >= sent / 3) in_order = 0;     // A high after a normal
+        } else if (cpu < 64) {
+            if (seq < last[cpu]) in_order = 0;     // FIFO within a shard
+            last[cpu] = seq;
+        }
+        got++;
+    }
+    close(fd);
+
+    test_result("Messages sent from every CPU", sent == 3 * ncpu);
+    int all = got == sent && highs == sent / 3;
+    test_result("Every message received once", all);
+    test_result("High priority first, FIFO per sender CPU", in_order);
+
+    return sent == 3 * ncpu && all && in_order;
+}
+
+static int peek(int fd, unsigned long long seq, struct safe_lkm_peek_rec *recs,
+                unsigned int count, unsigned int flags) {
+    struct safe_lkm_peek req = {
+        .seq = seq, .recs = (__u64)(unsigned long)recs, .count = count, .flags = flags,
+    };
+    return ioctl(fd, SAFE_LKM_IOC_PEEK, &req);
+}
+
+int test_browse_cursor() {
+    printf("\n%s=== Test 21: Browse Without Receiving ===%s\n", YELLOW, RESET);
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[16];
+    } msg;
+    const char *texts[] = { "browse-low", "browse-high", "browse-low2" };
+    int types[] = { 1, 9, 1 };
+    struct safe_lkm_peek_rec recs[8];
+    cpu_set_t saved, one;
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+
+    if (fd < 0 || sched_getaffinity(0, sizeof(saved), &saved) != 0) {
+        test_result("Open device", 0);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    // One CPU, so one shard with numa_shards=1: a pass goes shard by shard
+    CPU_ZERO(&one);
+    CPU_SET(sched_getcpu(), &one);
+    sched_setaffinity(0, sizeof(one), &one);
+    int sent = 1;
+    for (int i = 0; i < 3 && sent; i++) {
+        msg.hdr = (struct safe_lkm_hdr){ .pid = 7201, .type = types[i],
+                                         .len = strlen(texts[i]) };
+        memcpy(msg.payload, texts[i], msg.hdr.len);
+        sent = write(fd, &msg, sizeof(msg.hdr) + msg.hdr.len) > 0;
+    }
+    sched_setaffinity(0, sizeof(saved), &saved);
+    long long last = read_stat("last_seq");
+
+    // Delivery order, increasing sequence numbers within a level
+    int n = peek(fd, 0, recs, 8, SAFE_LKM_PEEK_START);
+    int listed = sent && n == 3 &&
+                 memcmp(recs[0].data, "browse-high", 11) == 0 &&
+                 memcmp(recs[1].data, "browse-low", 10) == 0 &&
+                 memcmp(recs[2].data, "browse-low2", 11) == 0 &&
+                 recs[1].seq < recs[2].seq && recs[0].seq == (unsigned long long)last - 1 &&
+                 recs[0].pid == 7201 && recs[0].type == 9 && recs[0].len == 11 &&
+                 peek(fd, 0, recs, 8, 0) == 0;
+    test_result("PEEK lists queued messages in delivery order", listed);
+
+    int fresh = peek(fd, last + 1, recs, 8, SAFE_LKM_PEEK_START) == 0 &&
+                peek(fd, last, recs, 8, SAFE_LKM_PEEK_START) == 1 &&
+                recs[0].seq == (unsigned long long)last;
+    test_result("PEEK from a sequence number skips older messages", fresh);
+
+    // The dump reads the same cursor, a chunk at a time
+    char line[256];
+    int lines = 0;
+    FILE *fp = fopen("/proc/safe_lkm_messages", "r");
+    while (fp && fgets(line, sizeof(line), fp))
+        if (strstr(line, "browse-"))
+            lines++;
+    if (fp) fclose(fp);
+    test_result("/proc/safe_lkm_messages lists them", lines == 3);
+
+    int got = 0;
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        got++;
+    test_result("Nothing was dequeued by browsing", got == 3);
+
+    int errs = peek(fd, 0, recs, 8, 0x80) < 0 && errno == EINVAL;
+    test_result("Unknown flags give EINVAL", errs);
+    close(fd);
+
+    return listed && fresh && lines == 3 && got == 3 && errs;
+}
+
+int test_export_import() {
+    printf("\n%s=== Test 22: Export and Import a Backlog ===%s\n", YELLOW, RESET);
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[16];
+    } msg;
+    const char *texts[] = { "keep-low", "keep-high", "keep-low2" };
+    int types[] = { 1, 9, 1 };
+    static char buf[4096];
+    struct safe_lkm_drain req = { .buf = (__u64)(unsigned long)buf, .len = sizeof(buf) };
+    struct safe_lkm_peek_rec recs[4];
+    struct timespec ts;
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+
+    if (fd < 0) {
+        test_result("Open device", 0);
+        return 0;
+    }
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+
+    int sent = 1;
+    for (int i = 0; i < 3 && sent; i++) {
+        msg.hdr = (struct safe_lkm_hdr){ .pid = 7301, .type = types[i],
+                                         .len = strlen(texts[i]) };
+        memcpy(msg.payload, texts[i], msg.hdr.len);
+        sent = write(fd, &msg, sizeof(msg.hdr) + msg.hdr.len) > 0;
+    }
+
+    // Delivery order, levels and send times kept; the queue is left empty
+    long long dequeued = read_stat("dequeued"), moved = read_stat("exported");
+    int n = ioctl(fd, SAFE_LKM_IOC_EXPORT, &req);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    unsigned long long real = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    struct safe_lkm_export_rec *r = (struct safe_lkm_export_rec *)buf;
+    struct safe_lkm_export_rec *r2 =
+        (struct safe_lkm_export_rec *)(buf + SAFE_LKM_EXPORT_RECLEN(r->hdr.len));
+    int exported = sent && n == 3 && req.count == 3 && r->hdr.type == 9 &&
+                   r->hdr.len == 9 && memcmp(r + 1, "keep-high", 9) == 0 &&
+                   r2->hdr.type == 1 && memcmp(r2 + 1, "keep-low", 8) == 0 &&
+                   r->level < r2->level && r->hdr.pid == 7301 && r->expires_ns == 0 &&
+                   r->time_ns <= real && real - r->time_ns < 10000000000ULL &&
+                   read(fd, &msg, sizeof(msg)) < 0 && errno == EAGAIN &&
+                   ioctl(fd, SAFE_LKM_IOC_EXPORT, &req) == 0;
+    test_result("EXPORT moves the backlog out as records", exported);
+
+    // Not a dequeue: only the exported counter moves
+    int uncounted = read_stat("dequeued") == dequeued && read_stat("exported") == moved + 3;
+    test_result("EXPORT is counted apart from dequeues", uncounted);
+
+    // Imported messages keep their age; a second IMPORT goes on from the first
+    usleep(50000);
+    __u32 first = SAFE_LKM_EXPORT_RECLEN(r->hdr.len);
+    struct safe_lkm_drain in = { .buf = req.buf, .len = first };
+    int imported = exported && ioctl(fd, SAFE_LKM_IOC_IMPORT, &in) == 1 &&
+                   in.bytes == first;
+    in.buf = req.buf + first;
+    in.len = req.bytes - first;
+    imported = imported && ioctl(fd, SAFE_LKM_IOC_IMPORT, &in) == 2 &&
+               in.count == 2 && in.bytes == req.bytes - first;
+    in.buf = req.buf;
+    in.len = req.bytes;
+    struct safe_lkm_peek peek = { .recs = (__u64)(unsigned long)recs, .count = 4,
+                                  .flags = SAFE_LKM_PEEK_START };
+    int aged = imported && ioctl(fd, SAFE_LKM_IOC_PEEK, &peek) == 3 &&
+               recs[0].age_ns >= 50000000ULL;
+    char got[3] = "";
+    for (int i = 0; i < 3 && read(fd, &msg, sizeof(msg)) > 0; i++)
+        got[i] = msg.payload[msg.hdr.len - 1];
+    int restored = imported && memcmp(got, "hw2", 3) == 0 && msg.hdr.pid == 7301;
+    test_result("IMPORT in two calls restores order, pid, type and age", restored && aged);
+
+    // Imported records must not land behind newer messages
+    msg.hdr = (struct safe_lkm_hdr){ .pid = 7301, .type = 1, .len = 1 };
+    int busy = write(fd, &msg, sizeof(msg.hdr) + 1) > 0 &&
+               ioctl(fd, SAFE_LKM_IOC_IMPORT, &in) < 0 && errno == EBUSY &&
+               read(fd, &msg, sizeof(msg)) > 0 && read(fd, &msg, sizeof(msg)) < 0;
+    test_result("IMPORT into a non-empty queue gives EBUSY", busy);
+
+    in.len = SAFE_LKM_EXPORT_RECLEN(0) - 1;
+    int errs = ioctl(fd, SAFE_LKM_IOC_IMPORT, &in) < 0 && errno == EINVAL;
+    test_result("A truncated record gives EINVAL", errs);
+    close(fd);
+
+    return exported && uncounted && restored && aged && busy && errs;
+}
+
 int main() {
     printf("\n");
     printf("================================================\n");
@@ -125,7 +1183,7 @@ int main() {
     printf("================================================\n");
     
     int passed = 0;
-    int total = 6;
+    int total = 22;
     
     if (access(PROC_FILE, F_OK) != 0) {
         printf("\n%sERROR: Module not loaded!%s\n", RED, RESET);
@@ -139,6 +1197,22 @@ int main() {
     passed += test_receive_empty();
     passed += test_multiple_messages();
     passed += test_read_status();
+    passed += test_binary_device();
+    passed += test_stats_file();
+    passed += test_blocking_receive();
+    passed += test_priority_levels();
+    passed += test_fair_dequeue();
+    passed += test_named_queues();
+    passed += test_overflow_policies();
+    passed += test_latency_histograms();
+    passed += test_message_ttl();
+    passed += test_selective_receive();
+    passed += test_packed_drain();
+    passed += test_task_registry();
+    passed += test_reprioritize();
+    passed += test_numa_shards();
+    passed += test_browse_cursor();
+    passed += test_export_import();
     
     printf("\n================================================\n");
     printf("Results: %s%d/%d tests passed%s\n", 
@@ -1,11 +1,19 @@
 // Stress Test Suite for Safe Kernel Module
 // Assignment 2 - OS Fall 2025
+//
+// Timings here are end to end through /proc (open, write/read, close) and
+// use clock(), so they are coarse; bench_queue measures the queue itself.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "safe_lkm_uapi.h"
 
 #define PROC_FILE "/proc/safe_lkm"
 #define GREEN "\033[0;32m"
@@ -205,18 +213,228 @@ int test_concurrent_reads() {
     return 1;
 }
 
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int test_batch_throughput() {
+    printf("\n%s=== Stress Test 7: Batched Send/Receive Throughput ===%s\n", YELLOW, RESET);
+
+    const int total = 65536;
+    const int sizes[] = { 1, 16, 256, 4096 };
+    static struct safe_lkm_desc descs[SAFE_LKM_BATCH_MAX];
+    static char payloads[SAFE_LKM_BATCH_MAX][32];
+    int ok = 1;
+
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        perror("Failed to open " SAFE_LKM_DEV_PATH);
+        test_result("Batched throughput", 0);
+        return 0;
+    }
+
+    // Start from an empty queue so leftovers do not skew the counts
+    struct safe_lkm_batch drain = { .descs = (__u64)(unsigned long)descs,
+                                    .count = SAFE_LKM_BATCH_MAX };
+    for (int i = 0; i < SAFE_LKM_BATCH_MAX; i++) {
+        descs[i].len = sizeof(payloads[i]);
+        descs[i].buf = (__u64)(unsigned long)payloads[i];
+    }
+    while (ioctl(fd, SAFE_LKM_IOC_RECV_BATCH, &drain) > 0)
+        ;
+
+    printf("  %-8s %14s %14s\n", "batch", "send msg/s", "recv msg/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int batch = sizes[s];
+        struct safe_lkm_batch req = { .descs = (__u64)(unsigned long)descs };
+        int sent = 0, received = 0;
+
+        double start = now_sec();
+        while (sent < total) {
+            int n = batch < total - sent ? batch : total - sent;
+            for (int i = 0; i < n; i++) {
+                descs[i].pid = 50000 + i;
+                descs[i].type = (sent + i) % 10;
+                descs[i].len = snprintf(payloads[i], sizeof(payloads[i]),
+                                        "Batch_%d", sent + i);
+                descs[i].flags = 0;
+                descs[i].buf = (__u64)(unsigned long)payloads[i];
+            }
+            req.count = n;
+            int r = ioctl(fd, SAFE_LKM_IOC_SEND_BATCH, &req);
+            if (r <= 0) break;
+            sent += r;
+        }
+        double send_time = now_sec() - start;
+
+        start = now_sec();
+        while (received < sent) {
+            for (int i = 0; i < batch; i++) {
+                descs[i].len = sizeof(payloads[i]);
+                descs[i].buf = (__u64)(unsigned long)payloads[i];
+            }
+            req.count = batch;
+            int r = ioctl(fd, SAFE_LKM_IOC_RECV_BATCH, &req);
+            if (r <= 0) break;
+            received += r;
+        }
+        double recv_time = now_sec() - start;
+
+        printf("  %-8d %14.0f %14.0f\n", batch,
+               send_time > 0 ? sent / send_time : 0,
+               recv_time > 0 ? received / recv_time : 0);
+        if (sent != total || received < total) ok = 0;
+    }
+
+    close(fd);
+    test_result("Batched throughput (1/16/256/4096)", ok);
+    return ok;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time from write() in one process to a blocked read() returning in another
+int test_wakeup_latency() {
+    printf("\n%s=== Stress Test 8: Blocking Receive Wake-up Latency ===%s\n", YELLOW, RESET);
+
+    enum { SAMPLES = 1000 };
+    // The payload follows the 12-byte header directly: no double member,
+    // which would be padded to offset 16
+    struct {
+        struct safe_lkm_hdr hdr;
+        char payload[sizeof(double)];
+    } msg;
+    const ssize_t msg_len = sizeof(msg.hdr) + sizeof(msg.payload);
+    double sent_at;
+
+    int fd = open(SAFE_LKM_DEV_PATH, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        perror("Failed to open " SAFE_LKM_DEV_PATH);
+        test_result("Wake-up latency", 0);
+        return 0;
+    }
+    while (read(fd, &msg, sizeof(msg)) > 0)
+        ;
+    close(fd);
+
+    pid_t child = fork();
+    if (child == 0) {
+        static double lat[SAMPLES];
+        __s32 timeout_ms = 2000;
+        int rfd = open(SAFE_LKM_DEV_PATH, O_RDONLY);
+        int n = 0;
+
+        if (rfd < 0 || ioctl(rfd, SAFE_LKM_IOC_SET_RCVTIMEO, &timeout_ms) != 0)
+            _exit(1);
+        while (n < SAMPLES && read(rfd, &msg, sizeof(msg)) == msg_len) {
+            memcpy(&sent_at, msg.payload, sizeof(sent_at));
+            lat[n++] = (now_sec() - sent_at) * 1e6;
+        }
+        close(rfd);
+        if (n < SAMPLES) _exit(1);
+
+        qsort(lat, SAMPLES, sizeof(lat[0]), cmp_double);
+        printf("  %d wake-ups: median %.1f us, p99 %.1f us, max %.1f us\n",
+               SAMPLES, lat[SAMPLES / 2], lat[SAMPLES * 99 / 100], lat[SAMPLES - 1]);
+        _exit(0);
+    }
+
+    int wfd = open(SAFE_LKM_DEV_PATH, O_WRONLY);
+    int sent = wfd >= 0;
+    msg.hdr.pid = getpid();
+    msg.hdr.type = 1;
+    msg.hdr.len = sizeof(msg.payload);
+    for (int i = 0; i < SAMPLES && sent; i++) {
+        usleep(1000);   // let the reader go back to sleep first
+        sent_at = now_sec();
+        memcpy(msg.payload, &sent_at, sizeof(sent_at));
+        if (write(wfd, &msg, msg_len) != msg_len) {
+            perror("write");
+            sent = 0;
+        }
+    }
+    if (wfd >= 0) close(wfd);
+    test_result("Every send is accepted", sent);
+
+    int status = 1;
+    waitpid(child, &status, 0);
+    int ok = sent && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    test_result("Blocked reader receives every message", ok);
+    return ok;
+}
+
+// Value of one key in /proc/safe_lkm_stats, -1 if missing
+static long long read_stat(const char *key) {
+    FILE *fp = fopen(SAFE_LKM_STATS_PATH, "r");
+    char line[128];
+    long long value = -1;
+    size_t klen = strlen(key);
+
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, klen) == 0 && line[klen] == '=') {
+            value = atoll(line + klen + 1);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+// Time n task commands; returns microseconds per command
+static double time_task_ops(const char *op, int base, int n, int max_arg) {
+    char cmd[64];
+    double start = now_sec();
+    for (int i = 0; i < n; i++) {
+        if (op[0] == 'D')
+            snprintf(cmd, sizeof(cmd), "D %d", base + i);
+        else
+            snprintf(cmd, sizeof(cmd), "%s %d %d", op, base + i, rand() % max_arg);
+        write_proc(cmd);
+    }
+    return (now_sec() - start) * 1e6 / n;
+}
+
+// Per-command cost of the task registry should not grow with its size
+int test_task_registry_scaling() {
+    printf("\n%s=== Stress Test 9: Task Registry Scaling ===%s\n", YELLOW, RESET);
+    const int sizes[] = { 100, 1000, 10000 };
+    long long before = read_stat("tasks");
+    int ok = before >= 0;
+
+    printf("  %-8s %10s %10s %10s %10s  (us per command)\n",
+           "tasks", "create", "reprio", "migrate", "delete");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && ok; s++) {
+        int n = sizes[s], base = 100000;
+        double t = time_task_ops("T", base, n, 100);
+        int created = read_stat("tasks") == before + n;
+        double a = time_task_ops("A", base, n, 100);
+        double c = time_task_ops("C", base, n, sysconf(_SC_NPROCESSORS_CONF));
+        double d = time_task_ops("D", base, n, 1);
+        printf("  %-8d %10.1f %10.1f %10.1f %10.1f\n", n, t, a, c, d);
+        ok = created && read_stat("tasks") == before;
+    }
+    test_result("10,000 tasks created, reprioritized, migrated, removed", ok);
+    return ok;
+}
+
 int main() {
     printf("\n");
     printf("========================================\n");
     printf("  Safe Kernel Module - Stress Tests\n");
     printf("  OS Assignment 2 - Fall 2025\n");
     printf("========================================\n");
-    printf("%sWARNING: This will generate many kernel log messages%s\n\n", YELLOW, RESET);
+    printf("%sNote: per-message events are tracepoints, see safe_lkm_trace.h%s\n\n", YELLOW, RESET);
     
     srand(time(NULL));
     
     int passed = 0;
-    int total = 6;
+    int total = 9;
     
     if (access(PROC_FILE, F_OK) != 0) {
         printf("\n%sERROR: Module not loaded. Please run: sudo insmod safe_lkm.ko%s\n", RED, RESET);
@@ -229,6 +447,9 @@ int main() {
     passed += test_priority_changes();
     passed += test_mixed_operations();
     passed += test_concurrent_reads();
+    passed += test_batch_throughput();
+    passed += test_wakeup_latency();
+    passed += test_task_registry_scaling();
     
     printf("\n========================================\n");
     printf("Results: %d/%d stress tests passed\n", passed, total);